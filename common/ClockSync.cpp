@@ -0,0 +1,157 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "ClockSync.h"
+
+ClockSync::ClockSync(void):
+  filterCount(0), historyCount(0), valid(false), best(), drift(0)
+{
+  // Nothing here
+}
+
+
+
+void ClockSync::reset(void)
+{
+  filterCount = 0;
+  historyCount = 0;
+  valid = false;
+  drift = 0;
+}
+
+
+
+/*
+ * Adds the timestamps of one exchange. Returns true if the estimate was
+ * updated. localUs is t4 in the full 64 bit local clock.
+ */
+bool ClockSync::addSample(quint32 t1, quint32 t2, quint32 t3, quint32 t4, qint64 localUs)
+{
+  // Round trip time without the peer's processing time. Timer granularity
+  // can make it slightly negative on a fast link.
+  qint32 delay = (qint32)(t4 - t1) - (qint32)(t3 - t2);
+  if (delay < 0) {
+	delay = 0;
+  }
+
+  Sample sample;
+  sample.offsetUs = (t2 - t1) - (quint32)(delay / 2);
+  sample.delayUs = delay;
+  sample.localUs = localUs;
+
+  filter[filterCount % CLOCK_SYNC_FILTER_SIZE] = sample;
+  filterCount++;
+
+  // Pick the sample with the least queuing
+  int samples = qMin(filterCount, CLOCK_SYNC_FILTER_SIZE);
+  Sample *candidate = &filter[0];
+  for (int i = 1; i < samples; i++) {
+	if (filter[i].delayUs < candidate->delayUs) {
+	  candidate = &filter[i];
+	}
+  }
+
+  // Never go back to an older sample, it would mess up the drift estimate
+  if (valid && candidate->localUs <= best.localUs) {
+	return false;
+  }
+
+  best = *candidate;
+  valid = true;
+
+  history[historyCount % CLOCK_SYNC_DRIFT_SIZE] = best;
+  historyCount++;
+
+  updateDrift();
+
+  return true;
+}
+
+
+
+/*
+ * Least squares fit of the offsets of the picked samples against the local
+ * time. The offsets are handled relative to the oldest sample to keep the
+ * wrapping values in range.
+ */
+void ClockSync::updateDrift(void)
+{
+  int samples = qMin(historyCount, CLOCK_SYNC_DRIFT_SIZE);
+  if (samples < 4) {
+	return;
+  }
+
+  const Sample &ref = history[historyCount > CLOCK_SYNC_DRIFT_SIZE ? historyCount % CLOCK_SYNC_DRIFT_SIZE : 0];
+
+  double sumX = 0, sumY = 0;
+  qint64 span = 0;
+  for (int i = 0; i < samples; i++) {
+	sumX += history[i].localUs - ref.localUs;
+	sumY += (qint32)(history[i].offsetUs - ref.offsetUs);
+	span = qMax(span, history[i].localUs - ref.localUs);
+  }
+
+  if (span < CLOCK_SYNC_DRIFT_MIN_SPAN_US) {
+	return;
+  }
+
+  double meanX = sumX / samples;
+  double meanY = sumY / samples;
+  double sxy = 0, sxx = 0;
+  for (int i = 0; i < samples; i++) {
+	double x = (history[i].localUs - ref.localUs) - meanX;
+	double y = (qint32)(history[i].offsetUs - ref.offsetUs) - meanY;
+	sxy += x * y;
+	sxx += x * x;
+  }
+
+  drift = qBound(-CLOCK_SYNC_DRIFT_MAX_PPM * 1e-6, sxy / sxx, CLOCK_SYNC_DRIFT_MAX_PPM * 1e-6);
+}
+
+
+
+/*
+ * Returns the offset of the peer's clock from ours at the given local time,
+ * extrapolated from the latest picked sample with the drift.
+ */
+quint32 ClockSync::offsetUs(qint64 localUs) const
+{
+  if (!valid) {
+	return 0;
+  }
+
+  return best.offsetUs + (quint32)qRound(drift * (localUs - best.localUs));
+}
+
+
+
+/*
+ * Converts a 32 bit timestamp of the peer's clock to our clock.
+ */
+quint32 ClockSync::toLocal(quint32 peerUs, qint64 localUs) const
+{
+  return peerUs - offsetUs(localUs);
+}
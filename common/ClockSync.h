@@ -0,0 +1,87 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _CLOCKSYNC_H
+#define _CLOCKSYNC_H
+
+#include <QtGlobal>
+
+// Number of latest exchanges the sample with the smallest delay is picked from
+#define CLOCK_SYNC_FILTER_SIZE        8
+
+// Number of picked samples the drift is fitted over
+#define CLOCK_SYNC_DRIFT_SIZE         16
+
+// Min time span of the picked samples for a drift estimate
+#define CLOCK_SYNC_DRIFT_MIN_SPAN_US  10000000
+
+// Larger drift is a bad estimate, real oscillators are within ~100 ppm
+#define CLOCK_SYNC_DRIFT_MAX_PPM      500
+
+/*
+ * Estimates the offset and drift of the peer's clock from NTP style
+ * timestamp exchanges: t1 sent (our clock), t2 received (peer's clock),
+ * t3 replied (peer's clock) and t4 reply received (our clock).
+ *
+ * Exchanges delayed by queuing in one direction give an offset off by half
+ * of the asymmetry, so only the sample with the smallest round trip delay
+ * of the latest exchanges is used (NTP clock filter). The drift is a least
+ * squares fit of the offsets of the picked samples.
+ *
+ * The timestamps are microseconds truncated to 32 bits and the offset is
+ * the peer's clock minus ours, modulo 2^32.
+ */
+class ClockSync
+{
+ public:
+  ClockSync(void);
+  void reset(void);
+  bool addSample(quint32 t1, quint32 t2, quint32 t3, quint32 t4, qint64 localUs);
+  bool isValid(void) const { return valid; }
+  quint32 offsetUs(qint64 localUs) const;
+  quint32 toLocal(quint32 peerUs, qint64 localUs) const;
+  double driftPpm(void) const { return drift * 1e6; }
+  int accuracyUs(void) const { return valid ? best.delayUs / 2 : -1; }
+
+ private:
+  struct Sample {
+	quint32 offsetUs;
+	qint32 delayUs;
+	qint64 localUs;
+  };
+
+  void updateDrift(void);
+
+  Sample filter[CLOCK_SYNC_FILTER_SIZE];
+  int filterCount;
+  Sample history[CLOCK_SYNC_DRIFT_SIZE];
+  int historyCount;
+  bool valid;
+  Sample best;
+  double drift;
+};
+
+#endif
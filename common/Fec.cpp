@@ -0,0 +1,473 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "Fec.h"
+#include "Log.h"
+
+#include <QDebug>
+
+#include <string.h>                          /* memset */
+
+// GF(2^8) with the generator polynomial x^8 + x^4 + x^3 + x^2 + 1
+static quint8 gfExp[512];
+static int gfLog[256];
+static bool gfInitialised = false;
+
+
+
+static void gfInit(void)
+{
+  if (gfInitialised) {
+	return;
+  }
+
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+	gfExp[i] = x;
+	gfLog[x] = i;
+	x <<= 1;
+	if (x & 0x100) {
+	  x ^= 0x11d;
+	}
+  }
+
+  // Double the exp table to avoid modulo in multiplication
+  for (int i = 255; i < 512; i++) {
+	gfExp[i] = gfExp[i - 255];
+  }
+
+  gfLog[0] = -1;
+  gfInitialised = true;
+}
+
+
+
+static inline quint8 gfMul(quint8 a, quint8 b)
+{
+  if (a == 0 || b == 0) {
+	return 0;
+  }
+
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+
+
+static inline quint8 gfInv(quint8 a)
+{
+  return gfExp[255 - gfLog[a]];
+}
+
+
+
+/*
+ * Grow the block to the given size, zero padding the new bytes
+ */
+static void growBlock(QByteArray &block, int size)
+{
+  int old = block.size();
+
+  if (old >= size) {
+	return;
+  }
+
+  block.resize(size);
+  memset(block.data() + old, 0, size - old);
+}
+
+
+
+/*
+ * Add coef * src to the block starting from offset. coef 1 is plain XOR.
+ */
+static void accumulate(QByteArray &block, int offset, const quint8 *src, int length, quint8 coef)
+{
+  quint8 *dst = (quint8 *)block.data() + offset;
+
+  if (coef == 1) {
+	for (int i = 0; i < length; i++) {
+	  dst[i] ^= src[i];
+	}
+	return;
+  }
+
+  for (int i = 0; i < length; i++) {
+	dst[i] ^= gfMul(src[i], coef);
+  }
+}
+
+
+
+FecEncoder::FecEncoder():
+  groupSize(0), parities(0), added(0), base(0)
+{
+  gfInit();
+}
+
+
+
+FecEncoder::~FecEncoder()
+{
+  // Nothing here
+}
+
+
+
+/*
+ * Set the number of media messages in a group and the number of parity
+ * messages sent after each group. Zero parity count disables FEC.
+ */
+void FecEncoder::setGroup(int newGroupSize, int parityCount)
+{
+  if (parityCount != 0 &&
+	  (newGroupSize < 2 || newGroupSize > FEC_MAX_GROUP_SIZE ||
+	   parityCount < 0 || parityCount > FEC_MAX_PARITY)) {
+	qWarning() << __FUNCTION__ << ": Invalid FEC group" << newGroupSize << "/" << parityCount << ", disabling FEC";
+	parityCount = 0;
+  }
+
+  groupSize = newGroupSize;
+  parities = parityCount;
+  added = 0;
+}
+
+
+
+bool FecEncoder::isEnabled(void)
+{
+  return parities > 0;
+}
+
+
+
+/*
+ * Add a media message to the current group. The data is the message without
+ * the common header. Returns true when the group is complete and the parity
+ * data is available.
+ */
+bool FecEncoder::add(quint16 seq, const char *data, int length)
+{
+  return add(seq, data, length, NULL, 0);
+}
+
+
+
+/*
+ * Adds a message whose protected data is in two parts, e.g. a header and a
+ * payload sent from separate buffers. Same as adding the concatenated data.
+ */
+bool FecEncoder::add(quint16 seq, const char *header, int headerLength,
+					 const char *payload, int payloadLength)
+{
+  int length = headerLength + payloadLength;
+
+  if (!isEnabled()) {
+	return false;
+  }
+
+  // Groups must consist of consecutive messages, start a new one on a gap
+  if (added > 0 && seq != (quint16)(base + added)) {
+	added = 0;
+  }
+
+  if (added == 0) {
+	base = seq;
+	for (int i = 0; i < parities; i++) {
+	  parityData[i].clear();
+	}
+  }
+
+  // The block protected by the parity is the data prefixed with its length
+  quint8 len[2];
+  len[0] = (quint8)((length & 0xff00) >> 8);
+  len[1] = (quint8)((length & 0x00ff) >> 0);
+
+  for (int i = 0; i < parities; i++) {
+	quint8 coef = (i == 0) ? 1 : gfExp[added];
+
+	growBlock(parityData[i], 2 + length);
+	accumulate(parityData[i], 0, len, 2, coef);
+	accumulate(parityData[i], 2, (const quint8 *)header, headerLength, coef);
+	if (payloadLength > 0) {
+	  accumulate(parityData[i], 2 + headerLength, (const quint8 *)payload, payloadLength, coef);
+	}
+  }
+
+  if (++added < groupSize) {
+	return false;
+  }
+
+  added = 0;
+  return true;
+}
+
+
+
+quint16 FecEncoder::baseSeq(void)
+{
+  return base;
+}
+
+
+
+quint8 FecEncoder::count(void)
+{
+  return groupSize;
+}
+
+
+
+quint8 FecEncoder::parityCount(void)
+{
+  return parities;
+}
+
+
+
+QByteArray *FecEncoder::parity(int index)
+{
+  return &parityData[index];
+}
+
+
+
+FecDecoder::FecDecoder():
+  nextGroup(0)
+{
+  gfInit();
+
+  for (int i = 0; i < FEC_WINDOW_SIZE; i++) {
+	window[i].valid = false;
+  }
+
+  for (int i = 0; i < FEC_MAX_GROUPS; i++) {
+	groups[i].valid = false;
+  }
+}
+
+
+
+FecDecoder::~FecDecoder()
+{
+  // Nothing here
+}
+
+
+
+/*
+ * Store a received media message for possible later recovery. Returns false
+ * if the message has already been received (or recovered).
+ */
+bool FecDecoder::add(quint16 seq, const char *data, int length)
+{
+  Entry *entry = &window[seq % FEC_WINDOW_SIZE];
+
+  if (entry->valid && entry->seq == seq) {
+	return false;
+  }
+
+  entry->valid = true;
+  entry->seq = seq;
+  entry->data.resize(2 + length);
+  entry->data[0] = (quint8)((length & 0xff00) >> 8);
+  entry->data[1] = (quint8)((length & 0x00ff) >> 0);
+  memcpy(entry->data.data() + 2, data, length);
+
+  return true;
+}
+
+
+
+/*
+ * Store a received parity message and try to recover the missing media
+ * messages of all pending groups.
+ */
+QList<FecDecoder::Recovered> FecDecoder::addParity(quint16 baseSeq, quint8 count, quint8 index,
+												   const char *data, int length)
+{
+  QList<Recovered> recovered;
+
+  if (count < 2 || count > FEC_MAX_GROUP_SIZE || index >= FEC_MAX_PARITY) {
+	qWarning() << __FUNCTION__ << ": Invalid FEC group" << count << ", parity" << index;
+	return recovered;
+  }
+
+  // Find the group or replace the oldest one
+  int group = -1;
+  for (int i = 0; i < FEC_MAX_GROUPS; i++) {
+	if (groups[i].valid && groups[i].baseSeq == baseSeq && groups[i].count == count) {
+	  group = i;
+	  break;
+	}
+  }
+
+  if (group == -1) {
+	group = nextGroup;
+	nextGroup = (nextGroup + 1) % FEC_MAX_GROUPS;
+
+	groups[group].valid = true;
+	groups[group].baseSeq = baseSeq;
+	groups[group].count = count;
+	for (int i = 0; i < FEC_MAX_PARITY; i++) {
+	  groups[group].hasParity[i] = false;
+	  groups[group].parity[i].clear();
+	}
+  }
+
+  groups[group].hasParity[index] = true;
+  groups[group].parity[index] = QByteArray(data, length);
+
+  for (int i = 0; i < FEC_MAX_GROUPS; i++) {
+	if (groups[i].valid) {
+	  recovered.append(recover(i));
+	}
+  }
+
+  return recovered;
+}
+
+
+
+QList<FecDecoder::Recovered> FecDecoder::recover(int g)
+{
+  QList<Recovered> recovered;
+  Group *group = &groups[g];
+
+  int missing[FEC_MAX_PARITY];
+  int missingCount = 0;
+
+  for (int i = 0; i < group->count; i++) {
+	quint16 seq = group->baseSeq + i;
+	Entry *entry = &window[seq % FEC_WINDOW_SIZE];
+
+	if (entry->valid && entry->seq == seq) {
+	  continue;
+	}
+
+	// Too many lost to be recovered (at least for now)
+	if (missingCount == FEC_MAX_PARITY) {
+	  return recovered;
+	}
+	missing[missingCount++] = i;
+  }
+
+  // Nothing lost, the group is done
+  if (missingCount == 0) {
+	group->valid = false;
+	return recovered;
+  }
+
+  int parityCount = (group->hasParity[0] ? 1 : 0) + (group->hasParity[1] ? 1 : 0);
+  if (parityCount < missingCount) {
+	return recovered;
+  }
+
+  // Remove the received data from the parities (zero padding is implicit)
+  QByteArray parity[FEC_MAX_PARITY];
+  for (int p = 0; p < FEC_MAX_PARITY; p++) {
+	if (!group->hasParity[p]) {
+	  continue;
+	}
+
+	parity[p] = group->parity[p];
+
+	for (int i = 0; i < group->count; i++) {
+	  if (i == missing[0] || (missingCount > 1 && i == missing[1])) {
+		continue;
+	  }
+
+	  Entry *entry = &window[(quint16)(group->baseSeq + i) % FEC_WINDOW_SIZE];
+	  int length = qMin(entry->data.size(), parity[p].size());
+	  accumulate(parity[p], 0, (const quint8 *)entry->data.constData(), length, p == 0 ? 1 : gfExp[i]);
+	}
+  }
+
+  QByteArray block[FEC_MAX_PARITY];
+
+  if (missingCount == 1) {
+	int x = missing[0];
+
+	if (group->hasParity[0]) {
+	  // P alone: the XOR of the others is the missing one
+	  block[0] = parity[0];
+	} else {
+	  // Q alone: divide out the coefficient of the missing one
+	  block[0] = parity[1];
+	  quint8 inv = gfInv(gfExp[x]);
+	  quint8 *d = (quint8 *)block[0].data();
+	  for (int j = 0; j < block[0].size(); j++) {
+		d[j] = gfMul(d[j], inv);
+	  }
+	}
+  } else {
+	// P = Dx + Dy, Q = g^x Dx + g^y Dy => Dx = (Q + g^y P) / (g^x + g^y)
+	int x = missing[0];
+	int y = missing[1];
+	int length = qMin(parity[0].size(), parity[1].size());
+	quint8 gy = gfExp[y];
+	quint8 inv = gfInv(gfExp[x] ^ gfExp[y]);
+
+	block[0].resize(length);
+	block[1].resize(length);
+
+	const quint8 *p = (const quint8 *)parity[0].constData();
+	const quint8 *q = (const quint8 *)parity[1].constData();
+	quint8 *dx = (quint8 *)block[0].data();
+	quint8 *dy = (quint8 *)block[1].data();
+
+	for (int j = 0; j < length; j++) {
+	  dx[j] = gfMul(q[j] ^ gfMul(gy, p[j]), inv);
+	  dy[j] = p[j] ^ dx[j];
+	}
+  }
+
+  for (int m = 0; m < missingCount; m++) {
+	quint16 seq = group->baseSeq + missing[m];
+
+	// Strip the length prefix
+	if (block[m].size() < 2) {
+	  continue;
+	}
+	int length = ((quint8)block[m].at(0) << 8) + (quint8)block[m].at(1);
+	if (length > block[m].size() - 2) {
+	  qWarning() << __FUNCTION__ << ": Invalid recovered length" << length << "for seq" << seq;
+	  continue;
+	}
+
+	Recovered r;
+	r.seq = seq;
+	r.data = block[m].mid(2, length);
+
+	add(seq, r.data.constData(), r.data.size());
+	recovered.append(r);
+  }
+
+  group->valid = false;
+
+  logDebug(LOG_MEDIA) << __FUNCTION__ << ": Recovered" << recovered.size() << "media messages";
+
+  return recovered;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _FEC_H
+#define _FEC_H
+
+#include <QByteArray>
+#include <QList>
+
+// Max number of media messages protected by one group of parity messages
+#define FEC_MAX_GROUP_SIZE            32
+
+// Max number of parity messages per group. P is a plain XOR over the group,
+// Q is a Reed-Solomon syndrome over GF(2^8) (as in RAID-6). One parity
+// recovers one lost message, both together recover any two.
+#define FEC_MAX_PARITY                2
+
+// Number of received media messages kept for recovery
+#define FEC_WINDOW_SIZE               128
+
+// Number of groups whose parity is kept while waiting for the media
+#define FEC_MAX_GROUPS                4
+
+class FecEncoder
+{
+ public:
+  FecEncoder();
+  ~FecEncoder();
+  void setGroup(int groupSize, int parityCount);
+  bool isEnabled(void);
+  bool add(quint16 seq, const char *data, int length);
+  bool add(quint16 seq, const char *header, int headerLength,
+		   const char *payload, int payloadLength);
+  quint16 baseSeq(void);
+  quint8 count(void);
+  quint8 parityCount(void);
+  QByteArray *parity(int index);
+
+ private:
+  int groupSize;
+  int parities;
+  int added;
+  quint16 base;
+  QByteArray parityData[FEC_MAX_PARITY];
+};
+
+class FecDecoder
+{
+ public:
+
+  // Media message restored from parity
+  struct Recovered {
+	quint16 seq;
+	QByteArray data;
+  };
+
+  FecDecoder();
+  ~FecDecoder();
+  bool add(quint16 seq, const char *data, int length);
+  QList<Recovered> addParity(quint16 baseSeq, quint8 count, quint8 index,
+							 const char *data, int length);
+
+ private:
+  QList<Recovered> recover(int group);
+
+  struct Entry {
+	bool valid;
+	quint16 seq;
+	QByteArray data;
+  };
+
+  struct Group {
+	bool valid;
+	quint16 baseSeq;
+	quint8 count;
+	bool hasParity[FEC_MAX_PARITY];
+	QByteArray parity[FEC_MAX_PARITY];
+  };
+
+  Entry window[FEC_WINDOW_SIZE];
+  Group groups[FEC_MAX_GROUPS];
+  int nextGroup;
+};
+
+#endif
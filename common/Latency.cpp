@@ -0,0 +1,183 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "Latency.h"
+
+#include <QStringList>
+
+LatencyHistogram::LatencyHistogram(void):
+  samples(0), sumUs(0), maxUs(0)
+{
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+	buckets[i] = 0;
+  }
+}
+
+
+
+void LatencyHistogram::add(qint64 us)
+{
+  // Negative samples come from clock offset errors
+  if (us < 0) {
+	us = 0;
+  }
+
+  // Bucket i holds samples below 2^i us
+  int bucket = 0;
+  while (bucket < LATENCY_HISTOGRAM_BUCKETS - 1 && (us >> bucket) > 0) {
+	bucket++;
+  }
+
+  buckets[bucket]++;
+  samples++;
+  sumUs += us;
+  if (us > maxUs) {
+	maxUs = us;
+  }
+}
+
+
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+	buckets[i] += other.buckets[i];
+  }
+
+  samples += other.samples;
+  sumUs += other.sumUs;
+  maxUs = qMax(maxUs, other.maxUs);
+}
+
+
+
+void LatencyHistogram::clear(void)
+{
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+	buckets[i] = 0;
+  }
+
+  samples = 0;
+  sumUs = 0;
+  maxUs = 0;
+}
+
+
+
+qint64 LatencyHistogram::mean(void) const
+{
+  return samples ? sumUs / samples : 0;
+}
+
+
+
+/*
+ * Returns the upper bound of the bucket holding the given percentile.
+ */
+qint64 LatencyHistogram::percentile(int percent) const
+{
+  if (samples == 0) {
+	return 0;
+  }
+
+  qint64 target = ((qint64)samples * percent + 99) / 100;
+  qint64 seen = 0;
+
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+	seen += buckets[i];
+	if (seen >= target) {
+	  return qMin((qint64)1 << i, maxUs);
+	}
+  }
+
+  return maxUs;
+}
+
+
+
+QString LatencyHistogram::toString(void) const
+{
+  if (samples == 0) {
+	return "-";
+  }
+
+  return QString::number(mean() / 1000.0, 'f', 1) + " ms (p95 " +
+	QString::number(percentile(95) / 1000.0, 'f', 1) + ", max " +
+	QString::number(maxUs / 1000.0, 'f', 1) + ")";
+}
+
+
+
+void LatencyStats::add(const LatencyStats &other)
+{
+  for (int i = 0; i < LATENCY_STAGES; i++) {
+	stage[i].add(other.stage[i]);
+  }
+}
+
+
+
+void LatencyStats::clear(void)
+{
+  for (int i = 0; i < LATENCY_STAGES; i++) {
+	stage[i].clear();
+  }
+}
+
+
+
+QString LatencyStats::toString(void) const
+{
+  QStringList list;
+
+  for (int i = 0; i < LATENCY_STAGES; i++) {
+	list.append(stageName(i) + ": " + stage[i].toString());
+  }
+
+  return list.join("\n");
+}
+
+
+
+QString LatencyStats::stageName(int stage)
+{
+  switch (stage) {
+  case LATENCY_CAPTURE_TO_ENCODE:
+	return QString("Capture-encode");
+  case LATENCY_ENCODE_TO_SEND:
+	return QString("Encode-send");
+  case LATENCY_NETWORK:
+	return QString("Network");
+  case LATENCY_JITTERBUFFER:
+	return QString("Jitterbuffer");
+  case LATENCY_DECODE:
+	return QString("Decode");
+  case LATENCY_DISPLAY:
+	return QString("Receive-display");
+  default:
+	return QString("UNKNOWN") + "(" +  QString::number(stage) + ")";
+  }
+}
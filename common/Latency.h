@@ -0,0 +1,86 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <QString>
+
+// Stages of the video from the camera to the display
+enum {
+  LATENCY_CAPTURE_TO_ENCODE,     // Slave: capture to encoded frame in appsink
+  LATENCY_ENCODE_TO_SEND,        // Slave: appsink to written to the socket
+  LATENCY_NETWORK,               // Sent to received, clock offset corrected
+  LATENCY_JITTERBUFFER,          // Controller: appsrc to jitterbuffer output
+  LATENCY_DECODE,                // Controller: decoder input to output
+  LATENCY_DISPLAY,               // Controller: appsrc to handed to the video sink
+  LATENCY_STAGES
+};
+
+// Buckets are powers of two microseconds, the last one holds everything
+// from ~4 s up
+#define LATENCY_HISTOGRAM_BUCKETS     23
+
+/*
+ * Histogram of latency samples with logarithmic buckets. Adding a sample is
+ * cheap enough for the per packet paths.
+ */
+class LatencyHistogram
+{
+ public:
+  LatencyHistogram(void);
+  void add(qint64 us);
+  void add(const LatencyHistogram &other);
+  void clear(void);
+  int count(void) const { return samples; }
+  qint64 mean(void) const;
+  qint64 percentile(int percent) const;
+  qint64 max(void) const { return maxUs; }
+  QString toString(void) const;
+
+ private:
+  quint32 buckets[LATENCY_HISTOGRAM_BUCKETS];
+  int samples;
+  qint64 sumUs;
+  qint64 maxUs;
+};
+
+/*
+ * Latency histograms of all the stages. Collected during one reporting
+ * period and passed on as a whole.
+ */
+class LatencyStats
+{
+ public:
+  void add(const LatencyStats &other);
+  void clear(void);
+  QString toString(void) const;
+  static QString stageName(int stage);
+
+  LatencyHistogram stage[LATENCY_STAGES];
+};
+
+#endif
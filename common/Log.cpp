@@ -0,0 +1,94 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "Log.h"
+
+#include <stdlib.h>                          /* getenv */
+#include <string.h>                          /* strchr, strncmp */
+
+static const struct {
+  const char *name;
+  quint32 category;
+} categoryNames[] = {
+  { "net",   LOG_NET },
+  { "msg",   LOG_MSG },
+  { "media", LOG_MEDIA },
+  { "video", LOG_VIDEO },
+  { "hw",    LOG_HW },
+  { "app",   LOG_APP },
+  { "all",   LOG_ALL },
+  { "none",  0 },
+};
+
+quint32 logCategories = logParseCategories(getenv("PLECO_LOG"));
+
+
+
+void logSetCategories(quint32 categories)
+{
+  logCategories = categories;
+}
+
+
+
+/*
+ * Returns the categories in a comma separated list of names. Returns all
+ * categories, if names is NULL.
+ */
+quint32 logParseCategories(const char *names)
+{
+  if (!names) {
+	return LOG_ALL;
+  }
+
+  quint32 categories = 0;
+  const char *start = names;
+
+  while (*start) {
+	const char *end = strchr(start, ',');
+	int len = end ? end - start : strlen(start);
+	bool found = false;
+
+	for (unsigned int i = 0; i < sizeof(categoryNames) / sizeof(categoryNames[0]); i++) {
+	  if ((int)strlen(categoryNames[i].name) == len && strncmp(categoryNames[i].name, start, len) == 0) {
+		categories |= categoryNames[i].category;
+		found = true;
+		break;
+	  }
+	}
+
+	if (!found && len > 0) {
+	  qWarning("%s: Unknown log category: %.*s", __FUNCTION__, len, start);
+	}
+
+	if (!end) {
+	  break;
+	}
+	start = end + 1;
+  }
+
+  return categories;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <QDebug>
+
+/*
+ * Logging for the hot paths. A message is written only if its level is
+ * enabled at compile time and its category at run time. Otherwise the
+ * arguments are not evaluated, and with a disabled level the statement is
+ * removed by the compiler.
+ *
+ * Usage: logTrace(LOG_NET) << "in" << __FUNCTION__;
+ *
+ * Warnings and errors always use qWarning() and qCritical().
+ */
+
+// Log levels
+#define LOG_LEVEL_NONE                0
+#define LOG_LEVEL_INFO                1
+#define LOG_LEVEL_DEBUG               2
+#define LOG_LEVEL_TRACE               3 // Per packet messages
+
+// Highest level compiled in. Override with e.g. DEFINES += LOG_LEVEL=3
+#ifndef LOG_LEVEL
+#ifdef QT_NO_DEBUG
+#define LOG_LEVEL                     LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL                     LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// Log categories, bits of logCategories
+#define LOG_NET                       0x01 // Transmitter sockets and resends
+#define LOG_MSG                       0x02 // Message parsing and CRCs
+#define LOG_MEDIA                     0x04 // Media fragments and FEC
+#define LOG_VIDEO                     0x08 // Video pipelines
+#define LOG_HW                        0x10 // Control board and camera
+#define LOG_APP                       0x20 // Slave and controller logic
+#define LOG_ALL                       0xff
+
+// Categories enabled at run time. Initialised from the PLECO_LOG environment
+// variable, a comma separated list of category names (e.g. "net,media").
+// All categories are enabled, if not set.
+extern quint32 logCategories;
+
+void logSetCategories(quint32 categories);
+quint32 logParseCategories(const char *names);
+
+#define LOG_ENABLED(level, category) \
+  (LOG_LEVEL >= (level) && (logCategories & (category)))
+
+// Turns the stream into void for the conditional expression of LOG_STREAM
+class LogVoidify
+{
+ public:
+  void operator&(const QDebug &) {}
+};
+
+// A single expression, so that it can be used in an unbraced if-else. The
+// streamed arguments bind tighter than &, so they are evaluated only if the
+// message is written.
+#define LOG_STREAM(level, category) \
+  !LOG_ENABLED(level, category) ? (void)0 : LogVoidify() & qDebug()
+
+#define logInfo(category)             LOG_STREAM(LOG_LEVEL_INFO, category)
+#define logDebug(category)            LOG_STREAM(LOG_LEVEL_DEBUG, category)
+#define logTrace(category)            LOG_STREAM(LOG_LEVEL_TRACE, category)
+
+#endif
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "MediaBuffer.h"
+
+
+/*
+ * Allocates a buffer of the given length.
+ */
+MediaBuffer::MediaBuffer(int length):
+  refCount(1), bufData(new char[length]), bufLength(length), owned(true),
+  release(NULL), userData(NULL), parent(NULL), captureTime(0), encodeTime(0)
+{
+}
+
+
+
+/*
+ * Wraps existing memory. The release function (if any) is called with
+ * userData once the buffer is no longer referenced.
+ */
+MediaBuffer::MediaBuffer(char *data, int length, ReleaseFunc release, void *userData):
+  refCount(1), bufData(data), bufLength(length), owned(false),
+  release(release), userData(userData), parent(NULL), captureTime(0), encodeTime(0)
+{
+}
+
+
+
+MediaBuffer::~MediaBuffer()
+{
+  if (owned) {
+	delete[] bufData;
+  }
+
+  if (release) {
+	release(userData);
+  }
+
+  if (parent) {
+	parent->unref();
+  }
+}
+
+
+
+/*
+ * Wraps a QByteArray without copying it. Takes the ownership of the array.
+ */
+MediaBuffer *MediaBuffer::fromByteArray(QByteArray *array)
+{
+  return new MediaBuffer(array->data(), array->size(), &MediaBuffer::releaseByteArray, array);
+}
+
+
+
+void MediaBuffer::releaseByteArray(void *userData)
+{
+  delete (QByteArray *)userData;
+}
+
+
+
+/*
+ * Returns a new buffer referring to a part of this buffer. This buffer is
+ * kept alive until the slice is released.
+ */
+MediaBuffer *MediaBuffer::slice(int offset, int length)
+{
+  Q_ASSERT(offset >= 0 && length >= 0 && offset + length <= bufLength);
+
+  MediaBuffer *s = new MediaBuffer(bufData + offset, length, NULL, NULL);
+
+  ref();
+  s->parent = this;
+
+  return s;
+}
+
+
+
+void MediaBuffer::ref(void)
+{
+  refCount.ref();
+}
+
+
+
+void MediaBuffer::unref(void)
+{
+  if (!refCount.deref()) {
+	delete this;
+  }
+}
+
+
+
+/*
+ * Returns true, if someone else holds a reference to this buffer (e.g. a
+ * slice given to the application). The data must not be modified then.
+ */
+bool MediaBuffer::isShared(void)
+{
+  return refCount.load() > 1;
+}
+
+
+
+// Each pool block starts with the pool pointer, aligned for the data
+#define POOL_BLOCK_HEADER 16
+
+MediaBufferPool::MediaBufferPool(int blockSize, int maxFree):
+  refCount(1), size(blockSize), maxFree(maxFree), mutex(), freeBlocks()
+{
+  freeBlocks.reserve(maxFree);
+}
+
+
+
+MediaBufferPool::~MediaBufferPool()
+{
+  for (int i = 0; i < freeBlocks.size(); i++) {
+	delete[] freeBlocks[i];
+  }
+}
+
+
+
+/*
+ * Returns a buffer of the block size, reusing a free block if there is one.
+ */
+MediaBuffer *MediaBufferPool::get(void)
+{
+  char *block = NULL;
+
+  mutex.lock();
+  if (!freeBlocks.isEmpty()) {
+	block = freeBlocks.last();
+	freeBlocks.removeLast();
+  }
+  mutex.unlock();
+
+  if (!block) {
+	block = new char[POOL_BLOCK_HEADER + size];
+	*(MediaBufferPool **)block = this;
+  }
+
+  ref();
+
+  return new MediaBuffer(block + POOL_BLOCK_HEADER, size, &MediaBufferPool::releaseBlock, block);
+}
+
+
+
+void MediaBufferPool::ref(void)
+{
+  refCount.ref();
+}
+
+
+
+void MediaBufferPool::unref(void)
+{
+  if (!refCount.deref()) {
+	delete this;
+  }
+}
+
+
+
+/*
+ * Returns the block of a released buffer to its pool. Blocks beyond the
+ * free list size are freed.
+ */
+void MediaBufferPool::releaseBlock(void *userData)
+{
+  char *block = (char *)userData;
+  MediaBufferPool *pool = *(MediaBufferPool **)block;
+
+  pool->mutex.lock();
+  if (pool->freeBlocks.size() < pool->maxFree) {
+	pool->freeBlocks.append(block);
+	block = NULL;
+  }
+  pool->mutex.unlock();
+
+  delete[] block;
+
+  pool->unref();
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _MEDIABUFFER_H
+#define _MEDIABUFFER_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QMutex>
+#include <QVector>
+
+/*
+ * Reference counted block of media data. A buffer either owns its memory or
+ * wraps memory owned by someone else (e.g. a GstBuffer), in which case the
+ * release function is called when the last reference is dropped. Slices
+ * refer to a part of another buffer without copying it and keep it alive.
+ *
+ * A new buffer has one reference. Buffers passed in signals carry one
+ * reference, which the receiver must drop with unref().
+ */
+class MediaBuffer
+{
+ public:
+  typedef void (*ReleaseFunc)(void *userData);
+
+  MediaBuffer(int length);
+  MediaBuffer(char *data, int length, ReleaseFunc release, void *userData);
+  static MediaBuffer *fromByteArray(QByteArray *array);
+
+  MediaBuffer *slice(int offset, int length);
+  void ref(void);
+  void unref(void);
+  bool isShared(void);
+
+  char *data(void) { return bufData; }
+  int length(void) { return bufLength; }
+
+  // Capture and encode times of the media (monotonicUs()), 0 if not known
+  void setTimestamps(qint64 captureUs, qint64 encodeUs) { captureTime = captureUs; encodeTime = encodeUs; }
+  qint64 captureUs(void) { return captureTime; }
+  qint64 encodeUs(void) { return encodeTime; }
+
+ private:
+  ~MediaBuffer();
+  MediaBuffer(const MediaBuffer &);
+  MediaBuffer &operator=(const MediaBuffer &);
+
+  static void releaseByteArray(void *userData);
+
+  QAtomicInt refCount;
+  char *bufData;
+  int bufLength;
+  bool owned;
+  ReleaseFunc release;
+  void *userData;
+  MediaBuffer *parent;
+  qint64 captureTime;
+  qint64 encodeTime;
+};
+
+
+
+/*
+ * Free list of equally sized memory blocks for buffers that are allocated
+ * at a high rate, e.g. the received datagrams. A released buffer returns its
+ * block to the pool from any thread. Each block keeps the pool alive, so the
+ * owner drops its reference with unref() instead of deleting the pool.
+ */
+class MediaBufferPool
+{
+ public:
+  MediaBufferPool(int blockSize, int maxFree);
+
+  MediaBuffer *get(void);
+  int blockSize(void) { return size; }
+
+  void ref(void);
+  void unref(void);
+
+ private:
+  ~MediaBufferPool();
+  MediaBufferPool(const MediaBufferPool &);
+  MediaBufferPool &operator=(const MediaBufferPool &);
+
+  static void releaseBlock(void *userData);
+
+  QAtomicInt refCount;
+  int size;
+  int maxFree;
+  QMutex mutex;
+  QVector<char *> freeBlocks;
+};
+
+#endif
@@ -25,6 +25,9 @@
  */
 
 #include "Message.h"
+#include "MessageView.h"
+#include "Log.h"
+#include "Crc16.h"
 
 #include <QDebug>
 
@@ -32,12 +35,18 @@
 
 static quint16 seqs[MSG_TYPE_SUBTYPE_MAX] = {0};
 
+static const struct {
+  quint8 subType;
+  int policy;
+  int deadlineMs;
+} deliveryPolicies[] = MSG_DELIVERY_POLICIES;
+
 Message::Message(QByteArray data):
   bytearray(data)
 {
   //qDebug() << "in" << __FUNCTION__;
 
-  qDebug() << __FUNCTION__ << ": Created a message with type " << getTypeStr((quint8)bytearray.at(TYPE_OFFSET_TYPE))
+  logTrace(LOG_MSG) << __FUNCTION__ << ": Created a message with type " << getTypeStr((quint8)bytearray.at(TYPE_OFFSET_TYPE))
 		   << ", length: " << data.length();
 }
 
@@ -61,7 +70,7 @@ Message::Message(quint8 type, quint8 subType):
   
   setCRC();
 
-  qDebug() << __FUNCTION__ << ": Created a message with type" << getTypeStr((quint8)bytearray.at(TYPE_OFFSET_TYPE))
+  logTrace(LOG_MSG) << __FUNCTION__ << ": Created a message with type" << getTypeStr((quint8)bytearray.at(TYPE_OFFSET_TYPE))
 		   << ", sub type" << getSubTypeStr((quint8)bytearray.at(TYPE_OFFSET_SUBTYPE));
 }
 
@@ -74,7 +83,7 @@ Message::~Message()
 
 
 
-void Message::setACK(Message &msg)
+void Message::setACK(MessageView &msg)
 {
 
   quint8 type = msg.type();
@@ -89,15 +98,74 @@ void Message::setACK(Message &msg)
   bytearray[TYPE_OFFSET_ACKED_SUBTYPE] = subType;
 
   // Copy the CRC of the message we are acking
-  QByteArray *data = msg.data();
-  bytearray[TYPE_OFFSET_ACKED_CRC + 0] = (*data)[TYPE_OFFSET_CRC + 0];
-  bytearray[TYPE_OFFSET_ACKED_CRC + 1] = (*data)[TYPE_OFFSET_CRC + 1];
+  const char *data = msg.data();
+  bytearray[TYPE_OFFSET_ACKED_CRC + 0] = data[TYPE_OFFSET_CRC + 0];
+  bytearray[TYPE_OFFSET_ACKED_CRC + 1] = data[TYPE_OFFSET_CRC + 1];
 
   setCRC(); 
 }
 
 
 
+/*
+ * Extends the ACK of a ping with the echoed send time of the ping and our
+ * receive and send times. The peer calculates the clock offset from these.
+ */
+void Message::setAckPingTimes(quint32 pingUs, quint32 receiveUs, quint32 sendUs)
+{
+  bytearray.resize(MSG_PING_ACK_LENGTH);
+
+  setQuint32(TYPE_OFFSET_ACK_PING_TIME, pingUs);
+  setQuint32(TYPE_OFFSET_ACK_RECEIVE_TIME, receiveUs);
+  setQuint32(TYPE_OFFSET_ACK_SEND_TIME, sendUs);
+}
+
+
+
+/*
+ * Removes the ACK map appended to a message, e.g. before resending it with
+ * a fresh one.
+ */
+void Message::clearAckMap(void)
+{
+  if (canCarryAckMap(type())) {
+	bytearray.resize(length(type()));
+  }
+}
+
+
+
+/*
+ * Adds an entry to the ACK map of an ACK map message, or to the map
+ * appended after the fixed length part of other messages.
+ */
+void Message::addAckMapEntry(quint16 fullType, quint16 seq, quint16 bitmap, quint16 delayUs)
+{
+  int offset = (type() == MSG_TYPE_ACK_MAP) ? TYPE_OFFSET_PAYLOAD : length(type());
+
+  Q_ASSERT(type() == MSG_TYPE_ACK_MAP || canCarryAckMap(type()));
+
+  if (bytearray.size() <= offset) {
+	bytearray.resize(offset + ACK_MAP_OFFSET_ENTRIES);
+	bytearray[offset + ACK_MAP_OFFSET_COUNT] = 0;
+  }
+
+  quint8 count = bytearray.at(offset + ACK_MAP_OFFSET_COUNT);
+  Q_ASSERT(count < ACK_MAP_MAX_ENTRIES);
+
+  int entry = bytearray.size();
+  bytearray.resize(entry + ACK_MAP_ENTRY_SIZE);
+
+  setQuint16(entry + ACK_MAP_ENTRY_FULL_TYPE, fullType);
+  setQuint16(entry + ACK_MAP_ENTRY_SEQ, seq);
+  setQuint16(entry + ACK_MAP_ENTRY_BITMAP, bitmap);
+  setQuint16(entry + ACK_MAP_ENTRY_DELAY, delayUs);
+
+  bytearray[offset + ACK_MAP_OFFSET_COUNT] = count + 1;
+}
+
+
+
 quint8 Message::getAckedType(void)
 {
 
@@ -226,17 +294,27 @@ int Message::length(quint8 type)
 
   switch(type) {
   case MSG_TYPE_PING:
-	return TYPE_OFFSET_PAYLOAD + 0; // no payload
+	return TYPE_OFFSET_PAYLOAD + 4; // + 32 bit timestamp
   case MSG_TYPE_MEDIA:
-	return TYPE_OFFSET_PAYLOAD + 0; // + payload of arbitrary length
+	return TYPE_OFFSET_MEDIA_PAYLOAD; // + payload of arbitrary length
   case MSG_TYPE_DEBUG:
 	return TYPE_OFFSET_PAYLOAD + 0; // + payload of arbitrary length
   case MSG_TYPE_VALUE:
 	return TYPE_OFFSET_PAYLOAD + 2; // + 16 bit value
   case MSG_TYPE_PERIODIC_VALUE:
 	return TYPE_OFFSET_PAYLOAD + 2; // + 16 bit value
+  case MSG_TYPE_MEDIA_FEC:
+	return TYPE_OFFSET_FEC_PAYLOAD; // + parity of arbitrary length
+  case MSG_TYPE_RECEIVER_REPORT:
+	return TYPE_OFFSET_REPORT_JITTER + 4; // + 32 bit jitter
+  case MSG_TYPE_TELEMETRY:
+	return TYPE_OFFSET_TELEMETRY_VALUES; // + values of arbitrary length
+  case MSG_TYPE_TYPED_VALUE:
+	return TYPE_OFFSET_TYPED_VALUE + 4; // + 32 bit value
   case MSG_TYPE_ACK:
 	return TYPE_OFFSET_PAYLOAD + 4; // + type + sub type + 16 bit CRC
+  case MSG_TYPE_ACK_MAP:
+	return TYPE_OFFSET_PAYLOAD + ACK_MAP_OFFSET_ENTRIES; // + entries
   default:
 	qWarning() << "Message length for type" << getTypeStr(type) << "not known";
 	return 0;
@@ -245,6 +323,50 @@ int Message::length(quint8 type)
 
 
 
+/*
+ * Messages of these types have a fixed length, so an ACK map can be
+ * appended after them. Not pings, their ACK is matched with the CRC.
+ */
+bool Message::canCarryAckMap(quint8 type)
+{
+  switch(type) {
+  case MSG_TYPE_VALUE:
+  case MSG_TYPE_PERIODIC_VALUE:
+  case MSG_TYPE_TYPED_VALUE:
+  case MSG_TYPE_RECEIVER_REPORT:
+	return true;
+  default:
+	return false;
+  }
+}
+
+
+
+/*
+ * Returns the delivery policy of a high priority message and the minimum
+ * deadline for the latest only delivery.
+ */
+int Message::deliveryPolicy(quint16 fullType, int *deadlineMs)
+{
+  if ((fullType >> 8) == MSG_TYPE_VALUE) {
+	for (unsigned int i = 0; i < sizeof(deliveryPolicies) / sizeof(deliveryPolicies[0]); i++) {
+	  if (deliveryPolicies[i].subType == (fullType & 0xff)) {
+		if (deadlineMs) {
+		  *deadlineMs = deliveryPolicies[i].deadlineMs;
+		}
+		return deliveryPolicies[i].policy;
+	  }
+	}
+  }
+
+  if (deadlineMs) {
+	*deadlineMs = 0;
+  }
+  return MSG_DELIVERY_RELIABLE;
+}
+
+
+
 QByteArray *Message::data(void)
 {
   //qDebug() << "in" << __FUNCTION__;
@@ -267,6 +389,24 @@ void Message::setCRC(void)
 
 
 
+/*
+ * Sets the CRC of a message sent as this header followed by a payload in a
+ * separate buffer (e.g. media). The payload is not copied.
+ */
+void Message::setCRC(const char *payload, int payloadLength)
+{
+  // Zero CRC field in data before calculating new 16bit CRC
+  setQuint16(TYPE_OFFSET_CRC, 0);
+
+  Crc16 crc;
+  crc.update(bytearray.constData(), bytearray.size());
+  crc.update(payload, payloadLength);
+
+  setQuint16(TYPE_OFFSET_CRC, crc.value());
+}
+
+
+
 void Message::setSeq(quint16 seq)
 {
   setQuint16(TYPE_OFFSET_SEQ, seq);
@@ -274,6 +414,13 @@ void Message::setSeq(quint16 seq)
 
 
 
+quint16 Message::getSeq(void)
+{
+  return getQuint16(TYPE_OFFSET_SEQ);
+}
+
+
+
 quint16 Message::getCRC(void)
 {
   return getQuint16(TYPE_OFFSET_CRC);
@@ -298,7 +445,7 @@ bool Message::validateCRC(void)
   bool isValid = (crc == calculated);
 
   if (!isValid) {
-	qDebug() << __FUNCTION__ << ": Embdedded CRC:" << hex << crc << ", calculated CRC:" << hex << calculated;
+	logTrace(LOG_MSG) << __FUNCTION__ << ": Embdedded CRC:" << hex << crc << ", calculated CRC:" << hex << calculated;
   }
 
   return isValid;
@@ -312,7 +459,7 @@ bool Message::matchCRC(quint16 test)
   bool match = crc == test;
 
   if (!match) {
-	qDebug() << __FUNCTION__ << ": Embdedded CRC:" << hex << crc << ", match CRC:" << hex << test;
+	logTrace(LOG_MSG) << __FUNCTION__ << ": Embdedded CRC:" << hex << crc << ", match CRC:" << hex << test;
   }
 
   return match;
@@ -334,6 +481,150 @@ quint16 Message::getPayload16(void)
 
 
 
+void Message::setMediaFragment(quint16 frameId, quint8 index, quint8 count)
+{
+  setQuint16(TYPE_OFFSET_MEDIA_FRAME_ID, frameId);
+  bytearray[TYPE_OFFSET_MEDIA_FRAG_INDEX] = index;
+  bytearray[TYPE_OFFSET_MEDIA_FRAG_COUNT] = count;
+}
+
+
+
+quint16 Message::getMediaFrameId(void)
+{
+  return getQuint16(TYPE_OFFSET_MEDIA_FRAME_ID);
+}
+
+
+
+quint8 Message::getMediaFragIndex(void)
+{
+  return (quint8)bytearray.at(TYPE_OFFSET_MEDIA_FRAG_INDEX);
+}
+
+
+
+quint8 Message::getMediaFragCount(void)
+{
+  return (quint8)bytearray.at(TYPE_OFFSET_MEDIA_FRAG_COUNT);
+}
+
+
+
+/*
+ * Sets the media timestamps, truncated to 32 bits. They are only compared
+ * with each other, so wrapping around is not a problem.
+ */
+void Message::setMediaTimes(quint32 captureUs, quint32 encodeUs, quint32 sendUs)
+{
+  setQuint32(TYPE_OFFSET_MEDIA_CAPTURE_TIME, captureUs);
+  setQuint32(TYPE_OFFSET_MEDIA_ENCODE_TIME, encodeUs);
+  setQuint32(TYPE_OFFSET_MEDIA_SEND_TIME, sendUs);
+}
+
+
+
+void Message::setPingTime(quint32 sendUs)
+{
+  setQuint32(TYPE_OFFSET_PING_TIME, sendUs);
+}
+
+
+
+void Message::setFec(quint16 baseSeq, quint8 count, quint8 index)
+{
+  setQuint16(TYPE_OFFSET_FEC_BASE_SEQ, baseSeq);
+  bytearray[TYPE_OFFSET_FEC_COUNT] = count;
+  bytearray[TYPE_OFFSET_FEC_INDEX] = index;
+}
+
+
+
+quint16 Message::getFecBaseSeq(void)
+{
+  return getQuint16(TYPE_OFFSET_FEC_BASE_SEQ);
+}
+
+
+
+quint8 Message::getFecCount(void)
+{
+  return (quint8)bytearray.at(TYPE_OFFSET_FEC_COUNT);
+}
+
+
+
+quint8 Message::getFecIndex(void)
+{
+  return (quint8)bytearray.at(TYPE_OFFSET_FEC_INDEX);
+}
+
+
+
+void Message::setTelemetryBaseline(quint16 baselineSeq, bool hasBaseline)
+{
+  setQuint16(TYPE_OFFSET_TELEMETRY_BASELINE, baselineSeq);
+  bytearray[TYPE_OFFSET_TELEMETRY_FLAGS] = hasBaseline ? MSG_TELEMETRY_FLAG_BASELINE : 0;
+}
+
+
+
+void Message::setTypedValue(quint8 tag, qint64 value)
+{
+  bytearray[TYPE_OFFSET_TYPED_VALUE_TAG] = tag;
+  setQuint32(TYPE_OFFSET_TYPED_VALUE, (quint32)value);
+}
+
+
+
+/*
+ * Returns the value of the 32 bit raw value, signed or unsigned depending
+ * on the type tag.
+ */
+qint64 Message::typedValue(quint8 tag, quint32 raw)
+{
+  switch (MSG_VALUE_TAG_TYPE(tag)) {
+  case MSG_VALUE_TYPE_U16:
+	return (quint16)raw;
+  case MSG_VALUE_TYPE_U32:
+	return raw;
+  default:
+	return (qint32)raw;
+  }
+}
+
+
+
+/*
+ * Returns the value scaled by the decimals of a fixed point type tag.
+ */
+double Message::typedValueToDouble(quint8 tag, qint64 value)
+{
+  double scaled = value;
+
+  if (MSG_VALUE_TAG_TYPE(tag) == MSG_VALUE_TYPE_FIXED) {
+	for (int i = 0; i < MSG_VALUE_TAG_DECIMALS(tag); i++) {
+	  scaled /= 10;
+	}
+  }
+
+  return scaled;
+}
+
+
+
+void Message::setReceiverReport(quint16 highestSeq, quint32 lost, quint8 fractionLost,
+								quint8 bufferFill, quint32 jitterUs)
+{
+  setQuint16(TYPE_OFFSET_REPORT_HIGHEST_SEQ, highestSeq);
+  setQuint32(TYPE_OFFSET_REPORT_LOST, lost);
+  bytearray[TYPE_OFFSET_REPORT_FRACTION] = fractionLost;
+  bytearray[TYPE_OFFSET_REPORT_BUFFER_FILL] = bufferFill;
+  setQuint32(TYPE_OFFSET_REPORT_JITTER, jitterUs);
+}
+
+
+
 QString Message::getTypeStr(quint16 type)
 {
   switch (type) {
@@ -349,6 +640,16 @@ QString Message::getTypeStr(quint16 type)
 	return QString("DEBUG");
   case MSG_TYPE_PERIODIC_VALUE:
 	return QString("PERIODIC_VALUE");
+  case MSG_TYPE_MEDIA_FEC:
+	return QString("MEDIA_FEC");
+  case MSG_TYPE_RECEIVER_REPORT:
+	return QString("RECEIVER_REPORT");
+  case MSG_TYPE_TELEMETRY:
+	return QString("TELEMETRY");
+  case MSG_TYPE_TYPED_VALUE:
+	return QString("TYPED_VALUE");
+  case MSG_TYPE_ACK_MAP:
+	return QString("ACK_MAP");
   case MSG_TYPE_ACK:
 	return QString("ACK");
   default:
@@ -393,6 +694,12 @@ QString Message::getSubTypeStr(quint16 type)
 	return QString("VIDEO_QUALITY");
   case MSG_SUBTYPE_UPTIME:
 	return QString("UPTIME");
+  case MSG_SUBTYPE_VIDEO_FEC:
+	return QString("VIDEO_FEC");
+  case MSG_SUBTYPE_REQUEST_KEYFRAME:
+	return QString("REQUEST_KEYFRAME");
+  case MSG_SUBTYPE_VIDEO_FIRST_FRAME:
+	return QString("VIDEO_FIRST_FRAME");
   default:
 	return QString("UNKNOWN") + "(" +  QString::number(type) + ")";
   }
@@ -416,3 +723,11 @@ quint16 Message::getQuint16(int index)
 
 
 
+void Message::setQuint32(int index, quint32 value)
+{
+  setQuint16(index, (quint16)(value >> 16));
+  setQuint16(index + 2, (quint16)(value & 0xffff));
+}
+
+
+
@@ -41,6 +41,11 @@
 #define MSG_TYPE_MEDIA               66
 #define MSG_TYPE_DEBUG               67
 #define MSG_TYPE_PERIODIC_VALUE      68
+#define MSG_TYPE_MEDIA_FEC           69
+#define MSG_TYPE_RECEIVER_REPORT     70
+#define MSG_TYPE_TELEMETRY           71
+#define MSG_TYPE_TYPED_VALUE         72
+#define MSG_TYPE_ACK_MAP            254
 #define MSG_TYPE_ACK                255
 #define MSG_TYPE_MAX                256
 #define MSG_TYPE_SUBTYPE_MAX      65536    // 16 bit full types
@@ -63,9 +68,36 @@ enum {
   MSG_SUBTYPE_SIGNAL_STRENGTH,
   MSG_SUBTYPE_CPU_USAGE,
   MSG_SUBTYPE_VIDEO_QUALITY,
-  MSG_SUBTYPE_UPTIME
+  MSG_SUBTYPE_UPTIME,
+  MSG_SUBTYPE_VIDEO_FEC,
+  MSG_SUBTYPE_REQUEST_KEYFRAME,
+  MSG_SUBTYPE_VIDEO_FIRST_FRAME
 };
 
+// Delivery policies of the high priority messages
+enum {
+  MSG_DELIVERY_RELIABLE,        // Resent until acked
+  MSG_DELIVERY_LATEST,          // Resent until acked, superseded or the deadline has passed
+  MSG_DELIVERY_UNRELIABLE       // Sent once and not acked
+};
+
+// Delivery policy registry of the VALUE subtypes: subtype, policy and the
+// minimum deadline in ms from queueing the newest value. Subtypes not listed
+// are reliable. The transmitter extends the deadline to several resend
+// timeouts, so that e.g. the command to stop the motors gets resent.
+#define MSG_DELIVERY_POLICIES { \
+	{ MSG_SUBTYPE_CAMERA_XY,          MSG_DELIVERY_LATEST,      300 }, \
+	{ MSG_SUBTYPE_CAMERA_ZOOM,        MSG_DELIVERY_LATEST,     1000 }, \
+	{ MSG_SUBTYPE_CAMERA_FOCUS,       MSG_DELIVERY_LATEST,     1000 }, \
+	{ MSG_SUBTYPE_SPEED_TURN,         MSG_DELIVERY_LATEST,      300 }, \
+	{ MSG_SUBTYPE_REQUEST_KEYFRAME,   MSG_DELIVERY_LATEST,      500 }, \
+	{ MSG_SUBTYPE_VIDEO_FIRST_FRAME,  MSG_DELIVERY_UNRELIABLE,    0 }, \
+  }
+
+// Value of MSG_SUBTYPE_VIDEO_FEC: number of parity messages in the high byte,
+// number of media messages per group in the low byte.
+#define MSG_VIDEO_FEC_VALUE(parities, group) ((quint16)(((parities) << 8) | (group)))
+
 // Byte offsets inside a message
 #define TYPE_OFFSET_CRC               0    // 16 bit CRC
 #define TYPE_OFFSET_SEQ               2    // 16 bit sequence number
@@ -75,10 +107,68 @@ enum {
 #define TYPE_OFFSET_ACKED_TYPE        6    // Acked 8 bit type
 #define TYPE_OFFSET_ACKED_SUBTYPE     7    // Acked 8 bit sub type
 #define TYPE_OFFSET_ACKED_CRC         8    // Acked 16 bit CRC
+#define TYPE_OFFSET_PING_TIME         6    // 32 bit send time, sender clock in us
+#define TYPE_OFFSET_ACK_PING_TIME    10    // ACK of a ping: 32 bit send time of the ping
+#define TYPE_OFFSET_ACK_RECEIVE_TIME 14    // ACK of a ping: 32 bit ping receive time, acker clock in us
+#define TYPE_OFFSET_ACK_SEND_TIME    18    // ACK of a ping: 32 bit ACK send time, acker clock in us
+#define TYPE_OFFSET_MEDIA_FRAME_ID    6    // 16 bit media frame id
+#define TYPE_OFFSET_MEDIA_FRAG_INDEX  8    // 8 bit index of the fragment in the frame
+#define TYPE_OFFSET_MEDIA_FRAG_COUNT  9    // 8 bit number of fragments in the frame
+#define TYPE_OFFSET_MEDIA_CAPTURE_TIME 10  // 32 bit capture time, sender clock in us
+#define TYPE_OFFSET_MEDIA_ENCODE_TIME  14  // 32 bit encode time, sender clock in us
+#define TYPE_OFFSET_MEDIA_SEND_TIME    18  // 32 bit send time, sender clock in us
+#define TYPE_OFFSET_MEDIA_PAYLOAD    22    // start of media payload
+#define TYPE_OFFSET_FEC_BASE_SEQ      6    // 16 bit seq of the first media message in the group
+#define TYPE_OFFSET_FEC_COUNT         8    // 8 bit number of media messages in the group
+#define TYPE_OFFSET_FEC_INDEX         9    // 8 bit index of the parity message
+#define TYPE_OFFSET_FEC_PAYLOAD      10    // start of parity data
+#define TYPE_OFFSET_REPORT_HIGHEST_SEQ  6  // 16 bit highest media seq received
+#define TYPE_OFFSET_REPORT_LOST         8  // 32 bit number of media messages lost
+#define TYPE_OFFSET_REPORT_FRACTION    12  // 8 bit fraction lost since last report, x/256
+#define TYPE_OFFSET_REPORT_BUFFER_FILL 13  // 8 bit jitterbuffer fill percentage
+#define TYPE_OFFSET_REPORT_JITTER      14  // 32 bit interarrival jitter in microseconds
+#define TYPE_OFFSET_TELEMETRY_BASELINE  6  // 16 bit seq of the snapshot the values are relative to
+#define TYPE_OFFSET_TELEMETRY_FLAGS     8  // 8 bit flags
+#define TYPE_OFFSET_TELEMETRY_VALUES    9  // (8 bit subtype, varint delta) pairs
+#define TYPE_OFFSET_TYPED_VALUE_TAG     6  // 8 bit type tag of the value
+#define TYPE_OFFSET_TYPED_VALUE         7  // 32 bit value
+
+// Telemetry flags
+#define MSG_TELEMETRY_FLAG_BASELINE   0x1  // Values are relative to the baseline snapshot
+
+// Type tags of the periodic values. The low nibble is the type and the high
+// nibble the number of decimals of a fixed point value.
+#define MSG_VALUE_TYPE_U16            0x0
+#define MSG_VALUE_TYPE_U32            0x1
+#define MSG_VALUE_TYPE_I32            0x2
+#define MSG_VALUE_TYPE_FIXED          0x3  // i32, value / 10^decimals
+#define MSG_VALUE_TAG(type, decimals) ((quint8)(((decimals) << 4) | (type)))
+#define MSG_VALUE_TAG_TYPE(tag)       ((tag) & 0x0f)
+#define MSG_VALUE_TAG_DECIMALS(tag)   (((tag) >> 4) & 0x0f)
+
+// ACK map: the latest received seq of each acked full type with a bitmap of
+// the preceding ones. Sent as its own message or appended to a message of
+// a fixed length type (see Message::canCarryAckMap()).
+#define ACK_MAP_OFFSET_COUNT          0    // 8 bit number of entries
+#define ACK_MAP_OFFSET_ENTRIES        1    // start of the entries
+#define ACK_MAP_ENTRY_SIZE            8
+#define ACK_MAP_ENTRY_FULL_TYPE       0    // 16 bit acked full type
+#define ACK_MAP_ENTRY_SEQ             2    // 16 bit latest received seq of the type
+#define ACK_MAP_ENTRY_BITMAP          4    // 16 bit, bit n is set if seq - 1 - n was received
+#define ACK_MAP_ENTRY_DELAY           6    // 16 bit time the ACK was held back in us
+#define ACK_MAP_MAX_ENTRIES          16
+
+// Length of an ACK of a ping, with the timestamps for the clock sync
+#define MSG_PING_ACK_LENGTH           22
+
+// Max number of fragments a media frame can be split into
+#define MSG_MEDIA_MAX_FRAGMENTS       255
 
 // Max length of debug messages
 #define MSG_DEBUG_MAX_LEN             256
 
+class MessageView;
+
 class Message : public QObject
 {
   Q_OBJECT;
@@ -88,7 +178,10 @@ class Message : public QObject
   Message(QByteArray data);
   Message(quint8 type, quint8 subType = 0);
   ~Message();
-  void setACK(Message &msg);
+  void setACK(MessageView &msg);
+  void setAckPingTimes(quint32 pingUs, quint32 receiveUs, quint32 sendUs);
+  void clearAckMap(void);
+  void addAckMapEntry(quint16 fullType, quint16 seq, quint16 bitmap, quint16 delayUs);
   quint8 getAckedType(void);
   quint8 getAckedSubType(void);
   quint16 getAckedFullType(void);
@@ -101,22 +194,49 @@ class Message : public QObject
 
   QByteArray *data(void);
   void setCRC(void);
+  void setCRC(const char *payload, int payloadLength);
   bool validateCRC(void);
   bool matchCRC(quint16 test);
   void setSeq(quint16 seq);
+  quint16 getSeq(void);
 
   void setPayload16(quint16 value);
   quint16 getPayload16();
 
+  void setMediaFragment(quint16 frameId, quint8 index, quint8 count);
+  quint16 getMediaFrameId(void);
+  quint8 getMediaFragIndex(void);
+  quint8 getMediaFragCount(void);
+  void setMediaTimes(quint32 captureUs, quint32 encodeUs, quint32 sendUs);
+
+  void setPingTime(quint32 sendUs);
+
+  void setFec(quint16 baseSeq, quint8 count, quint8 index);
+  quint16 getFecBaseSeq(void);
+  quint8 getFecCount(void);
+  quint8 getFecIndex(void);
+
+  void setTelemetryBaseline(quint16 baselineSeq, bool hasBaseline);
+
+  void setTypedValue(quint8 tag, qint64 value);
+
+  void setReceiverReport(quint16 highestSeq, quint32 lost, quint8 fractionLost,
+						 quint8 bufferFill, quint32 jitterUs);
+
   static QString getTypeStr(quint16 type);
   static QString getSubTypeStr(quint16 type);
+  static int length(quint8 type);
+  static bool canCarryAckMap(quint8 type);
+  static int deliveryPolicy(quint16 fullType, int *deadlineMs = NULL);
+  static qint64 typedValue(quint8 tag, quint32 raw);
+  static double typedValueToDouble(quint8 tag, qint64 value);
 
  private:
   int length(void);
-  int length(quint8 type);
   quint16 getCRC(void);
   void setQuint16(int index, quint16 value);
   quint16 getQuint16(int index);
+  void setQuint32(int index, quint32 value);
 
   QByteArray bytearray;
 };
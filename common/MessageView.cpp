@@ -0,0 +1,120 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "MessageView.h"
+#include "Log.h"
+#include "Crc16.h"
+
+#include <string.h>                          /* memcpy */
+
+
+
+bool MessageView::isValid(void)
+{
+  // Size must be at least big enough to hold mandatory headers before payload
+  if (len < TYPE_OFFSET_PAYLOAD) {
+	qWarning() << "Invalid message length:" << len << ", discarding";
+	return false;
+  }
+
+  // Size must be at least the minimum size for the type
+  if (len < Message::length(type())) {
+	qWarning() << "Invalid message length (" << len << ") for type" << Message::getTypeStr(type()) <<  ", discarding";
+	return false;
+  }
+
+  // CRC inside the message must match the calculated CRC
+  return validateCRC();
+}
+
+
+
+/*
+ * Returns the offset of the ACK map in the message or -1, if there's none.
+ */
+int MessageView::ackMapOffset(void)
+{
+  int offset;
+
+  if (type() == MSG_TYPE_ACK_MAP) {
+	offset = TYPE_OFFSET_PAYLOAD;
+  } else if (Message::canCarryAckMap(type()) && len > Message::length(type())) {
+	offset = Message::length(type());
+  } else {
+	return -1;
+  }
+
+  if (len != offset + ACK_MAP_OFFSET_ENTRIES + getAckMapCount(offset) * ACK_MAP_ENTRY_SIZE) {
+	qWarning() << "Invalid ACK map length:" << len << ", ignoring";
+	return -1;
+  }
+
+  return offset;
+}
+
+
+
+/*
+ * The CRC is calculated with the CRC field zeroed, without modifying the
+ * data.
+ */
+bool MessageView::validateCRC(void)
+{
+  static const char zero[2] = { 0, 0 };
+  quint16 crc = getCRC();
+
+  Crc16 check;
+  check.update(zero, sizeof(zero));
+  check.update(bytes + TYPE_OFFSET_CRC + 2, len - 2);
+  quint16 calculated = check.value();
+
+  bool isValid = (crc == calculated);
+
+  if (!isValid) {
+	logTrace(LOG_MSG) << __FUNCTION__ << ": Embdedded CRC:" << hex << crc << ", calculated CRC:" << hex << calculated;
+  }
+
+  return isValid;
+}
+
+
+
+/*
+ * Returns the media payload. It is a slice of the received buffer, if there
+ * is one, and a copy otherwise. The caller owns the returned reference.
+ */
+MediaBuffer *MessageView::mediaPayload(void)
+{
+  int payloadLength = len - TYPE_OFFSET_MEDIA_PAYLOAD;
+
+  if (buffer) {
+	return buffer->slice(bytes + TYPE_OFFSET_MEDIA_PAYLOAD - buffer->data(), payloadLength);
+  }
+
+  MediaBuffer *copy = new MediaBuffer(payloadLength);
+  memcpy(copy->data(), bytes + TYPE_OFFSET_MEDIA_PAYLOAD, payloadLength);
+  return copy;
+}
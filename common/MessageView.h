@@ -0,0 +1,117 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _MESSAGEVIEW_H
+#define _MESSAGEVIEW_H
+
+#include "Message.h"
+#include "MediaBuffer.h"
+
+/*
+ * Read-only view of a received message. Parses the header in place over the
+ * received data, without copying it or creating a QObject. If the data is in
+ * a MediaBuffer, the media payload can be passed on as a slice of it.
+ */
+class MessageView
+{
+ public:
+  MessageView(const char *data, int length, MediaBuffer *buffer = NULL):
+	bytes(data), len(length), buffer(buffer) {}
+
+  bool isValid(void);
+  bool isHighPriority(void) { return type() < MSG_HP_TYPE_LIMIT; }
+
+  const char *data(void) { return bytes; }
+  int length(void) { return len; }
+
+  quint8 type(void) { return bytes[TYPE_OFFSET_TYPE]; }
+  quint8 subType(void) { return bytes[TYPE_OFFSET_SUBTYPE]; }
+  quint16 fullType(void) { return (type() << 8) | subType(); }
+  quint16 getCRC(void) { return getQuint16(TYPE_OFFSET_CRC); }
+  quint16 getSeq(void) { return getQuint16(TYPE_OFFSET_SEQ); }
+
+  quint16 getAckedFullType(void) { return getQuint16(TYPE_OFFSET_ACKED_TYPE); }
+  quint16 getAckedCRC(void) { return getQuint16(TYPE_OFFSET_ACKED_CRC); }
+  quint32 getAckPingTime(void) { return getQuint32(TYPE_OFFSET_ACK_PING_TIME); }
+  quint32 getAckReceiveTime(void) { return getQuint32(TYPE_OFFSET_ACK_RECEIVE_TIME); }
+  quint32 getAckSendTime(void) { return getQuint32(TYPE_OFFSET_ACK_SEND_TIME); }
+
+  int ackMapOffset(void);
+  quint8 getAckMapCount(int offset) { return bytes[offset + ACK_MAP_OFFSET_COUNT]; }
+  quint16 getAckMapFullType(int offset, int i) { return getQuint16(ackMapEntry(offset, i) + ACK_MAP_ENTRY_FULL_TYPE); }
+  quint16 getAckMapSeq(int offset, int i) { return getQuint16(ackMapEntry(offset, i) + ACK_MAP_ENTRY_SEQ); }
+  quint16 getAckMapBitmap(int offset, int i) { return getQuint16(ackMapEntry(offset, i) + ACK_MAP_ENTRY_BITMAP); }
+  quint16 getAckMapDelay(int offset, int i) { return getQuint16(ackMapEntry(offset, i) + ACK_MAP_ENTRY_DELAY); }
+
+  quint16 getPayload16(void) { return getQuint16(TYPE_OFFSET_PAYLOAD); }
+
+  quint16 getMediaFrameId(void) { return getQuint16(TYPE_OFFSET_MEDIA_FRAME_ID); }
+  quint8 getMediaFragIndex(void) { return bytes[TYPE_OFFSET_MEDIA_FRAG_INDEX]; }
+  quint8 getMediaFragCount(void) { return bytes[TYPE_OFFSET_MEDIA_FRAG_COUNT]; }
+  quint32 getMediaCaptureTime(void) { return getQuint32(TYPE_OFFSET_MEDIA_CAPTURE_TIME); }
+  quint32 getMediaEncodeTime(void) { return getQuint32(TYPE_OFFSET_MEDIA_ENCODE_TIME); }
+  quint32 getMediaSendTime(void) { return getQuint32(TYPE_OFFSET_MEDIA_SEND_TIME); }
+
+  quint32 getPingTime(void) { return getQuint32(TYPE_OFFSET_PING_TIME); }
+  MediaBuffer *mediaPayload(void);
+
+  quint16 getFecBaseSeq(void) { return getQuint16(TYPE_OFFSET_FEC_BASE_SEQ); }
+  quint8 getFecCount(void) { return bytes[TYPE_OFFSET_FEC_COUNT]; }
+  quint8 getFecIndex(void) { return bytes[TYPE_OFFSET_FEC_INDEX]; }
+
+  quint16 getReportHighestSeq(void) { return getQuint16(TYPE_OFFSET_REPORT_HIGHEST_SEQ); }
+  quint32 getReportLost(void) { return getQuint32(TYPE_OFFSET_REPORT_LOST); }
+  quint8 getReportFractionLost(void) { return bytes[TYPE_OFFSET_REPORT_FRACTION]; }
+  quint8 getReportBufferFill(void) { return bytes[TYPE_OFFSET_REPORT_BUFFER_FILL]; }
+  quint32 getReportJitter(void) { return getQuint32(TYPE_OFFSET_REPORT_JITTER); }
+
+  quint16 getTelemetryBaseline(void) { return getQuint16(TYPE_OFFSET_TELEMETRY_BASELINE); }
+  quint8 getTelemetryFlags(void) { return bytes[TYPE_OFFSET_TELEMETRY_FLAGS]; }
+
+  quint8 getTypedValueTag(void) { return bytes[TYPE_OFFSET_TYPED_VALUE_TAG]; }
+  qint64 getTypedValue(void) { return Message::typedValue(getTypedValueTag(), getQuint32(TYPE_OFFSET_TYPED_VALUE)); }
+
+ private:
+  bool validateCRC(void);
+
+  int ackMapEntry(int offset, int i) { return offset + ACK_MAP_OFFSET_ENTRIES + i * ACK_MAP_ENTRY_SIZE; }
+
+  quint16 getQuint16(int index)
+  {
+	return ((quint8)bytes[index] << 8) | (quint8)bytes[index + 1];
+  }
+
+  quint32 getQuint32(int index)
+  {
+	return ((quint32)getQuint16(index) << 16) | getQuint16(index + 2);
+  }
+
+  const char *bytes;
+  int len;
+  MediaBuffer *buffer;
+};
+
+#endif
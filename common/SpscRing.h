@@ -0,0 +1,85 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _SPSCRING_H
+#define _SPSCRING_H
+
+#include <QAtomicInt>
+
+/*
+ * Lock-free ring buffer for passing items from exactly one producer thread
+ * to exactly one consumer thread. SIZE must be a power of two. One slot is
+ * left empty to tell a full ring from an empty one.
+ */
+template <typename T, int SIZE>
+class SpscRing
+{
+ public:
+  SpscRing(): head(0), tail(0)
+  {
+	Q_STATIC_ASSERT((SIZE & (SIZE - 1)) == 0);
+  }
+
+  // Called by the producer only. Returns false, if the ring is full.
+  bool push(const T &item)
+  {
+	int h = head.load();
+	int next = (h + 1) & (SIZE - 1);
+
+	if (next == tail.loadAcquire()) {
+	  return false;
+	}
+
+	items[h] = item;
+	head.storeRelease(next);
+	return true;
+  }
+
+  // Called by the consumer only. Returns false, if the ring is empty.
+  bool pop(T &item)
+  {
+	int t = tail.load();
+
+	if (t == head.loadAcquire()) {
+	  return false;
+	}
+
+	item = items[t];
+	tail.storeRelease((t + 1) & (SIZE - 1));
+	return true;
+  }
+
+ private:
+  T items[SIZE];
+
+  // Written by the producer
+  QAtomicInt head;
+  char padding[64];
+  // Written by the consumer
+  QAtomicInt tail;
+};
+
+#endif
@@ -0,0 +1,390 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "Telemetry.h"
+#include "Message.h"
+
+#include <QDebug>
+
+#include <string.h>                          /* memset */
+
+// Max length of a 64 bit varint
+#define VARINT_MAX_LENGTH      10
+
+// Max length of an encoded value: subtype, varint and tag
+#define ENTRY_MAX_LENGTH       (1 + VARINT_MAX_LENGTH + 1)
+
+
+
+/*
+ * Zigzag encoding maps small negative and positive deltas to small
+ * unsigned values: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+ */
+static quint64 zigzag(qint64 value)
+{
+  return ((quint64)value << 1) ^ (quint64)(value >> 63);
+}
+
+
+
+static qint64 unzigzag(quint64 value)
+{
+  return (qint64)(value >> 1) ^ -(qint64)(value & 1);
+}
+
+
+
+/*
+ * Writes a little endian base 128 varint. Returns the length.
+ */
+static int writeVarint(quint64 value, char *buf)
+{
+  int len = 0;
+
+  while (value >= 0x80) {
+	buf[len++] = (char)(value | 0x80);
+	value >>= 7;
+  }
+  buf[len++] = (char)value;
+
+  return len;
+}
+
+
+
+/*
+ * Reads a varint. Returns the length or -1 if it's truncated or too long.
+ */
+static int readVarint(const char *data, int length, quint64 *value)
+{
+  *value = 0;
+
+  for (int i = 0; i < length && i < VARINT_MAX_LENGTH; i++) {
+	quint8 byte = data[i];
+	*value |= (quint64)(byte & 0x7f) << (7 * i);
+	if (!(byte & 0x80)) {
+	  return i + 1;
+	}
+  }
+
+  return -1;
+}
+
+
+
+void TelemetrySnapshot::clear(void)
+{
+  valid = false;
+  seq = 0;
+  memset(present, 0, sizeof(present));
+  memset(tags, 0, sizeof(tags));
+  memset(values, 0, sizeof(values));
+}
+
+
+
+TelemetryEncoder::TelemetryEncoder():
+  historyNext(0), sentSinceAck(0)
+{
+  current.clear();
+  reset();
+}
+
+
+
+/*
+ * Forgets the acked snapshots, so that the next message has all the
+ * values. The latest values are kept.
+ */
+void TelemetryEncoder::reset(void)
+{
+  baseline.clear();
+
+  for (int i = 0; i < TELEMETRY_HISTORY; i++) {
+	history[i].clear();
+  }
+
+  sentSinceAck = 0;
+}
+
+
+
+void TelemetryEncoder::set(quint8 subType, quint8 tag, qint64 value)
+{
+  current.set(subType, tag, value);
+}
+
+
+
+qint64 TelemetryEncoder::baseValue(int subType)
+{
+  if (baseline.valid && baseline.has(subType)) {
+	return baseline.values[subType];
+  }
+
+  return 0;
+}
+
+
+
+bool TelemetryEncoder::sameTag(int subType)
+{
+  return baseline.valid && baseline.has(subType) && baseline.tags[subType] == current.tags[subType];
+}
+
+
+
+bool TelemetryEncoder::changed(int subType)
+{
+  if (!current.has(subType)) {
+	return false;
+  }
+
+  if (!sameTag(subType)) {
+	return true;
+  }
+
+  return baseline.values[subType] != current.values[subType];
+}
+
+
+
+/*
+ * Encodes the value of the subtype. Returns the length.
+ */
+int TelemetryEncoder::encodeEntry(int subType, char *entry)
+{
+  bool tag = !sameTag(subType);
+  quint64 delta = zigzag(current.values[subType] - baseValue(subType));
+
+  int len = 0;
+  entry[len++] = (char)subType;
+  len += writeVarint((delta << 1) | (tag ? 1 : 0), entry + len);
+  if (tag) {
+	entry[len++] = (char)current.tags[subType];
+  }
+
+  return len;
+}
+
+
+
+/*
+ * Returns true if some value differs from the acked snapshot.
+ */
+bool TelemetryEncoder::hasChanges(void)
+{
+  for (int i = 0; i < TELEMETRY_VALUES; i++) {
+	if (changed(i)) {
+	  return true;
+	}
+  }
+
+  return false;
+}
+
+
+
+/*
+ * Returns the length of the encoded values, if encoded now.
+ */
+int TelemetryEncoder::encodedSize(void)
+{
+  char entry[ENTRY_MAX_LENGTH];
+  int size = 0;
+
+  for (int i = 0; i < TELEMETRY_VALUES; i++) {
+	if (changed(i)) {
+	  size += encodeEntry(i, entry);
+	}
+  }
+
+  return size;
+}
+
+
+
+/*
+ * Appends the changed values to the data, as long as it stays within the
+ * max length. The rest are sent in the next message. The snapshot the
+ * receiver will have is stored with the sequence number of the message.
+ */
+void TelemetryEncoder::encode(quint16 seq, QByteArray *data, int maxLength)
+{
+  TelemetrySnapshot *snapshot = &history[historyNext];
+  historyNext = (historyNext + 1) % TELEMETRY_HISTORY;
+
+  if (baseline.valid) {
+	*snapshot = baseline;
+  } else {
+	snapshot->clear();
+  }
+
+  char entry[ENTRY_MAX_LENGTH];
+
+  for (int i = 0; i < TELEMETRY_VALUES; i++) {
+	if (!changed(i)) {
+	  continue;
+	}
+
+	int len = encodeEntry(i, entry);
+
+	if (data->size() + len > maxLength) {
+	  break;
+	}
+
+	data->append(entry, len);
+	snapshot->set(i, current.tags[i], current.values[i]);
+  }
+
+  snapshot->valid = true;
+  snapshot->seq = seq;
+
+  // Start over with a full snapshot, if the receiver doesn't ACK
+  if (++sentSinceAck >= TELEMETRY_BASELINE_TIMEOUT) {
+	qWarning() << __FUNCTION__ << ": No ACKs for" << sentSinceAck << "telemetry messages, sending all values";
+	baseline.valid = false;
+	sentSinceAck = 0;
+  }
+}
+
+
+
+/*
+ * The receiver has the snapshot of the seq and those marked in the bitmap
+ * (bit n for seq - 1 - n). The latest of them becomes the baseline.
+ */
+void TelemetryEncoder::acked(quint16 seq, quint16 bitmap)
+{
+  TelemetrySnapshot *latest = NULL;
+
+  for (int i = 0; i < TELEMETRY_HISTORY; i++) {
+	TelemetrySnapshot *snapshot = &history[i];
+	if (!snapshot->valid) {
+	  continue;
+	}
+
+	quint16 behind = seq - snapshot->seq;
+	if (behind != 0 && (behind > 16 || !(bitmap & (1 << (behind - 1))))) {
+	  continue;
+	}
+
+	if (!latest || (qint16)(snapshot->seq - latest->seq) > 0) {
+	  latest = snapshot;
+	}
+  }
+
+  if (!latest || (baseline.valid && (qint16)(latest->seq - baseline.seq) <= 0)) {
+	return;
+  }
+
+  baseline = *latest;
+  sentSinceAck = 0;
+}
+
+
+
+TelemetryDecoder::TelemetryDecoder():
+  historyNext(0)
+{
+  reset();
+}
+
+
+
+void TelemetryDecoder::reset(void)
+{
+  for (int i = 0; i < TELEMETRY_HISTORY; i++) {
+	history[i].clear();
+  }
+}
+
+
+
+/*
+ * Decodes the values of a telemetry message into the arrays, which must
+ * have space for TELEMETRY_VALUES values. Returns the number of values or
+ * -1 if the message can't be decoded.
+ */
+int TelemetryDecoder::decode(quint16 seq, bool hasBaseline, quint16 baselineSeq, const char *data, int length,
+							 quint8 *subTypes, quint8 *tags, qint64 *values)
+{
+  TelemetrySnapshot snapshot;
+  snapshot.clear();
+
+  if (hasBaseline) {
+	int i;
+	for (i = 0; i < TELEMETRY_HISTORY; i++) {
+	  if (history[i].valid && history[i].seq == baselineSeq) {
+		break;
+	  }
+	}
+
+	if (i == TELEMETRY_HISTORY) {
+	  qWarning() << __FUNCTION__ << ": Unknown telemetry baseline" << baselineSeq << ", ignoring";
+	  return -1;
+	}
+
+	snapshot = history[i];
+  }
+
+  int count = 0;
+  int pos = 0;
+  while (pos < length) {
+	quint8 subType = data[pos++];
+
+	quint64 delta;
+	int len = readVarint(data + pos, length - pos, &delta);
+	bool hasTag = len != -1 && (delta & 1);
+	if (len == -1 || (hasTag && pos + len >= length) || count == TELEMETRY_VALUES) {
+	  qWarning() << __FUNCTION__ << ": Invalid telemetry message, ignoring";
+	  return -1;
+	}
+	pos += len;
+
+	// Values without a tag have the same type as in the baseline. Those
+	// not in the baseline have the tag.
+	quint8 tag = snapshot.has(subType) ? snapshot.tags[subType] : MSG_VALUE_TAG(MSG_VALUE_TYPE_U16, 0);
+	if (hasTag) {
+	  tag = data[pos++];
+	}
+
+	qint64 value = (snapshot.has(subType) ? snapshot.values[subType] : 0) + unzigzag(delta >> 1);
+	snapshot.set(subType, tag, value);
+
+	subTypes[count] = subType;
+	tags[count] = tag;
+	values[count] = value;
+	count++;
+  }
+
+  snapshot.valid = true;
+  snapshot.seq = seq;
+  history[historyNext] = snapshot;
+  historyNext = (historyNext + 1) % TELEMETRY_HISTORY;
+
+  return count;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <QByteArray>
+
+// One value per 8 bit subtype
+#define TELEMETRY_VALUES              256
+
+// Number of sent and received snapshots kept for the delta encoding
+#define TELEMETRY_HISTORY             16
+
+// Snapshots sent without an ACK before the baseline is considered lost and
+// a full snapshot is sent (e.g. the receiver has restarted)
+#define TELEMETRY_BASELINE_TIMEOUT    8
+
+/*
+ * Snapshot of the latest telemetry values, identified by the sequence
+ * number of the message it was sent in.
+ */
+struct TelemetrySnapshot {
+  bool valid;
+  quint16 seq;
+  quint32 present[TELEMETRY_VALUES / 32];
+  quint8 tags[TELEMETRY_VALUES];
+  qint64 values[TELEMETRY_VALUES];
+
+  void clear(void);
+  bool has(int subType) const { return present[subType / 32] & (1u << (subType % 32)); }
+  void set(int subType, quint8 tag, qint64 value)
+  {
+	present[subType / 32] |= 1u << (subType % 32);
+	tags[subType] = tag;
+	values[subType] = value;
+  }
+};
+
+/*
+ * Encodes the values that differ from the last snapshot acked by the
+ * receiver, as (subtype, zigzag varint delta) pairs. The lowest bit of the
+ * varint tells if the type tag of the value follows. It's sent only if the
+ * acked snapshot doesn't have the same tag. Lost messages don't matter, the
+ * next one is relative to the same or a later acked snapshot.
+ */
+class TelemetryEncoder
+{
+ public:
+  TelemetryEncoder();
+  void reset(void);
+  void set(quint8 subType, quint8 tag, qint64 value);
+  bool hasChanges(void);
+  int encodedSize(void);
+  bool hasBaseline(void) { return baseline.valid; }
+  quint16 baselineSeq(void) { return baseline.seq; }
+  void encode(quint16 seq, QByteArray *data, int maxLength);
+  void acked(quint16 seq, quint16 bitmap);
+
+ private:
+  qint64 baseValue(int subType);
+  bool sameTag(int subType);
+  bool changed(int subType);
+  int encodeEntry(int subType, char *entry);
+
+  TelemetrySnapshot current;
+  TelemetrySnapshot baseline;
+  TelemetrySnapshot history[TELEMETRY_HISTORY];
+  int historyNext;
+  int sentSinceAck;
+};
+
+/*
+ * Rebuilds the snapshots from the deltas. Keeps the latest received
+ * snapshots, any of which the sender may use as the baseline.
+ */
+class TelemetryDecoder
+{
+ public:
+  TelemetryDecoder();
+  void reset(void);
+  int decode(quint16 seq, bool hasBaseline, quint16 baselineSeq, const char *data, int length,
+			 quint8 *subTypes, quint8 *tags, qint64 *values);
+
+ private:
+  TelemetrySnapshot history[TELEMETRY_HISTORY];
+  int historyNext;
+};
+
+#endif
@@ -26,512 +26,2271 @@
 
 #include "Transmitter.h"
 #include "Message.h"
+#include "Log.h"
+#include "Clock.h"
+
+#include <string.h>                          /* memset */
+#include <stdlib.h>                          /* getenv */
+
+#ifdef TRANSMITTER_BATCHED_IO
+#include <sys/socket.h>                      /* recvmmsg, sendmmsg */
+#include <netinet/in.h>                      /* sockaddr_in */
+#include <netinet/udp.h>                     /* UDP_SEGMENT */
+#include <unistd.h>                          /* close */
+#include <errno.h>
+
+// Not defined by older C libraries
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT            103
+#endif
+#endif
 
 #define RESEND_TIMEOUT_DEFAULT 1000
+#define RESEND_TIMEOUT_MIN     50
+#define RESEND_TIMEOUT_MAX     3000
 
+// Partially received media frames older than this are dropped
+#define REASSEMBLY_TIMEOUT_MS  500
 
-Transmitter::Transmitter(QString host, quint16 port):
-  socket(), relayHost(host), relayPort(port), resendTimeoutMs(RESEND_TIMEOUT_DEFAULT),
-  resendCounter(0), connectionTimeoutTimer(NULL), connectionStatus(CONNECTION_STATUS_LOST), 
-  autoPing(NULL),
-  payloadSent(0), payloadRecv(0), totalSent(0), totalRecv(0), rateTimer(), rateTime()
+
+
+/*
+ * Send scheduler class of a message type.
+ */
+static int txClassOf(quint8 type)
 {
-  qDebug() << "in" << __FUNCTION__ << ", connecting to host:" << host << ", port:" << port;
+  if (type < MSG_HP_TYPE_LIMIT || type == MSG_TYPE_ACK || type == MSG_TYPE_ACK_MAP) {
+	return TX_CLASS_CONTROL;
+  }
+
+  if (type == MSG_TYPE_MEDIA || type == MSG_TYPE_MEDIA_FEC) {
+	return TX_CLASS_MEDIA;
+  }
+
+  return TX_CLASS_NORMAL;
+}
+
 
-  // Add a signal mapper for resending packages
-  resendSignalMapper = new QSignalMapper(this);
-  connect(resendSignalMapper, SIGNAL(mapped(QObject *)),
-		  this, SLOT(resendMessage(QObject *)));
+Transmitter::Transmitter(QString host, quint16 port):
+  socket(), fd(-1), readNotifier(NULL), txQueued(0), txFlushTimer(), gso(false),
+  mediaQueueHead(0), mediaQueueCount(0), pacingTimer(), pacingRateKbps(0),
+  mediaDeadlineUs(TRANSMITTER_MEDIA_DEADLINE_MS * 1000), pacingTokens(0), pacingLastUs(0), pacingFrameUs(-1), relayHost(host), relayPort(port), resendTimeoutMs(RESEND_TIMEOUT_DEFAULT),
+  resendCounter(0), rttSampled(false), srttMs(0), rttVarMs(0), resendCount(0), wheelTick(0), wheelTimer(), clock(),
+  pendingAcks(0), ackTimer(), connectionTimeoutTimer(NULL), connectionStatus(CONNECTION_STATUS_LOST), 
+  autoPing(NULL), lastPingMs(0), mtu(TRANSMITTER_MTU_DEFAULT), mediaFrameId(0),
+  reportTimer(NULL), mediaSeqInit(false), mediaMaxSeq(0), mediaCycles(0), mediaBaseSeq(0),
+  mediaReceived(0), mediaExpectedPrior(0), mediaReceivedPrior(0), mediaLastArrivalUs(0),
+  mediaMeanIntervalUs(0), mediaJitterUs(0), bufferFill(0),
+  peerClock(), rxTimeUs(0), telemetryTimer(NULL), telemetryMaxBytes(0), telemetryEncoder(), telemetryDecoder(),
+  latencyStats(), latencyFrameId(-1),
+  payloadSent(0), payloadRecv(0), totalSent(0), totalRecv(0),
+  rxCalls(0), rxDatagrams(0), txCalls(0), txDatagrams(0), rateTimer(), rateTime()
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__ << ", connecting to host:" << host << ", port:" << port;
 
   // Zero arrays
-  // FIXME: memset?
-  for (int i = 0; i < MSG_TYPE_SUBTYPE_MAX; i++)  {
-	rtTimers[i] = NULL;
-	resendTimers[i] = NULL;
+  for (int i = 0; i < MSG_TYPE_MAX; i++)  {
 	messageHandlers[i] = NULL;
-	resendMessages[i] = NULL;
   }
 
+  for (int i = 0; i < RESEND_TABLE_SIZE; i++)  {
+	resendTable[i].used = false;
+	resendTable[i].scheduled = false;
+	resendTable[i].msg = NULL;
+  }
+
+  for (int i = 0; i < RESEND_WHEEL_SLOTS; i++)  {
+	wheel[i] = -1;
+  }
+
+  // A single timer drives all resends. It runs only when there are messages
+  // waiting for an ACK.
+  clock.start();
+  wheelTimer.setInterval(RESEND_WHEEL_TICK_MS);
+  connect(&wheelTimer, SIGNAL(timeout()), this, SLOT(processResendWheel()));
+
+  for (int i = 0; i < ACK_STATE_SIZE; i++)  {
+	ackStates[i].used = false;
+	ackStates[i].pending = false;
+  }
+
+  // Held back ACKs are sent at the latest when this expires
+  ackTimer.setSingleShot(true);
+  ackTimer.setInterval(ACK_MAX_DELAY_MS);
+  connect(&ackTimer, SIGNAL(timeout()), this, SLOT(flushAcks()));
+
+  for (int i = 0; i < REASSEMBLY_SLOTS; i++)  {
+	reassembly[i].used = false;
+  }
+
+  rxPool = NULL;
+  for (int i = 0; i < TRANSMITTER_BATCH_SIZE; i++)  {
+	rxSlots[i] = NULL;
+  }
+
+  // Queued datagrams are flushed when returning to the event loop
+  txFlushTimer.setSingleShot(true);
+  txFlushTimer.setInterval(0);
+  connect(&txFlushTimer, SIGNAL(timeout()), this, SLOT(flushTxQueue()));
+
+  // Releases the paced media when there are enough tokens
+  pacingTimer.setSingleShot(true);
+  pacingTimer.setTimerType(Qt::PreciseTimer);
+  connect(&pacingTimer, SIGNAL(timeout()), this, SLOT(paceMedia()));
+
+  memset(txStats, 0, sizeof(txStats));
+
   // Set message handlers
   messageHandlers[MSG_TYPE_ACK]                = &Transmitter::handleACK;
+  messageHandlers[MSG_TYPE_ACK_MAP]            = &Transmitter::handleAckMap;
   messageHandlers[MSG_TYPE_PING]               = &Transmitter::handlePing;
   messageHandlers[MSG_TYPE_MEDIA]              = &Transmitter::handleMedia;
   messageHandlers[MSG_TYPE_DEBUG]              = &Transmitter::handleDebug;
   messageHandlers[MSG_TYPE_VALUE]              = &Transmitter::handleValue;
   messageHandlers[MSG_TYPE_PERIODIC_VALUE]     = &Transmitter::handlePeriodicValue;
+  messageHandlers[MSG_TYPE_MEDIA_FEC]          = &Transmitter::handleMediaFec;
+  messageHandlers[MSG_TYPE_RECEIVER_REPORT]    = &Transmitter::handleReceiverReport;
+  messageHandlers[MSG_TYPE_TELEMETRY]          = &Transmitter::handleTelemetry;
+  messageHandlers[MSG_TYPE_TYPED_VALUE]        = &Transmitter::handleTypedValue;
+}
+
+
+
+Transmitter::~Transmitter()
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
+
+  wheelTimer.stop();
+
+  delete reportTimer;
+  delete telemetryTimer;
+
+  // Delete the messages waiting for an ACK
+  for (int i = 0; i < RESEND_TABLE_SIZE; i++)  {
+	delete resendTable[i].msg;
+	resendTable[i].msg = NULL;
+  }
+
+  // Drop the paced media
+  pacingTimer.stop();
+  while (mediaQueueCount > 0) {
+	TxDatagram *dgram = &mediaQueue[mediaQueueHead];
+	if (dgram->payload) {
+	  dgram->payload->unref();
+	}
+	mediaQueueHead = (mediaQueueHead + 1) % TRANSMITTER_MEDIA_QUEUE_SIZE;
+	mediaQueueCount--;
+  }
+
+#ifdef TRANSMITTER_BATCHED_IO
+  if (fd != -1) {
+	flushTxQueue();
+	delete readNotifier;
+	close(fd);
+  }
+#endif
+
+  for (int i = 0; i < TRANSMITTER_BATCH_SIZE; i++)  {
+	if (rxSlots[i]) {
+	  rxSlots[i]->unref();
+	}
+  }
+
+  // Freed once the application has released the last received media
+  if (rxPool) {
+	rxPool->unref();
+  }
+
+  for (int i = 0; i < REASSEMBLY_SLOTS; i++)  {
+	clearMediaFrame(&reassembly[i]);
+  }
+}
+
+
+
+void Transmitter::initSocket()
+{
+  logDebug(LOG_NET) << "in " << __FUNCTION__;
+
+  if (!initBatchedSocket()) {
+	socket.bind(QHostAddress::Any, 0,QUdpSocket::ShareAddress);
+  
+	logInfo(LOG_NET) << "Local address:" << socket.localAddress().toString();
+	logInfo(LOG_NET) << "Local port   :" << socket.localPort();
+
+	connect(&socket, SIGNAL(readyRead()),
+			this, SLOT(readPendingDatagrams()));
+	connect(&socket, SIGNAL(error(QAbstractSocket::SocketError)), 
+			this, SLOT(printError(QAbstractSocket::SocketError)));
+  }
+
+
+  // Start RX/TX timers
+  // FIXME: stop these somewhere?
+  rateTimer.start(1000);
+  rateTime.start();
+  connect(&rateTimer, SIGNAL(timeout()), 
+		  this, SLOT(updateRate()));
+
+}
+
+
+
+/*
+ * Creates a non-blocking socket for the batched datagram I/O. Returns false,
+ * if not supported, in which case the QUdpSocket is used.
+ */
+bool Transmitter::initBatchedSocket(void)
+{
+#ifdef TRANSMITTER_BATCHED_IO
+  if (relayHost.protocol() != QAbstractSocket::IPv4Protocol) {
+	logDebug(LOG_NET) << __FUNCTION__ << ": Relay host not an IPv4 address, not using batched I/O";
+	return false;
+  }
+
+  fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+	qWarning() << __FUNCTION__ << ": Failed to create socket:" << strerror(errno);
+	return false;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = 0;
+
+  socklen_t addrLen = sizeof(addr);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	  getsockname(fd, (struct sockaddr *)&addr, &addrLen) == -1) {
+	qWarning() << __FUNCTION__ << ": Failed to bind socket:" << strerror(errno);
+	close(fd);
+	fd = -1;
+	return false;
+  }
+
+  logInfo(LOG_NET) << "Using batched I/O, local port:" << ntohs(addr.sin_port);
+
+  // Use UDP GSO, if the kernel supports it (Linux 4.18 or newer)
+  int segmentSize = 0;
+  socklen_t optLen = sizeof(segmentSize);
+  gso = (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, &optLen) == 0);
+  logInfo(LOG_NET) << "UDP GSO supported:" << gso;
+
+  // Ring of receive buffers, one per datagram in a batch
+  rxPool = new MediaBufferPool(mtu, TRANSMITTER_RX_POOL_SIZE);
+  for (int i = 0; i < TRANSMITTER_BATCH_SIZE; i++)  {
+	rxSlots[i] = rxPool->get();
+  }
+
+  readNotifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+  connect(readNotifier, SIGNAL(activated(int)), this, SLOT(readBatchedDatagrams()));
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+
+void Transmitter::enableAutoPing(bool enable)
+{
+
+  if (!enable) {
+	// Disable autopinging, if running
+
+	if (autoPing) {
+	  autoPing->stop();
+	  delete autoPing;
+	  autoPing = NULL;
+	}
+	return;
+  }
+  
+  // Start autopinging, if not not running already
+  if (autoPing) {
+	return;
+  }
+
+  autoPing = new QTimer();
+
+  // Send ping every second (sending a high priority package restarts the timer)
+  connect(autoPing, SIGNAL(timeout()), this, SLOT(sendPing()));
+  autoPing->start(1000);
+}
+
+
+
+/*
+ * Enables sending a receiver report of the received media once per second.
+ * Used by the receiver of the video.
+ */
+void Transmitter::enableReceiverReports(bool enable)
+{
+  if (!enable) {
+	if (reportTimer) {
+	  reportTimer->stop();
+	  delete reportTimer;
+	  reportTimer = NULL;
+	}
+	return;
+  }
+
+  if (reportTimer) {
+	return;
+  }
+
+  reportTimer = new QTimer();
+  connect(reportTimer, SIGNAL(timeout()), this, SLOT(sendReceiverReport()));
+  reportTimer->start(1000);
+}
+
+
+
+/*
+ * Batches the periodic values into telemetry messages, sent every periodMs
+ * or when the encoded values exceed maxBytes. Zero period sends each value
+ * in its own message.
+ */
+void Transmitter::enableTelemetryBatching(int periodMs, int maxBytes)
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__ << ", period:" << periodMs << "ms, max bytes:" << maxBytes;
+
+  if (telemetryTimer) {
+	flushTelemetry();
+	delete telemetryTimer;
+	telemetryTimer = NULL;
+  }
+
+  if (periodMs <= 0) {
+	return;
+  }
+
+  telemetryMaxBytes = qBound(1, maxBytes, mtu - TYPE_OFFSET_TELEMETRY_VALUES);
+
+  telemetryTimer = new QTimer();
+  connect(telemetryTimer, SIGNAL(timeout()), this, SLOT(flushTelemetry()));
+  telemetryTimer->start(periodMs);
+}
+
+
+
+/*
+ * Sets the jitterbuffer fill percentage to include in the receiver reports.
+ */
+void Transmitter::setReceiverBufferFill(int percent)
+{
+  bufferFill = qBound(0, percent, 100);
+}
+
+
+
+void Transmitter::setMTU(int newMtu)
+{
+  // Leave space at least for the headers and one byte of media
+  if (newMtu <= TYPE_OFFSET_MEDIA_PAYLOAD || newMtu > TRANSMITTER_MTU_MAX) {
+	qWarning() << __FUNCTION__ << ": Invalid MTU:" << newMtu << ", using the default" << TRANSMITTER_MTU_DEFAULT;
+	newMtu = TRANSMITTER_MTU_DEFAULT;
+  }
+
+  logInfo(LOG_NET) << "Using MTU:" << newMtu;
+
+  mtu = newMtu;
+
+  // The receive buffers of the old size are replaced as they are reused
+  if (rxPool && rxPool->blockSize() != mtu) {
+	rxPool->unref();
+	rxPool = new MediaBufferPool(mtu, TRANSMITTER_RX_POOL_SIZE);
+  }
+}
+
+
+
+/*
+ * Returns the MTU set with the PLECO_MTU environment variable, or the
+ * default. The media payloader uses the same value, so that RTP packets fit
+ * in single datagrams.
+ */
+int Transmitter::configuredMTU(void)
+{
+  char *env = getenv("PLECO_MTU");
+  if (!env) {
+	return TRANSMITTER_MTU_DEFAULT;
+  }
+
+  int newMtu = atoi(env);
+  if (newMtu <= TYPE_OFFSET_MEDIA_PAYLOAD || newMtu > TRANSMITTER_MTU_MAX) {
+	qWarning() << __FUNCTION__ << ": Invalid PLECO_MTU:" << env << ", using the default" << TRANSMITTER_MTU_DEFAULT;
+	return TRANSMITTER_MTU_DEFAULT;
+  }
+
+  return newMtu;
+}
+
+
+
+/*
+ * Enables or disables sending same sized datagrams (e.g. video fragments)
+ * with UDP GSO. Enabled by default, if supported by the kernel.
+ */
+void Transmitter::setGSO(bool enable)
+{
+#ifdef TRANSMITTER_BATCHED_IO
+  if (enable && fd != -1) {
+	int segmentSize = 0;
+	socklen_t optLen = sizeof(segmentSize);
+	if (getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, &optLen) == -1) {
+	  qWarning() << __FUNCTION__ << ": UDP GSO not supported:" << strerror(errno);
+	  enable = false;
+	}
+  }
+
+  gso = enable && fd != -1;
+#else
+  if (enable) {
+	qWarning() << __FUNCTION__ << ": UDP GSO not supported";
+  }
+#endif
+}
+
+
+
+/*
+ * Paces the media to the given rate in kbit/s, dropping the media that has
+ * been queued longer than the deadline. Zero rate disables the pacing.
+ */
+void Transmitter::setMediaPacing(int rateKbps, int deadlineMs)
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__ << ", rate:" << rateKbps << "kbit/s, deadline:" << deadlineMs << "ms";
+
+  pacingRateKbps = qMax(0, rateKbps);
+  mediaDeadlineUs = (qint64)qMax(1, deadlineMs) * 1000;
+  pacingTokens = 0;
+  pacingLastUs = monotonicUs();
+
+  // Release the queued media at the new rate, or all of it
+  paceMedia();
+}
+
+
+
+void Transmitter::sendPing()
+{
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
+
+  Message *msg = new Message(MSG_TYPE_PING);
+  msg->setPingTime((quint32)monotonicUs());
+  lastPingMs = clock.elapsed();
+  sendMessage(msg);
+}
+
+
+
+/*
+ * Sends the media in fragments that fit in the MTU. Takes over the caller's
+ * reference to the buffer, which is released once all fragments have been
+ * written.
+ */
+void Transmitter::sendMedia(MediaBuffer *buffer)
+{
+  logTrace(LOG_MEDIA) << "in" << __FUNCTION__;
+
+  // Split the media into fragments that fit in the MTU
+  int fragSize = mtu - TYPE_OFFSET_MEDIA_PAYLOAD;
+  int count = qMax(1, (buffer->length() + fragSize - 1) / fragSize);
+
+  if (count > MSG_MEDIA_MAX_FRAGMENTS) {
+	qWarning() << __FUNCTION__ << ": Media too big (" << buffer->length() << ") for MTU" << mtu << ", dropping";
+	buffer->unref();
+	return;
+  }
+
+  // All fragments (and the parity) of the frame share the queuing time, so
+  // the pacer drops or sends the frame as a whole
+  quint16 frameId = mediaFrameId++;
+  qint64 queuedUs = monotonicUs();
+  quint32 sendUs = (quint32)queuedUs;
+
+  for (int i = 0; i < count; i++) {
+	// Only the header is built. The payload is never copied, the CRC and
+	// the FEC are calculated over it in place.
+	Message msg(MSG_TYPE_MEDIA);
+
+	msg.setMediaFragment(frameId, i, count);
+	msg.setMediaTimes((quint32)buffer->captureUs(), (quint32)buffer->encodeUs(), sendUs);
+
+	int offset = i * fragSize;
+	const char *payload = buffer->data() + offset;
+	int payloadLength = qMin(fragSize, buffer->length() - offset);
+
+	msg.setCRC(payload, payloadLength);
+
+	// Protect everything after the common header with the FEC
+	bool fecReady = fecEncoder.add(msg.getSeq(),
+								   msg.data()->constData() + TYPE_OFFSET_PAYLOAD,
+								   TYPE_OFFSET_MEDIA_PAYLOAD - TYPE_OFFSET_PAYLOAD,
+								   payload, payloadLength);
+
+	printData(msg.data()->constData(), msg.data()->size());
+
+	// Media is low priority, so there is nothing to resend
+	scheduleDatagram(TX_CLASS_MEDIA, queuedUs, *msg.data(), buffer, payload, payloadLength);
+
+	if (fecReady) {
+	  sendFec(queuedUs);
+	}
+  }
+
+  buffer->unref();
+}
+
+
+
+void Transmitter::setFec(int groupSize, int parityCount)
+{
+  logDebug(LOG_MEDIA) << "in" << __FUNCTION__ << ", group size:" << groupSize << ", parity count:" << parityCount;
+
+  fecEncoder.setGroup(groupSize, parityCount);
+}
+
+
+
+void Transmitter::sendFec(qint64 queuedUs)
+{
+  logTrace(LOG_MEDIA) << "in" << __FUNCTION__;
+
+  for (int i = 0; i < fecEncoder.parityCount(); i++) {
+	Message msg(MSG_TYPE_MEDIA_FEC);
+
+	msg.setFec(fecEncoder.baseSeq(), fecEncoder.count(), i);
+
+	// Append parity data
+	msg.data()->append(*fecEncoder.parity(i));
+
+	msg.setCRC();
+
+	printData(msg.data()->constData(), msg.data()->size());
+
+	// Parity is low priority like the media, nothing to resend
+	scheduleDatagram(TX_CLASS_MEDIA, queuedUs, *msg.data());
+  }
+}
+
+
+
+/*
+ * Reports the media reception statistics to the sender. Loss is calculated
+ * from the media sequence numbers as in RFC 3550, before FEC recovery.
+ */
+void Transmitter::sendReceiverReport(void)
+{
+  if (!mediaSeqInit) {
+	return;
+  }
+
+  quint32 extendedMax = mediaCycles + mediaMaxSeq;
+  quint32 expected = extendedMax - mediaBaseSeq + 1;
+  quint32 lost = expected > mediaReceived ? expected - mediaReceived : 0;
+
+  // Fraction lost since the previous report
+  quint32 expectedInterval = expected - mediaExpectedPrior;
+  quint32 receivedInterval = mediaReceived - mediaReceivedPrior;
+  mediaExpectedPrior = expected;
+  mediaReceivedPrior = mediaReceived;
+
+  quint8 fraction = 0;
+  if (expectedInterval > receivedInterval) {
+	fraction = (quint8)qMin((quint32)255, ((expectedInterval - receivedInterval) << 8) / expectedInterval);
+  }
+
+  logTrace(LOG_MEDIA) << "in" << __FUNCTION__ << ", highest seq:" << mediaMaxSeq << ", lost:" << lost
+					  << ", fraction:" << fraction << ", jitter:" << (quint32)mediaJitterUs << "us";
+
+  Message *msg = new Message(MSG_TYPE_RECEIVER_REPORT);
+  msg->setReceiverReport(mediaMaxSeq, lost, fraction, bufferFill, (quint32)mediaJitterUs);
+  sendMessage(msg);
+}
+
+
+
+void Transmitter::sendDebug(QString *debug)
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
+
+  Message *msg = new Message(MSG_TYPE_DEBUG);
+
+  debug->truncate(MSG_DEBUG_MAX_LEN);
+
+  // Append media payload
+  msg->data()->append(*debug);
+  
+  // FIXME: illogical to delete in sendMedia but not in other send* methods?
+  delete debug;
+
+  sendMessage(msg);
+}
+
+
+
+void Transmitter::sendValue(quint8 subType, quint16 value)
+{
+  logTrace(LOG_NET) << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(subType) << ", value:" << value;
+
+  Message *msg = new Message(MSG_TYPE_VALUE, subType);
+
+  msg->setPayload16(value);
+
+  sendMessage(msg);
+}
+
+
+
+void Transmitter::sendPeriodicValue(quint8 subType, quint16 value)
+{
+  logTrace(LOG_NET) << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(subType) << ", value:" << value;
+
+  if (telemetryTimer) {
+	batchValue(subType, MSG_VALUE_TAG(MSG_VALUE_TYPE_U16, 0), value);
+	return;
+  }
+
+  Message *msg = new Message(MSG_TYPE_PERIODIC_VALUE, subType);
+
+  msg->setPayload16(value);
+
+  sendMessage(msg);
+}
+
+
+
+/*
+ * Sends a periodic value wider than 16 bits, e.g. a 32 bit counter or a
+ * fixed point value. The tag tells the receiver how to decode it.
+ */
+void Transmitter::sendTypedValue(quint8 subType, quint8 tag, qint64 value)
+{
+  logTrace(LOG_NET) << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(subType) << ", tag:" << tag << ", value:" << value;
+
+  if (telemetryTimer) {
+	batchValue(subType, tag, value);
+	return;
+  }
+
+  Message *msg = new Message(MSG_TYPE_TYPED_VALUE, subType);
+
+  msg->setTypedValue(tag, value);
+
+  sendMessage(msg);
+}
+
+
+
+void Transmitter::batchValue(quint8 subType, quint8 tag, qint64 value)
+{
+  telemetryEncoder.set(subType, tag, value);
+  if (telemetryEncoder.encodedSize() >= telemetryMaxBytes) {
+	flushTelemetry();
+  }
+}
+
+
+
+/*
+ * Sends the values that differ from the snapshot last acked by the peer.
+ */
+void Transmitter::flushTelemetry(void)
+{
+  if (!telemetryEncoder.hasChanges()) {
+	return;
+  }
+
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
+
+  Message *msg = new Message(MSG_TYPE_TELEMETRY);
+  msg->setTelemetryBaseline(telemetryEncoder.baselineSeq(), telemetryEncoder.hasBaseline());
+  telemetryEncoder.encode(msg->getSeq(), msg->data(), mtu);
+
+  sendMessage(msg);
+}
+
+
+
+void Transmitter::sendMessage(Message *msg)
+{
+  // Replace the ACK map of a resent message with the current one
+  if (Message::canCarryAckMap(msg->type())) {
+	msg->clearAckMap();
+	if (pendingAcks > 0) {
+	  appendAcks(msg);
+	}
+  }
+
+  msg->setCRC();
+
+  printData(msg->data()->constData(), msg->data()->size());
+
+  scheduleDatagram(txClassOf(msg->type()), monotonicUs(), *msg->data());
+
+  // Reset auto ping timer if sending High Prio (or ack) packet (unless sending a ping).
+  // Pings are still sent regularly for the clock sync.
+  if (autoPing && (msg->isHighPriority() || msg->type() == MSG_TYPE_ACK) && msg->type() != MSG_TYPE_PING &&
+	  clock.elapsed() - lastPingMs < CLOCK_SYNC_INTERVAL_MS) {
+	autoPing->start();
+  }
+
+  // If not a high priority package, all is done
+  if (!msg->isHighPriority()) {
+	delete msg;
+	return;
+  }
+
+  // Fire-and-forget messages are not waited for
+  int deadlineMs;
+  int delivery = Message::deliveryPolicy(msg->fullType(), &deadlineMs);
+  if (delivery == MSG_DELIVERY_UNRELIABLE) {
+	delete msg;
+	return;
+  }
+
+  // Start connection timeout timer
+  startConnectionTimeout();
+
+  int index = resendInsert(msg->fullType());
+  if (index == -1) {
+	qWarning() << __FUNCTION__ << ": Resend table full, not waiting ACK for type" << msg->fullType();
+	delete msg;
+	return;
+  }
+
+  ResendEntry *entry = &resendTable[index];
+
+  // Store pointer to message until it's acked. Only the latest message of
+  // the type is resent, a newer one supersedes the unacked one.
+  if (entry->msg != msg) {
+	delete entry->msg;
+	entry->msg = msg;
+
+	// Start round trip timer for a new message only. The ACK of a resent
+	// message is ambiguous (Karn's algorithm).
+	entry->sentMs = clock.elapsed();
+	entry->retransmitted = false;
+
+	// The deadline runs from queueing the newest value
+	entry->delivery = delivery;
+	entry->deadlineMs = qMax(deadlineMs, RESEND_LATEST_MIN_RTOS * resendTimeoutMs);
+  }
+
+  // Start high priority package resend
+  wheelSchedule(index, resendTimeoutMs);
+}
+
+
+
+/*
+ * Called by the wheel timer. Resends the messages whose resend timeout has
+ * expired since the last call.
+ */
+void Transmitter::processResendWheel(void)
+{
+  quint32 now = (quint32)(clock.elapsed() / RESEND_WHEEL_TICK_MS);
+  quint16 expired[RESEND_TABLE_SIZE];
+  int expiredCount = 0;
+
+  // Visit each slot passed since the last call (at most one round)
+  quint32 ticks = now - wheelTick;
+  if (ticks > RESEND_WHEEL_SLOTS) {
+	ticks = RESEND_WHEEL_SLOTS;
+  }
+
+  for (quint32 t = 1; t <= ticks; t++) {
+	int index = wheel[(wheelTick + t) % RESEND_WHEEL_SLOTS];
+
+	while (index != -1) {
+	  int next = resendTable[index].wheelNext;
+
+	  // Entries due on a later round stay in the slot
+	  if ((qint32)(resendTable[index].dueTick - now) <= 0) {
+		wheelUnlink(index);
+		expired[expiredCount++] = resendTable[index].fullType;
+	  }
+	  index = next;
+	}
+  }
+
+  wheelTick = now;
+
+  // Resend after walking the wheel as resending reschedules. Dropping a
+  // message moves the table entries, so they are looked up by the type.
+  int resent = 0;
+  for (int i = 0; i < expiredCount; i++) {
+	int index = resendFind(expired[i]);
+	if (index == -1) {
+	  continue;
+	}
+
+	ResendEntry *entry = &resendTable[index];
+
+	// Stale commands are harmful, drop them instead of resending
+	qint64 ageMs = clock.elapsed() - entry->sentMs;
+	if (entry->delivery == MSG_DELIVERY_LATEST && ageMs > entry->deadlineMs) {
+	  logDebug(LOG_NET) << __FUNCTION__ << ": Deadline" << entry->deadlineMs << "ms passed for type"
+						<< Message::getTypeStr(expired[i] >> 8) << Message::getSubTypeStr(expired[i] & 0xff)
+						<< ", age" << ageMs << "ms, dropping";
+	  delete entry->msg;
+	  resendRemove(index);
+	  continue;
+	}
+
+	// Back off once per expiry round, not once per expired message
+	if (resent++ == 0) {
+	  backoffRTO();
+	}
+
+	resendMessage(index);
+  }
+}
+
+
+
+void Transmitter::resendMessage(int index)
+{
+  Message *msg = resendTable[index].msg;
+
+  Q_ASSERT(msg != NULL);
+
+  resendTable[index].retransmitted = true;
+
+  emit(resentPackets(++resendCounter));
+
+  if (connectionStatus == CONNECTION_STATUS_OK) {
+	connectionStatus = CONNECTION_STATUS_RETRYING;
+	emit(connectionStatusChanged(connectionStatus));
+  }
+
+  sendMessage(msg);
+}
+
+
+
+/*
+ * Find the resend table index of the full type. Returns -1 if not found.
+ */
+int Transmitter::resendFind(quint16 fullType)
+{
+  int mask = RESEND_TABLE_SIZE - 1;
+  int index = (int)(((quint32)fullType * 2654435761u) >> (32 - RESEND_TABLE_BITS));
+
+  for (int i = 0; i < RESEND_TABLE_SIZE; i++) {
+	ResendEntry *entry = &resendTable[index];
+
+	if (!entry->used) {
+	  return -1;
+	}
+
+	if (entry->fullType == fullType) {
+	  return index;
+	}
+
+	index = (index + 1) & mask;
+  }
+
+  return -1;
+}
+
+
+
+/*
+ * Find or add the full type in the resend table. Returns -1 if the table is
+ * full.
+ */
+int Transmitter::resendInsert(quint16 fullType)
+{
+  int index = resendFind(fullType);
+  if (index != -1) {
+	return index;
+  }
+
+  // Keep one slot free so that lookups always terminate
+  if (resendCount >= RESEND_TABLE_SIZE - 1) {
+	return -1;
+  }
+
+  int mask = RESEND_TABLE_SIZE - 1;
+  index = (int)(((quint32)fullType * 2654435761u) >> (32 - RESEND_TABLE_BITS));
+
+  while (resendTable[index].used) {
+	index = (index + 1) & mask;
+  }
+
+  ResendEntry *entry = &resendTable[index];
+  entry->used = true;
+  entry->scheduled = false;
+  entry->fullType = fullType;
+  entry->msg = NULL;
+  entry->sentMs = 0;
+  entry->retransmitted = false;
+  entry->delivery = MSG_DELIVERY_RELIABLE;
+  entry->deadlineMs = 0;
+
+  resendCount++;
+
+  return index;
+}
+
+
+
+/*
+ * Remove the entry from the resend table. The message is not deleted. Uses
+ * backward shift deletion to keep the probe sequences intact.
+ */
+void Transmitter::resendRemove(int index)
+{
+  int mask = RESEND_TABLE_SIZE - 1;
+
+  wheelUnlink(index);
+  resendTable[index].used = false;
+  resendTable[index].msg = NULL;
+  resendCount--;
+
+  int hole = index;
+  int next = (index + 1) & mask;
+
+  while (resendTable[next].used) {
+	quint16 fullType = resendTable[next].fullType;
+	int home = (int)(((quint32)fullType * 2654435761u) >> (32 - RESEND_TABLE_BITS));
+
+	// Move the entry to the hole, unless its home is cyclically in (hole, next]
+	bool stays = (hole <= next) ? (hole < home && home <= next) : (hole < home || home <= next);
+	if (!stays) {
+	  resendMove(next, hole);
+	  hole = next;
+	}
+
+	next = (next + 1) & mask;
+  }
+
+  if (resendCount == 0) {
+	wheelTimer.stop();
+  }
+}
+
+
+
+/*
+ * Move a resend table entry, keeping its timing wheel links valid
+ */
+void Transmitter::resendMove(int from, int to)
+{
+  ResendEntry *entry = &resendTable[to];
+
+  *entry = resendTable[from];
+
+  if (entry->scheduled) {
+	if (entry->wheelPrev != -1) {
+	  resendTable[entry->wheelPrev].wheelNext = to;
+	} else {
+	  wheel[entry->dueTick % RESEND_WHEEL_SLOTS] = to;
+	}
+
+	if (entry->wheelNext != -1) {
+	  resendTable[entry->wheelNext].wheelPrev = to;
+	}
+  }
+
+  resendTable[from].used = false;
+  resendTable[from].scheduled = false;
+  resendTable[from].msg = NULL;
+}
+
+
+
+/*
+ * (Re)schedule the resend of the entry after the timeout
+ */
+void Transmitter::wheelSchedule(int index, int timeoutMs)
+{
+  ResendEntry *entry = &resendTable[index];
+
+  wheelUnlink(index);
+
+  // Make sure the wheel position is current before scheduling relative to it
+  if (!wheelTimer.isActive()) {
+	wheelTick = (quint32)(clock.elapsed() / RESEND_WHEEL_TICK_MS);
+	wheelTimer.start();
+  }
+
+  quint32 ticks = (timeoutMs + RESEND_WHEEL_TICK_MS - 1) / RESEND_WHEEL_TICK_MS;
+  if (ticks == 0) {
+	ticks = 1;
+  }
+
+  entry->dueTick = wheelTick + ticks;
+  entry->scheduled = true;
+
+  int slot = entry->dueTick % RESEND_WHEEL_SLOTS;
+  entry->wheelPrev = -1;
+  entry->wheelNext = wheel[slot];
+  if (wheel[slot] != -1) {
+	resendTable[wheel[slot]].wheelPrev = index;
+  }
+  wheel[slot] = index;
+}
+
+
+
+void Transmitter::wheelUnlink(int index)
+{
+  ResendEntry *entry = &resendTable[index];
+
+  if (!entry->scheduled) {
+	return;
+  }
+
+  if (entry->wheelPrev != -1) {
+	resendTable[entry->wheelPrev].wheelNext = entry->wheelNext;
+  } else {
+	wheel[entry->dueTick % RESEND_WHEEL_SLOTS] = entry->wheelNext;
+  }
+
+  if (entry->wheelNext != -1) {
+	resendTable[entry->wheelNext].wheelPrev = entry->wheelPrev;
+  }
+
+  entry->scheduled = false;
+}
+
+
+
+void Transmitter::startConnectionTimeout(void)
+{
+  // Start existing timer (if inactive), or create a new one
+  if (!connectionTimeoutTimer) {
+	connectionTimeoutTimer = new QTimer(this);
+	connectionTimeoutTimer->setSingleShot(true);
+	connect(connectionTimeoutTimer, SIGNAL(timeout()), this, SLOT(connectionTimeout()));
+  }
+
+  if (!connectionTimeoutTimer->isActive()) {
+	// FIXME: 4 * resendTimeoutMs but never less than e.g. 2 secs?
+	connectionTimeoutTimer->start(4 * resendTimeoutMs);
+  }
+}
+
+
+/*
+ * Passes the datagram to the send scheduler. Media is queued for pacing, if
+ * enabled, other classes are written right away.
+ */
+void Transmitter::scheduleDatagram(int txClass, qint64 queuedUs, const QByteArray &header, MediaBuffer *payload,
+								   const char *payloadData, int payloadLength)
+{
+  TxClassStats *stats = &txStats[txClass];
+  stats->queued++;
+  stats->maxQueued = qMax(stats->maxQueued, stats->queued);
+
+  if (txClass != TX_CLASS_MEDIA || pacingRateKbps == 0) {
+	writeDatagram(txClass, queuedUs, header, payload, payloadData, payloadLength);
+	return;
+  }
+
+  if (mediaQueueCount == TRANSMITTER_MEDIA_QUEUE_SIZE) {
+	qWarning() << __FUNCTION__ << ": Media queue full, dropping";
+	stats->queued--;
+	stats->dropped++;
+	return;
+  }
+
+  // The copy is implicitly shared, so the data is not copied
+  TxDatagram *dgram = &mediaQueue[(mediaQueueHead + mediaQueueCount) % TRANSMITTER_MEDIA_QUEUE_SIZE];
+  dgram->header = header;
+  dgram->payload = payload;
+  dgram->payloadData = payloadData;
+  dgram->payloadLength = payloadLength;
+  dgram->txClass = txClass;
+  dgram->queuedUs = queuedUs;
+  mediaQueueCount++;
+
+  if (payload) {
+	payload->ref();
+  }
+
+  if (!pacingTimer.isActive()) {
+	paceMedia();
+  }
+}
+
+
+
+/*
+ * Token bucket pacing of the queued media. The bucket holds a few
+ * milliseconds worth of data (at least two datagrams), so short bursts go
+ * out at once.
+ */
+void Transmitter::paceMedia(void)
+{
+  qint64 nowUs = monotonicUs();
+
+  dropStaleMedia(nowUs);
+
+  if (pacingRateKbps > 0) {
+	double bytesPerUs = pacingRateKbps / 8000.0;
+	double burst = qMax(2.0 * mtu, TRANSMITTER_PACING_BURST_MS * 1000 * bytesPerUs);
+
+	pacingTokens = qMin(burst, pacingTokens + (nowUs - pacingLastUs) * bytesPerUs);
+	pacingLastUs = nowUs;
+  }
+
+  while (mediaQueueCount > 0) {
+	TxDatagram *dgram = &mediaQueue[mediaQueueHead];
+	int size = dgram->header.size() + dgram->payloadLength;
+
+	if (pacingRateKbps > 0) {
+	  if (pacingTokens < size) {
+		// Wait until there are enough tokens for the next datagram
+		int waitMs = (int)((size - pacingTokens) * 8 / pacingRateKbps) + 1;
+		pacingTimer.start(waitMs);
+		return;
+	  }
+	  pacingTokens -= size;
+	}
+
+	pacingFrameUs = dgram->queuedUs;
+	writeDatagram(dgram->txClass, dgram->queuedUs, dgram->header, dgram->payload,
+				  dgram->payloadData, dgram->payloadLength);
+
+	// writeDatagram() took its own reference
+	dgram->header.clear();
+	if (dgram->payload) {
+	  dgram->payload->unref();
+	  dgram->payload = NULL;
+	}
+
+	mediaQueueHead = (mediaQueueHead + 1) % TRANSMITTER_MEDIA_QUEUE_SIZE;
+	mediaQueueCount--;
+  }
+
+  pacingTimer.stop();
+}
+
+
+
+/*
+ * Drops the queued media older than the deadline. The fragments of a frame
+ * share the queuing time, so the whole frame is dropped. A frame already
+ * partly sent is finished, the receiver couldn't decode it otherwise.
+ */
+void Transmitter::dropStaleMedia(qint64 nowUs)
+{
+  int dropped = 0;
+
+  while (mediaQueueCount > 0) {
+	TxDatagram *dgram = &mediaQueue[mediaQueueHead];
+	if (nowUs - dgram->queuedUs <= mediaDeadlineUs || dgram->queuedUs == pacingFrameUs) {
+	  break;
+	}
+
+	dgram->header.clear();
+	if (dgram->payload) {
+	  dgram->payload->unref();
+	  dgram->payload = NULL;
+	}
+
+	mediaQueueHead = (mediaQueueHead + 1) % TRANSMITTER_MEDIA_QUEUE_SIZE;
+	mediaQueueCount--;
+	dropped++;
+  }
+
+  if (dropped > 0) {
+	txStats[TX_CLASS_MEDIA].queued -= dropped;
+	txStats[TX_CLASS_MEDIA].dropped += dropped;
+	logDebug(LOG_MEDIA) << __FUNCTION__ << ": Dropped" << dropped << "stale media datagrams";
+  }
+}
+
+
+
+/*
+ * Updates the statistics of the class when its datagram has been handed to
+ * the kernel.
+ */
+void Transmitter::datagramSent(int txClass, qint64 queuedUs, qint64 nowUs)
+{
+  TxClassStats *stats = &txStats[txClass];
+  qint64 delayUs = nowUs - queuedUs;
+
+  stats->queued--;
+  stats->sent++;
+  stats->delaySumUs += delayUs;
+  stats->delayMaxUs = qMax(stats->delayMaxUs, delayUs);
+}
+
+
+
+/*
+ * Sends a datagram consisting of the header and an optional payload. The
+ * payload buffer is referenced until the datagram has been written.
+ */
+void Transmitter::writeDatagram(int txClass, qint64 queuedUs, const QByteArray &header, MediaBuffer *payload,
+								const char *payloadData, int payloadLength)
+{
+#ifdef TRANSMITTER_BATCHED_IO
+  if (fd != -1) {
+	int pos = txQueued++;
+
+	// Strict priority: go before the queued datagrams of lower classes
+	while (pos > 0 && txQueue[pos - 1].txClass > txClass) {
+	  txQueue[pos] = txQueue[pos - 1];
+	  pos--;
+	}
+
+	TxDatagram *dgram = &txQueue[pos];
+
+	// The copy is implicitly shared, so the data is not copied unless the
+	// message is modified (e.g. resent) before the queue is flushed.
+	dgram->header = header;
+	dgram->payload = payload;
+	dgram->payloadData = payloadData;
+	dgram->payloadLength = payloadLength;
+	dgram->txClass = txClass;
+	dgram->queuedUs = queuedUs;
+
+	if (payload) {
+	  payload->ref();
+	}
+
+	if (txQueued == TRANSMITTER_BATCH_SIZE) {
+	  flushTxQueue();
+	} else if (!txFlushTimer.isActive()) {
+	  txFlushTimer.start();
+	}
+	return;
+  }
+#endif
+
+  int tx;
+  if (payloadLength > 0) {
+	QByteArray data(header);
+	data.append(payloadData, payloadLength);
+	tx = socket.writeDatagram(data, relayHost, relayPort);
+  } else {
+	tx = socket.writeDatagram(header, relayHost, relayPort);
+  }
+
+  datagramSent(txClass, queuedUs, monotonicUs());
+
+  if (tx == -1) {
+	qWarning() << "Failed to writeDatagram:" << socket.errorString();
+  } else {
+	payloadSent += tx;
+	totalSent += tx + 28; // UDP + IPv4 headers.
+	txCalls++;
+	txDatagrams++;
+  }
+}
+
+
+
+/*
+ * Writes all queued datagrams with as few sendmmsg() calls as possible.
+ *
+ * Each datagram is written from one or two iovecs: the header and the
+ * payload buffer.
+ *
+ * With UDP GSO, consecutive datagrams of the same size (e.g. the fragments
+ * of a video frame) are given to the kernel as one buffer with the segment
+ * size. Only the last segment of such a run may be shorter.
+ */
+void Transmitter::flushTxQueue(void)
+{
+#ifdef TRANSMITTER_BATCHED_IO
+  if (txQueued == 0) {
+	return;
+  }
+
+  txFlushTimer.stop();
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(relayHost.toIPv4Address());
+  addr.sin_port = htons(relayPort);
+
+  struct mmsghdr msgs[TRANSMITTER_BATCH_SIZE];
+  struct iovec iovecs[2 * TRANSMITTER_BATCH_SIZE];
+
+  // First iovec and size of each datagram
+  int iovStart[TRANSMITTER_BATCH_SIZE + 1];
+  int sizes[TRANSMITTER_BATCH_SIZE];
+
+  // UDP_SEGMENT control message for each GSO run
+  union {
+	char buf[CMSG_SPACE(sizeof(quint16))];
+	struct cmsghdr align;
+  } control[TRANSMITTER_BATCH_SIZE];
+
+  // First datagram and the number of datagrams in each mmsghdr
+  int first[TRANSMITTER_BATCH_SIZE];
+  int segments[TRANSMITTER_BATCH_SIZE];
+
+  int iov = 0;
+  for (int i = 0; i < txQueued; i++) {
+	TxDatagram *dgram = &txQueue[i];
+
+	iovStart[i] = iov;
+	iovecs[iov].iov_base = (void *)dgram->header.constData();
+	iovecs[iov].iov_len = dgram->header.size();
+	iov++;
+
+	if (dgram->payloadLength > 0) {
+	  iovecs[iov].iov_base = (void *)dgram->payloadData;
+	  iovecs[iov].iov_len = dgram->payloadLength;
+	  iov++;
+	}
+
+	sizes[i] = dgram->header.size() + dgram->payloadLength;
+  }
+  iovStart[txQueued] = iov;
+
+  int sent = 0;
+  while (sent < txQueued) {
+	int count = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (int i = sent; i < txQueued; count++) {
+	  int size = sizes[i];
+	  int n = 1;
+	  int bytes = size;
+
+	  if (gso) {
+		while (i + n < txQueued && n < TRANSMITTER_GSO_MAX_SEGMENTS &&
+			   sizes[i + n] <= size &&
+			   bytes + sizes[i + n] <= TRANSMITTER_GSO_MAX_BYTES) {
+		  bytes += sizes[i + n];
+		  n++;
+		  // A shorter segment ends the run
+		  if (sizes[i + n - 1] < size) {
+			break;
+		  }
+		}
+	  }
+
+	  msgs[count].msg_hdr.msg_name = &addr;
+	  msgs[count].msg_hdr.msg_namelen = sizeof(addr);
+	  msgs[count].msg_hdr.msg_iov = &iovecs[iovStart[i]];
+	  msgs[count].msg_hdr.msg_iovlen = iovStart[i + n] - iovStart[i];
+
+	  if (n > 1) {
+		msgs[count].msg_hdr.msg_control = control[count].buf;
+		msgs[count].msg_hdr.msg_controllen = sizeof(control[count].buf);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[count].msg_hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(quint16));
+		quint16 segmentSize = size;
+		memcpy(CMSG_DATA(cmsg), &segmentSize, sizeof(segmentSize));
+	  }
+
+	  first[count] = i;
+	  segments[count] = n;
+	  i += n;
+	}
+
+	int ret = sendmmsg(fd, msgs, count, 0);
+	if (ret == -1) {
+	  if (errno == EINTR) {
+		continue;
+	  }
+
+	  // Kernel or the device does not support the segmentation. Resend
+	  // without it.
+	  if (segments[0] > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+		qWarning() << __FUNCTION__ << ": UDP GSO rejected (" << strerror(errno) << "), disabling";
+		gso = false;
+		continue;
+	  }
+
+	  // Drop the rest, like a failed writeDatagram would
+	  qWarning() << __FUNCTION__ << ": Failed to send" << (txQueued - sent) << "datagrams:" << strerror(errno);
+	  break;
+	}
+
+	for (int i = 0; i < ret; i++) {
+	  payloadSent += msgs[i].msg_len;
+	  totalSent += msgs[i].msg_len + 28 * segments[i]; // UDP + IPv4 headers.
+	  txDatagrams += segments[i];
+	}
+
+	txCalls++;
+	sent = first[ret - 1] + segments[ret - 1];
+  }
+
+  // Release the data
+  qint64 nowUs = monotonicUs();
+  for (int i = 0; i < txQueued; i++) {
+	datagramSent(txQueue[i].txClass, txQueue[i].queuedUs, nowUs);
+	txQueue[i].header.clear();
+	if (txQueue[i].payload) {
+	  txQueue[i].payload->unref();
+	  txQueue[i].payload = NULL;
+	}
+  }
+  txQueued = 0;
+#endif
+}
+
+
+
+/*
+ * Drains the socket with recvmmsg(). The datagrams are parsed straight from
+ * the receive buffers, which are reused for the next batch unless the
+ * application still holds a slice of them. Those are replaced from the pool.
+ */
+void Transmitter::readBatchedDatagrams(void)
+{
+#ifdef TRANSMITTER_BATCHED_IO
+  struct mmsghdr msgs[TRANSMITTER_BATCH_SIZE];
+  struct iovec iovecs[TRANSMITTER_BATCH_SIZE];
+
+  forever {
+	memset(msgs, 0, sizeof(msgs));
+
+	for (int i = 0; i < TRANSMITTER_BATCH_SIZE; i++) {
+	  // Replace the buffers still in use or sized for an old MTU
+	  if (rxSlots[i]->isShared() || rxSlots[i]->length() != rxPool->blockSize()) {
+		rxSlots[i]->unref();
+		rxSlots[i] = rxPool->get();
+	  }
+
+	  iovecs[i].iov_base = rxSlots[i]->data();
+	  iovecs[i].iov_len = rxSlots[i]->length();
+	  msgs[i].msg_hdr.msg_iov = &iovecs[i];
+	  msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int ret = recvmmsg(fd, msgs, TRANSMITTER_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (ret == -1) {
+	  if (errno == EINTR) {
+		continue;
+	  }
+	  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		qWarning() << __FUNCTION__ << ": Failed to receive datagrams:" << strerror(errno);
+	  }
+	  return;
+	}
+
+	logTrace(LOG_NET) << "in" << __FUNCTION__ << ", datagrams:" << ret;
+
+	rxCalls++;
+	rxDatagrams += ret;
+
+	for (int i = 0; i < ret; i++) {
+	  int rx = msgs[i].msg_len;
+
+	  payloadRecv += rx;
+	  totalRecv += rx + 28; // UDP + IPv4 headers
+
+	  if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+		qWarning() << __FUNCTION__ << ": Datagram bigger than the MTU" << rxSlots[i]->length() << "bytes, ignoring";
+		continue;
+	  }
+
+	  printData(rxSlots[i]->data(), rx);
+
+	  parseData(rxSlots[i]->data(), rx, rxSlots[i]);
+	}
+
+	// Socket drained
+	if (ret < TRANSMITTER_BATCH_SIZE) {
+	  return;
+	}
+  }
+#endif
+}
+
+
+
+void Transmitter::readPendingDatagrams()
+{
+  while (socket.hasPendingDatagrams()) {
+	QHostAddress sender;
+	quint16 senderPort;
+
+	logTrace(LOG_NET) << "in" << __FUNCTION__;
+
+	MediaBuffer *datagram = new MediaBuffer(socket.pendingDatagramSize());
+	
+	int rx = socket.readDatagram(datagram->data(), datagram->length(), &sender, &senderPort);
+	if (rx == -1) {
+	  qWarning() << "Failed to readDatagram:" << socket.errorString();
+	  datagram->unref();
+	  continue;
+	} 
+
+	payloadRecv += rx;
+	totalRecv += rx + 28; // UDP + IPv4 headers
+	rxCalls++;
+	rxDatagrams++;
+
+	logTrace(LOG_NET) << "Sender:" << sender.toString() << ", port:" << senderPort;
+	printData(datagram->data(), rx);
+
+	parseData(datagram->data(), rx, datagram);
+
+	// Slices given to the application keep the data alive
+	datagram->unref();
+  }
+}
+
+
+void Transmitter::printError(QAbstractSocket::SocketError error)
+{
+  logDebug(LOG_NET) << "Socket error (" << error << "):" << socket.errorString();
+}
+
+
+
+void Transmitter::printData(const char *data, int length)
+{
+  if (!LOG_ENABLED(LOG_LEVEL_TRACE, LOG_NET)) {
+	return;
+  }
+
+  logTrace(LOG_NET) << "in" << __FUNCTION__ << ", data len:" << length;
+
+  if (length > 32) {
+	logTrace(LOG_NET) << "Big packet (video?), not printing content";
+  } else {
+	logTrace(LOG_NET) << QByteArray::fromRawData(data, length).toHex();
+  }
+}
+
+
+
+/*
+ * Parses a received datagram in place. Media is passed on as slices of the
+ * buffer, if given.
+ */
+void Transmitter::parseData(const char *data, int length, MediaBuffer *buffer)
+{
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
+
+  rxTimeUs = monotonicUs();
+
+  MessageView msg(data, length, buffer);
+
+  // isValid() also checks that the packet is exactly as long as expected
+  if (!msg.isValid()) {
+	qWarning() << "Package not valid, ignoring";
+	return;
+  }
+
+  logTrace(LOG_NET) << __FUNCTION__ << ": type:" << Message::getTypeStr((int)msg.type());
+
+  // New data -> connection ok
+  if (connectionStatus != CONNECTION_STATUS_OK) {
+	connectionStatus = CONNECTION_STATUS_OK;
+	emit(connectionStatusChanged(connectionStatus));
+  }
+
+  // Stop connection timeout timer as we got something from the slave
+  if (connectionTimeoutTimer && connectionTimeoutTimer->isActive()) {
+	connectionTimeoutTimer->stop();
+  }
+
+  // Check, whether to ACK the packet. Pings are ACKed right away for the
+  // clock sync, the rest (except fire-and-forget) are held back to be sent
+  // together.
+  if (msg.type() == MSG_TYPE_PING) {
+	sendACK(msg);
+  } else if (msg.isHighPriority() && Message::deliveryPolicy(msg.fullType()) != MSG_DELIVERY_UNRELIABLE) {
+	queueAck(msg);
+  }
+
+  // Handle different message types in different methods
+  if (messageHandlers[msg.type()]) {
+	messageHandler func = messageHandlers[msg.type()];
+	(this->*func)(msg);
+  } else {
+	qWarning() << "No message handler for type" << Message::getTypeStr(msg.type()) << ", ignoring";
+  }  
+
+  // ACKs can be carried in any message of a fixed length type
+  int ackMap = msg.ackMapOffset();
+  if (ackMap != -1) {
+	processAckMap(msg, ackMap);
+  }
+}
+
+
+
+void Transmitter::sendACK(MessageView &incoming)
+{
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
+
+  Message *msg = new Message(MSG_TYPE_ACK);
+
+  // Sets CRC as well
+  msg->setACK(incoming);
+
+  // Timestamps for the peer's clock sync. sendMessage() updates the CRC.
+  if (incoming.type() == MSG_TYPE_PING) {
+	msg->setAckPingTimes(incoming.getPingTime(), (quint32)rxTimeUs, (quint32)monotonicUs());
+  }
+
+  sendMessage(msg);
+}
+
+
+
+/*
+ * Records the received high priority (or telemetry) message for the next
+ * ACK map. The map
+ * is sent when it's full, when the ACK delay expires or appended to the
+ * next suitable outgoing message, whichever comes first.
+ */
+void Transmitter::queueAck(MessageView &incoming)
+{
+  quint16 fullType = incoming.fullType();
+  quint16 seq = incoming.getSeq();
+  AckState *state = NULL;
+  AckState *unused = NULL;
+  AckState *oldest = NULL;
+
+  for (int i = 0; i < ACK_STATE_SIZE; i++) {
+	AckState *s = &ackStates[i];
+	if (!s->used) {
+	  if (!unused) {
+		unused = s;
+	  }
+	} else if (s->fullType == fullType) {
+	  state = s;
+	  break;
+	} else if (!s->pending && (!oldest || s->receivedUs < oldest->receivedUs)) {
+	  oldest = s;
+	}
+  }
+
+  if (!state) {
+	// Forget the type received longest ago, if there's no space
+	state = unused ? unused : oldest;
+	if (!state) {
+	  flushAcks();
+	  state = &ackStates[0];
+	}
+	state->used = true;
+	state->pending = false;
+	state->fullType = fullType;
+	state->seq = seq;
+	state->bitmap = 0;
+  }
+
+  quint16 newer = seq - state->seq;
+  quint16 older = state->seq - seq;
+
+  if (newer > 0 && newer < 0x8000) {
+	// Bit n - 1 for the previous latest, which is now n behind
+	state->bitmap = (newer > 16) ? 0 : (quint16)((state->bitmap << newer) | (1 << (newer - 1)));
+	state->seq = seq;
+	state->receivedUs = rxTimeUs;
+  } else if (older > 0 && older <= 16) {
+	// Reordered
+	state->bitmap |= 1 << (older - 1);
+  } else {
+	// The latest resent or the sender has restarted its sequence numbers
+	if (older != 0) {
+	  state->bitmap = 0;
+	  state->seq = seq;
+	}
+	state->receivedUs = rxTimeUs;
+  }
+
+  if (!state->pending) {
+	state->pending = true;
+	pendingAcks++;
+  }
+
+  if (pendingAcks >= ACK_MAP_MAX_ENTRIES) {
+	flushAcks();
+  } else if (!ackTimer.isActive()) {
+	ackTimer.start();
+  }
 }
 
 
 
-Transmitter::~Transmitter()
+/*
+ * Appends the pending ACKs to the message.
+ */
+void Transmitter::appendAcks(Message *msg)
 {
-  qDebug() << "in" << __FUNCTION__;
+  qint64 nowUs = monotonicUs();
 
-  delete resendSignalMapper;
-
-  // Delete the timers 
-  for (int i = 0; i < MSG_TYPE_SUBTYPE_MAX; i++)  {
-	delete rtTimers[i];
-	rtTimers[i] = NULL;
+  for (int i = 0; i < ACK_STATE_SIZE && pendingAcks > 0; i++) {
+	AckState *state = &ackStates[i];
+	if (!state->pending) {
+	  continue;
+	}
 
-	delete resendTimers[i];
-	resendTimers[i] = NULL;
+	quint16 delayUs = (quint16)qMin(nowUs - state->receivedUs, (qint64)0xffff);
+	msg->addAckMapEntry(state->fullType, state->seq, state->bitmap, delayUs);
 
-	messageHandlers[i] = NULL;
+	state->pending = false;
+	pendingAcks--;
   }
 
+  ackTimer.stop();
 }
 
 
 
-void Transmitter::initSocket()
+/*
+ * Sends the pending ACKs in an ACK map message, if they were not carried
+ * by other messages within the ACK delay.
+ */
+void Transmitter::flushAcks(void)
 {
-  qDebug() << "in " << __FUNCTION__;
-
-  socket.bind(QHostAddress::Any, 0,QUdpSocket::ShareAddress);
-  
-  qDebug() << "Local address:" << socket.localAddress().toString();
-  qDebug() << "Local port   :" << socket.localPort();
-
-  connect(&socket, SIGNAL(readyRead()),
-		  this, SLOT(readPendingDatagrams()));
-  connect(&socket, SIGNAL(error(QAbstractSocket::SocketError)), 
-		  this, SLOT(printError(QAbstractSocket::SocketError)));
-
+  if (pendingAcks == 0) {
+	return;
+  }
 
-  // Start RX/TX timers
-  // FIXME: stop these somewhere?
-  rateTimer.start(1000);
-  rateTime.start();
-  connect(&rateTimer, SIGNAL(timeout()), 
-		  this, SLOT(updateRate()));
+  logTrace(LOG_NET) << "in" << __FUNCTION__ << ", ACKs:" << pendingAcks;
 
+  Message *msg = new Message(MSG_TYPE_ACK_MAP);
+  appendAcks(msg);
+  sendMessage(msg);
 }
 
 
 
-void Transmitter::enableAutoPing(bool enable)
+void Transmitter::handleACK(MessageView &msg)
 {
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
 
-  if (!enable) {
-	// Disable autopinging, if running
+  quint16 ackedFullType = msg.getAckedFullType();
+  quint16 ackedCRC = msg.getAckedCRC();
 
-	if (autoPing) {
-	  autoPing->stop();
-	  delete autoPing;
-	  autoPing = NULL;
-	}
-	return;
+  // The timestamps are valid also in an ACK of an older (resent) ping
+  if ((ackedFullType >> 8) == MSG_TYPE_PING && msg.length() >= MSG_PING_ACK_LENGTH) {
+	updateClockSync(msg);
   }
-  
-  // Start autopinging, if not not running already
-  if (autoPing) {
+
+  int index = resendFind(ackedFullType);
+  if (index == -1) {
+	qWarning() << "No message waiting for ACK for type" << ackedFullType;
 	return;
   }
 
-  autoPing = new QTimer();
+  ResendEntry *entry = &resendTable[index];
 
-  // Send ping every second (sending a high priority package restarts the timer)
-  connect(autoPing, SIGNAL(timeout()), this, SLOT(sendPing()));
-  autoPing->start(1000);
+  // If the ack is not for the latest msg, ignore it
+  if (!entry->msg->matchCRC(ackedCRC)) {
+	// We got ack, just not for the latest package. Restart timer to avoid continuous resends.
+	wheelSchedule(index, resendTimeoutMs);
+	logDebug(LOG_NET) << __FUNCTION__ << ": acked CRC does not match for type:" << ackedFullType;
+	return;
+  }
+
+  acknowledge(index, 0);
 }
 
 
 
-void Transmitter::sendPing()
+void Transmitter::handleAckMap(MessageView &)
 {
-  qDebug() << "in" << __FUNCTION__;
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
 
-  Message *msg = new Message(MSG_TYPE_PING);
-  sendMessage(msg);
+  // The ACK map is processed in parseData() with the ones appended to other
+  // messages. This handler is here to avoid missing handler warning.
 }
 
 
 
-void Transmitter::sendMedia(QByteArray *media)
+/*
+ * Acknowledges the messages waiting for an ACK whose seq is the latest in
+ * an entry of the ACK map or marked in its bitmap.
+ */
+void Transmitter::processAckMap(MessageView &msg, int offset)
 {
-  qDebug() << "in" << __FUNCTION__;
+  int count = msg.getAckMapCount(offset);
 
-  Message *msg = new Message(MSG_TYPE_MEDIA);
+  for (int i = 0; i < count; i++) {
+	quint16 fullType = msg.getAckMapFullType(offset, i);
+	quint16 seq = msg.getAckMapSeq(offset, i);
+	quint16 bitmap = msg.getAckMapBitmap(offset, i);
 
-  // Append media payload
-  msg->data()->append(*media);
-  
-  // FIXME: illogical to delete in sendMedia but not in other send* methods?
-  delete media;
+	// Telemetry is not resent, the ACK moves the delta encoding baseline
+	if ((fullType >> 8) == MSG_TYPE_TELEMETRY) {
+	  telemetryEncoder.acked(seq, bitmap);
+	  continue;
+	}
 
-  sendMessage(msg);
+	int index = resendFind(fullType);
+	if (index == -1) {
+	  // Already acked in an earlier map
+	  continue;
+	}
+
+	ResendEntry *entry = &resendTable[index];
+	quint16 behind = seq - entry->msg->getSeq();
+
+	if (behind != 0 && (behind > 16 || !(bitmap & (1 << (behind - 1))))) {
+	  // We got ack, just not for the latest package. Restart timer to avoid continuous resends.
+	  wheelSchedule(index, resendTimeoutMs);
+	  logDebug(LOG_NET) << __FUNCTION__ << ": acked seq" << seq << "does not match for type:" << fullType;
+	  continue;
+	}
+
+	acknowledge(index, msg.getAckMapDelay(offset, i) / 1000);
+  }
 }
 
 
 
-void Transmitter::sendDebug(QString *debug)
+/*
+ * The message in the resend table has been acked.
+ */
+void Transmitter::acknowledge(int index, int ackDelayMs)
 {
-  qDebug() << "in" << __FUNCTION__;
+  ResendEntry *entry = &resendTable[index];
 
-  Message *msg = new Message(MSG_TYPE_DEBUG);
+  // Send RTT signal and update the resend timeout, unless the message was
+  // resent and the RTT would be ambiguous. The time the peer held back the
+  // ACK is not part of the RTT.
+  if (!entry->retransmitted) {
+	int rttMs = qMax(0, (int)(clock.elapsed() - entry->sentMs) - ackDelayMs);
 
-  debug->truncate(MSG_DEBUG_MAX_LEN);
+	emit(rtt(rttMs));
 
-  // Append media payload
-  msg->data()->append(*debug);
-  
-  // FIXME: illogical to delete in sendMedia but not in other send* methods?
-  delete debug;
+	updateRTO(rttMs);
+  }
 
-  sendMessage(msg);
+  // Delete the message waiting for resend and stop its resend timer
+  delete entry->msg;
+  resendRemove(index);
 }
 
 
 
-void Transmitter::sendValue(quint8 subType, quint16 value)
+/*
+ * Update the smoothed RTT, RTT variance and the resend timeout (RTO) from a
+ * new RTT sample as in RFC 6298 (Jacobson/Karels).
+ */
+void Transmitter::updateRTO(int rttMs)
 {
-  qDebug() << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(subType) << ", value:" << value;
+  if (!rttSampled) {
+	srttMs = rttMs;
+	rttVarMs = rttMs / 2.0;
+	rttSampled = true;
+  } else {
+	rttVarMs = 0.75 * rttVarMs + 0.25 * qAbs(srttMs - rttMs);
+	srttMs = 0.875 * srttMs + 0.125 * rttMs;
+  }
 
-  Message *msg = new Message(MSG_TYPE_VALUE, subType);
+  // The variance term is at least the resend timer granularity. The peer
+  // may hold back the ACK for up to the max ACK delay.
+  resendTimeoutMs = (int)(srttMs + qMax((double)RESEND_WHEEL_TICK_MS, 4 * rttVarMs)) + ACK_MAX_DELAY_MS;
+  resendTimeoutMs = qBound(RESEND_TIMEOUT_MIN, resendTimeoutMs, RESEND_TIMEOUT_MAX);
 
-  msg->setPayload16(value);
+  emit(resendTimeout(resendTimeoutMs));
+  emit(rttEstimate((int)srttMs, (int)rttVarMs, resendTimeoutMs));
 
-  sendMessage(msg);
+  logTrace(LOG_NET) << "New resend timeout:" << resendTimeoutMs << ", srtt:" << srttMs << ", rttvar:" << rttVarMs;
 }
 
 
 
-void Transmitter::sendPeriodicValue(quint8 subType, quint16 value)
+/*
+ * Double the resend timeout after a resend timer has expired. The next valid
+ * RTT sample recalculates it.
+ */
+void Transmitter::backoffRTO(void)
 {
-  qDebug() << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(subType) << ", value:" << value;
-
-  Message *msg = new Message(MSG_TYPE_PERIODIC_VALUE, subType);
+  resendTimeoutMs = qMin(2 * resendTimeoutMs, RESEND_TIMEOUT_MAX);
 
-  msg->setPayload16(value);
+  emit(resendTimeout(resendTimeoutMs));
+  emit(rttEstimate((int)srttMs, (int)rttVarMs, resendTimeoutMs));
 
-  sendMessage(msg);
+  logDebug(LOG_NET) << "Backed off resend timeout:" << resendTimeoutMs;
 }
 
 
 
-void Transmitter::sendMessage(Message *msg)
+void Transmitter::handlePing(MessageView &)
 {
-  msg->setCRC();
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
 
-  printData(msg->data());
+  // We don't do anything with ping (ACKing it is enough, the ACK carries the
+  // timestamps for the clock sync).
+  // This handler is here to avoid missing handler warning.
+}
 
-  int tx = socket.writeDatagram(*msg->data(), relayHost, relayPort);
-  if (tx == -1) {
-	qWarning() << "Failed to writeDatagram:" << socket.errorString();
-  } else {
-	payloadSent += tx;
-	totalSent += tx + 28; // UDP + IPv4 headers.
-  }
 
-  // Reset auto ping timer if sending High Prio (or ack) packet (unless sending a ping)
-  if (autoPing && (msg->isHighPriority() || msg->type() == MSG_TYPE_ACK) && msg->type() != MSG_TYPE_PING) {
-	autoPing->start();
-  }
 
-  // If not a high priority package, all is done
-  if (!msg->isHighPriority()) {
-	delete msg;
+/*
+ * NTP style clock sync from the ACK of our ping: the ping's send time (our
+ * clock), the peer's receive and ACK send times (peer's clock) and the ACK
+ * receive time (our clock).
+ */
+void Transmitter::updateClockSync(MessageView &msg)
+{
+  if (!peerClock.addSample(msg.getAckPingTime(), msg.getAckReceiveTime(), msg.getAckSendTime(),
+						   (quint32)rxTimeUs, rxTimeUs)) {
 	return;
   }
 
-  // Start connection timeout timer
-  startConnectionTimeout();
-
-  // Store pointer to message until it's acked
-  if (resendMessages[msg->fullType()]) {
-	delete resendMessages[msg->fullType()];
-  }
-  resendMessages[msg->fullType()] = msg;
+  quint32 offsetUs = peerClock.offsetUs(rxTimeUs);
 
-  // Start high priority package resend
-  startResendTimer(msg);
+  logTrace(LOG_NET) << __FUNCTION__ << ": clock offset:" << (qint32)offsetUs << "us, drift:"
+					<< peerClock.driftPpm() << "ppm, accuracy:" << peerClock.accuracyUs() << "us";
 
-  // Start (or restart) round trip timer
-  startRTTimer(msg);
+  emit(clockSync(offsetUs, peerClock.driftPpm(), peerClock.accuracyUs()));
 }
 
 
 
-void Transmitter::resendMessage(QObject *msgobj)
+void Transmitter::handleMedia(MessageView &msg)
 {
-  Message *msg = dynamic_cast<Message *>(msgobj);
-
-  Q_ASSERT(resendMessages[msg->fullType()] != NULL);
-
-  emit(resentPackets(++resendCounter));
-
-  if (connectionStatus == CONNECTION_STATUS_OK) {
-	connectionStatus = CONNECTION_STATUS_RETRYING;
-	emit(connectionStatusChanged(connectionStatus));
+  logTrace(LOG_MEDIA) << "in" << __FUNCTION__;
+
+  updateReceiverStats(msg);
+  updateLatency(msg);
+
+  // Always store the media for recovery. The parity of a group is sent
+  // after it, so the first group would be lost if stored only once parity
+  // has been received.
+  if (!fecDecoder.add(msg.getSeq(),
+					  msg.data() + TYPE_OFFSET_PAYLOAD,
+					  msg.length() - TYPE_OFFSET_PAYLOAD)) {
+	logTrace(LOG_MEDIA) << __FUNCTION__ << ": Media" << msg.getSeq() << "already received or recovered";
+	return;
   }
-  resendMessages[msg->fullType()] = NULL;
 
-  sendMessage(msg);
+  processMedia(msg);
 }
 
 
 
-void Transmitter::startResendTimer(Message *msg)
+/*
+ * Tracks the highest media sequence number, the number of received media
+ * messages and the interarrival jitter. There's no send timestamp in the
+ * media messages, so the jitter is the smoothed deviation of the arrival
+ * interval from its mean.
+ */
+void Transmitter::updateReceiverStats(MessageView &msg)
 {
-  quint16 fullType = msg->fullType();
-
-  // Restart existing timer, or create a new one
-  if (!resendTimers[fullType]) {
-	resendTimers[fullType] = new QTimer(this);
-
-	// Connect to resend timeout through a signal mapper
-	connect(resendTimers[fullType], SIGNAL(timeout()), resendSignalMapper, SLOT(map()));
-  }
+  quint16 seq = msg.getSeq();
+  qint64 arrivalUs = clock.nsecsElapsed() / 1000;
+
+  if (!mediaSeqInit) {
+	mediaSeqInit = true;
+	mediaMaxSeq = seq;
+	mediaCycles = 0;
+	mediaBaseSeq = seq;
+	mediaReceived = 0;
+	mediaExpectedPrior = 0;
+	mediaReceivedPrior = 0;
+	mediaLastArrivalUs = arrivalUs;
+	mediaMeanIntervalUs = 0;
+	mediaJitterUs = 0;
+  } else {
+	quint16 delta = seq - mediaMaxSeq;
+	if (delta > 0 && delta < 0x8000) {
+	  // Sequence number wrapped around
+	  if (seq < mediaMaxSeq) {
+		mediaCycles += 0x10000;
+	  }
+	  mediaMaxSeq = seq;
+	}
 
-  // If there is existing mapping, free it before setting a new one
-  QObject *existing = resendSignalMapper->mapping(resendTimers[fullType]);
-  if (existing) {
-	qDebug() << "deleting existing";
-	delete existing;
+	double interval = arrivalUs - mediaLastArrivalUs;
+	mediaLastArrivalUs = arrivalUs;
+	mediaMeanIntervalUs += (interval - mediaMeanIntervalUs) / 16;
+	mediaJitterUs += (qAbs(interval - mediaMeanIntervalUs) - mediaJitterUs) / 16;
   }
 
-  resendSignalMapper->setMapping(resendTimers[fullType], msg);
-
-  resendTimers[fullType]->start(resendTimeoutMs);
+  mediaReceived++;
 }
 
 
 
-void Transmitter::startRTTimer(Message *msg)
+/*
+ * Collects the latencies of the sender's stages and of the network from the
+ * media timestamps. The network latency requires the clock offset. Sampled
+ * from the first received fragment of each frame, so that each frame
+ * counts once.
+ */
+void Transmitter::updateLatency(MessageView &msg)
 {
-  quint16 fullType = msg->fullType();
-
-  // Restart existing stopwatch, or create a new one
-  if (rtTimers[fullType]) {
-	rtTimers[fullType]->restart();
-  } else {
-	rtTimers[fullType] = new QTime();
-	rtTimers[fullType]->start();
+  if (msg.getMediaFrameId() == latencyFrameId) {
+	return;
   }
-}
-
+  latencyFrameId = msg.getMediaFrameId();
 
+  quint32 receiveUs = (quint32)monotonicUs();
+  quint32 captureUs = msg.getMediaCaptureTime();
+  quint32 encodeUs = msg.getMediaEncodeTime();
+  quint32 sendUs = msg.getMediaSendTime();
 
-void Transmitter::startConnectionTimeout(void)
-{
-  // Start existing timer (if inactive), or create a new one
-  if (!connectionTimeoutTimer) {
-	connectionTimeoutTimer = new QTimer(this);
-	connectionTimeoutTimer->setSingleShot(true);
-	connect(connectionTimeoutTimer, SIGNAL(timeout()), this, SLOT(connectionTimeout()));
+  // Zero timestamps are not known by the sender
+  if (encodeUs != 0) {
+	if (captureUs != 0) {
+	  latencyStats.stage[LATENCY_CAPTURE_TO_ENCODE].add((qint32)(encodeUs - captureUs));
+	}
+	latencyStats.stage[LATENCY_ENCODE_TO_SEND].add((qint32)(sendUs - encodeUs));
   }
 
-  if (!connectionTimeoutTimer->isActive()) {
-	// FIXME: 4 * resendTimeoutMs but never less than e.g. 2 secs?
-	connectionTimeoutTimer->start(4 * resendTimeoutMs);
+  if (peerClock.isValid()) {
+	latencyStats.stage[LATENCY_NETWORK].add((qint32)(receiveUs - peerClock.toLocal(sendUs, rxTimeUs)));
   }
 }
 
 
-void Transmitter::readPendingDatagrams()
-{
-  while (socket.hasPendingDatagrams()) {
-	QByteArray datagram;
-	QHostAddress sender;
-	quint16 senderPort;
-
-	qDebug() << "in" << __FUNCTION__;
-
-	datagram.resize(socket.pendingDatagramSize());
-	
-	int rx = socket.readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
-	if (rx == -1) {
-	  qWarning() << "Failed to readDatagram:" << socket.errorString();
-	} 
 
-	payloadRecv += rx;
-	totalRecv += rx + 28; // UDP + IPv4 headers
+/*
+ * Unpacks the batched telemetry into periodic values. The snapshot is acked
+ * so that the sender can encode the next values relative to it.
+ */
+void Transmitter::handleTelemetry(MessageView &msg)
+{
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
+
+  quint8 subTypes[TELEMETRY_VALUES];
+  quint8 tags[TELEMETRY_VALUES];
+  qint64 values[TELEMETRY_VALUES];
+
+  int count = telemetryDecoder.decode(msg.getSeq(),
+									  msg.getTelemetryFlags() & MSG_TELEMETRY_FLAG_BASELINE,
+									  msg.getTelemetryBaseline(),
+									  msg.data() + TYPE_OFFSET_TELEMETRY_VALUES,
+									  msg.length() - TYPE_OFFSET_TELEMETRY_VALUES,
+									  subTypes, tags, values);
+  if (count == -1) {
+	return;
+  }
 
-	qDebug() << "Sender:" << sender.toString() << ", port:" << senderPort;
-	printData(&datagram);
+  queueAck(msg);
 
-	parseData(&datagram);
+  for (int i = 0; i < count; i++) {
+	emitValue(subTypes[i], tags[i], values[i]);
   }
 }
 
 
-void Transmitter::printError(QAbstractSocket::SocketError error)
+
+void Transmitter::handleTypedValue(MessageView &msg)
 {
-  qDebug() << "Socket error (" << error << "):" << socket.errorString();
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
+
+  emitValue(msg.subType(), msg.getTypedValueTag(), msg.getTypedValue());
 }
 
 
 
-void Transmitter::printData(QByteArray *data)
+/*
+ * 16 bit values are passed on as before, the rest with their type tag.
+ */
+void Transmitter::emitValue(quint8 subType, quint8 tag, qint64 value)
 {
-  qDebug() << "in" << __FUNCTION__ << ", data len:" << data->size();
-
-  if (data->size() > 32) {
-	qDebug() << "Big packet (video?), not printing content";
+  if (tag == MSG_VALUE_TAG(MSG_VALUE_TYPE_U16, 0)) {
+	emit(periodicValue(subType, (quint16)value));
   } else {
-	qDebug() << data->toHex();
+	emit(typedValue(subType, tag, value));
   }
 }
 
 
 
-void Transmitter::parseData(QByteArray *data)
+void Transmitter::handleMediaFec(MessageView &msg)
 {
-  qDebug() << "in" << __FUNCTION__;
+  logTrace(LOG_MEDIA) << "in" << __FUNCTION__;
 
-  Message msg(*data);
+  QList<FecDecoder::Recovered> recovered =
+	fecDecoder.addParity(msg.getFecBaseSeq(), msg.getFecCount(), msg.getFecIndex(),
+						 msg.data() + TYPE_OFFSET_FEC_PAYLOAD,
+						 msg.length() - TYPE_OFFSET_FEC_PAYLOAD);
 
-  // isValid() also checks that the packet is exactly as long as expected
-  if (!msg.isValid()) {
-	qWarning() << "Package not valid, ignoring";
-	return;
-  }
+  // Rebuild the lost media messages and handle them as received
+  for (int i = 0; i < recovered.size(); i++) {
+	const QByteArray &payload = recovered.at(i).data;
+	quint16 seq = recovered.at(i).seq;
 
-  qDebug() << __FUNCTION__ << ": type:" << Message::getTypeStr((int)msg.type());
+	if (TYPE_OFFSET_PAYLOAD + payload.size() < TYPE_OFFSET_MEDIA_PAYLOAD) {
+	  continue;
+	}
 
-  // New data -> connection ok
-  if (connectionStatus != CONNECTION_STATUS_OK) {
-	connectionStatus = CONNECTION_STATUS_OK;
-	emit(connectionStatusChanged(connectionStatus));
-  }
+	MediaBuffer *buffer = new MediaBuffer(TYPE_OFFSET_PAYLOAD + payload.size());
+	char *data = buffer->data();
 
-  // Stop connection timeout timer as we got something from the slave
-  if (connectionTimeoutTimer && connectionTimeoutTimer->isActive()) {
-	connectionTimeoutTimer->stop();
-  }
+	memset(data, 0, TYPE_OFFSET_PAYLOAD);
+	data[TYPE_OFFSET_SEQ + 0] = (quint8)(seq >> 8);
+	data[TYPE_OFFSET_SEQ + 1] = (quint8)(seq & 0xff);
+	data[TYPE_OFFSET_TYPE] = MSG_TYPE_MEDIA;
+	memcpy(data + TYPE_OFFSET_PAYLOAD, payload.constData(), payload.size());
 
-  // Check, whether to ACK the packet
-  if (msg.isHighPriority()) {
-	sendACK(msg);
-  }
+	MessageView media(data, buffer->length(), buffer);
+	processMedia(media);
 
-  // Handle different message types in different methods
-  if (messageHandlers[msg.type()]) {
-	messageHandler func = messageHandlers[msg.type()];
-	(this->*func)(msg);
-  } else {
-	qWarning() << "No message handler for type" << Message::getTypeStr(msg.type()) << ", ignoring";
-  }  
+	buffer->unref();
+  }
 }
 
 
 
-void Transmitter::sendACK(Message &incoming)
+void Transmitter::processMedia(MessageView &msg)
 {
-  qDebug() << "in" << __FUNCTION__;
-
-  Message *msg = new Message(MSG_TYPE_ACK);
+  if (msg.getMediaFragIndex() >= msg.getMediaFragCount()) {
+	qWarning() << __FUNCTION__ << ": Invalid fragment" << msg.getMediaFragIndex()
+			   << "/" << msg.getMediaFragCount() << ", ignoring";
+	return;
+  }
 
-  // Sets CRC as well
-  msg->setACK(incoming);
+  // Fragmented media must be reassembled first
+  if (msg.getMediaFragCount() > 1) {
+	reassembleMedia(msg);
+	return;
+  }
 
-  sendMessage(msg);
+  // Send the received media payload to the application. It refers to the
+  // received data without copying it.
+  emit(media(msg.mediaPayload()));
 }
 
 
 
-void Transmitter::handleACK(Message &msg)
+/*
+ * Store a media fragment and emit the media frame once all its fragments
+ * have been received. The reassembly table has a fixed number of slots. Stale
+ * frames are dropped and the oldest frame is evicted if the table is full.
+ */
+void Transmitter::reassembleMedia(MessageView &msg)
 {
-  qDebug() << "in" << __FUNCTION__;
+  quint16 frameId = msg.getMediaFrameId();
+  quint8 index = msg.getMediaFragIndex();
+  quint8 count = msg.getMediaFragCount();
+
+  MediaFrame *frame = NULL;
+  MediaFrame *unused = NULL;
+  MediaFrame *oldest = NULL;
+
+  for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+	MediaFrame *slot = &reassembly[i];
+
+	// Drop frames that will most likely never be completed
+	if (slot->used && slot->frameId != frameId && slot->started.elapsed() > REASSEMBLY_TIMEOUT_MS) {
+	  logDebug(LOG_MEDIA) << __FUNCTION__ << ": Dropping stale media frame" << slot->frameId
+			   << "(" << slot->received << "/" << slot->fragments.size() << ")";
+	  clearMediaFrame(slot);
+	}
 
-  quint16 ackedFullType = msg.getAckedFullType();
-  quint16 ackedCRC = msg.getAckedCRC();
+	if (!slot->used) {
+	  if (!unused) {
+		unused = slot;
+	  }
+	  continue;
+	}
 
-  // If the ack is not for the latest msg, ignore it
-  if (resendMessages[ackedFullType] &&
-	  !resendMessages[ackedFullType]->matchCRC(ackedCRC)) {
-	// We got ack, just not for the latest package. Restart timer to avoid continuous resends.
-	if (resendTimers[ackedFullType]) {
-	  resendTimers[ackedFullType]->start();
+	if (slot->frameId == frameId) {
+	  frame = slot;
 	}
-	qDebug() << __FUNCTION__ << ": acked CRC does not match for type:" << ackedFullType;
-	return;
-  }
 
-  // Stop and delete resend timer
-  if (resendTimers[ackedFullType]) {
-	resendTimers[ackedFullType]->stop();
-	resendSignalMapper->removeMappings(resendTimers[ackedFullType]);
-	delete resendTimers[ackedFullType];
-	resendTimers[ackedFullType] = NULL;
-  } else {
-	  qWarning() << "No Resend timer running for type" << ackedFullType;
+	if (!oldest || slot->started.elapsed() > oldest->started.elapsed()) {
+	  oldest = slot;
+	}
   }
 
+  if (!frame) {
+	if (unused) {
+	  frame = unused;
+	} else {
+	  qWarning() << __FUNCTION__ << ": Reassembly table full, evicting media frame" << oldest->frameId;
+	  frame = oldest;
+	}
 
-  // Send RTT signal and delete RT timer
-  if (rtTimers[ackedFullType]) {
-	int rttMs = rtTimers[ackedFullType]->elapsed();
+	clearMediaFrame(frame);
 
-	emit(rtt(rttMs));
+	frame->used = true;
+	frame->frameId = frameId;
+	frame->received = 0;
+	memset(frame->present, 0, sizeof(frame->present));
+	frame->fragments.fill(NULL, count);
+	frame->started.start();
+  }
 
-	// Adjust resend timeout but keep it always > 20ms.
-	// If the doubled round trip time is less than current timeout, decrease resendTimeoutMs by 10%.
-	// if the doubled round trip time is greater that current resendTimeoutMs, increase resendTimeoutMs to 2x rtt
-	if (2 * rttMs < resendTimeoutMs) {
-	  resendTimeoutMs -= (int)(0.1 * resendTimeoutMs);
-	} else {
-	  resendTimeoutMs = 2 * rttMs;
-	}
+  if (frame->fragments.size() != count) {
+	qWarning() << __FUNCTION__ << ": Fragment count mismatch for media frame" << frameId << ", ignoring";
+	return;
+  }
 
-	if (resendTimeoutMs < 20) {
-	  resendTimeoutMs = 20;
-	}
+  // Ignore duplicates
+  if (frame->present[index / 32] & (1u << (index % 32))) {
+	return;
+  }
 
-	emit(resendTimeout(resendTimeoutMs));
+  frame->present[index / 32] |= (1u << (index % 32));
+  frame->fragments[index] = msg.mediaPayload();
+  frame->received++;
 
-	qDebug() << "New resend timeout:" << resendTimeoutMs;
+  if (frame->received < count) {
+	return;
+  }
 
-	delete rtTimers[ackedFullType];
-	rtTimers[ackedFullType] = NULL;
-  } else {
-	  qWarning() << "No RT timer running for type" << ackedFullType;
+  // All fragments received, concatenate them
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+	size += frame->fragments[i]->length();
   }
 
-  // Delete the message waiting for resend
-  if (resendMessages[ackedFullType]) {
-	delete resendMessages[ackedFullType];
-	resendMessages[ackedFullType] = NULL;
+  MediaBuffer *data = new MediaBuffer(size);
+  int offset = 0;
+  for (int i = 0; i < count; i++) {
+	memcpy(data->data() + offset, frame->fragments[i]->data(), frame->fragments[i]->length());
+	offset += frame->fragments[i]->length();
   }
+
+  clearMediaFrame(frame);
+
+  // Send the reassembled media payload to the application
+  emit(media(data));
 }
 
 
 
-void Transmitter::handlePing(Message &)
+void Transmitter::clearMediaFrame(MediaFrame *frame)
 {
-  qDebug() << "in" << __FUNCTION__;
+  for (int i = 0; i < frame->fragments.size(); i++) {
+	if (frame->fragments[i]) {
+	  frame->fragments[i]->unref();
+	}
+  }
 
-  // We don't do anything with ping (ACKing it is enough).
-  // This handler is here to avoid missing handler warning.
+  frame->fragments.clear();
+  frame->used = false;
 }
 
 
 
-void Transmitter::handleMedia(Message &msg)
+void Transmitter::handleReceiverReport(MessageView &msg)
 {
-  qDebug() << "in" << __FUNCTION__;
-
-  QByteArray *data = new QByteArray(*msg.data());
+  logTrace(LOG_MEDIA) << "in" << __FUNCTION__;
 
-  // Remove header from the data to get the actual media payload
-  data->remove(0, TYPE_OFFSET_PAYLOAD);
+  int lossPercent = (msg.getReportFractionLost() * 100 + 128) / 256;
 
-  // Send the received media payload to the application
-  emit(media(data));
+  emit(receiverReport(msg.getReportHighestSeq(), msg.getReportLost(), lossPercent,
+					  msg.getReportJitter() / 1000.0, msg.getReportBufferFill()));
 }
 
 
 
-void Transmitter::handleDebug(Message &msg)
+void Transmitter::handleDebug(MessageView &msg)
 {
-  qDebug() << "in" << __FUNCTION__;
-
-  // Remove header from the data to get the actual debug payload
-  QByteArray data(*msg.data());
-  data.remove(0, TYPE_OFFSET_PAYLOAD);
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
 
-  QString *debugmsg = new QString(data.data());
+  // Skip the header to get the actual debug payload
+  QString *debugmsg = new QString(QString::fromUtf8(msg.data() + TYPE_OFFSET_PAYLOAD,
+												   msg.length() - TYPE_OFFSET_PAYLOAD));
 
   // Send the received debug message to the application
   emit(debug(debugmsg));
@@ -539,9 +2298,9 @@ void Transmitter::handleDebug(Message &msg)
 
 
 
-void Transmitter::handleValue(Message &msg)
+void Transmitter::handleValue(MessageView &msg)
 {
-  qDebug() << "in" << __FUNCTION__;
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
 
   quint8 type = msg.subType();
   quint16 val = msg.getPayload16();
@@ -552,9 +2311,9 @@ void Transmitter::handleValue(Message &msg)
 
 
 
-void Transmitter::handlePeriodicValue(Message &msg)
+void Transmitter::handlePeriodicValue(MessageView &msg)
 {
-  qDebug() << "in" << __FUNCTION__;
+  logTrace(LOG_NET) << "in" << __FUNCTION__;
 
   quint8 type = msg.subType();
   quint16 val = msg.getPayload16();
@@ -582,17 +2341,63 @@ void Transmitter::updateRate(void)
   int totalTx = (int)(totalSent / (elapsedMs/(double)1000));
   totalSent = 0;
 
-  emit(networkRate(payloadRx, totalRx, payloadTx, totalTx));
+  // Average number of datagrams per read/write system call
+  double rxBatch = rxCalls ? rxDatagrams / (double)rxCalls : 0;
+  double txBatch = txCalls ? txDatagrams / (double)txCalls : 0;
+  rxCalls = rxDatagrams = txCalls = txDatagrams = 0;
+
+  emit(networkRate(payloadRx, totalRx, payloadTx, totalTx, rxBatch, txBatch));
+
+  // The receiver of the signal takes the ownership of the stats
+  if (latencyStats.stage[LATENCY_NETWORK].count() > 0 ||
+	  latencyStats.stage[LATENCY_ENCODE_TO_SEND].count() > 0) {
+	emit(latency(new LatencyStats(latencyStats)));
+	latencyStats.clear();
+  }
+
+  // Queue depth and queuing delay of each send scheduler class
+  for (int i = 0; i < TX_CLASSES; i++) {
+	TxClassStats *stats = &txStats[i];
+	if (stats->sent == 0 && stats->dropped == 0) {
+	  continue;
+	}
+
+	double meanDelayMs = stats->sent ? stats->delaySumUs / 1000.0 / stats->sent : 0;
+	double maxDelayMs = stats->delayMaxUs / 1000.0;
+
+	logDebug(LOG_NET) << "TX class" << i << ": max queued:" << stats->maxQueued << ", delay:" << meanDelayMs
+					  << "ms, max delay:" << maxDelayMs << "ms, dropped:" << stats->dropped;
+
+	stats->maxQueued = stats->queued;
+	stats->sent = 0;
+	stats->dropped = 0;
+	stats->delaySumUs = 0;
+	stats->delayMaxUs = 0;
+  }
 }
 
 
 
 void Transmitter::connectionTimeout(void)
 {
-  qDebug() << "in" << __FUNCTION__;
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
 
   // FIXME: stop all resends
   resendTimeoutMs = RESEND_TIMEOUT_DEFAULT;
+  rttSampled = false;
+
+  // The sender may restart its sequence numbers and its clock
+  mediaSeqInit = false;
+  peerClock.reset();
+  telemetryEncoder.reset();
+  telemetryDecoder.reset();
+  latencyFrameId = -1;
+  for (int i = 0; i < ACK_STATE_SIZE; i++)  {
+	ackStates[i].used = false;
+	ackStates[i].pending = false;
+  }
+  pendingAcks = 0;
+  ackTimer.stop();
 
   if (connectionStatus != CONNECTION_STATUS_LOST) {
 	connectionStatus = CONNECTION_STATUS_LOST;
@@ -28,9 +28,16 @@
 #define _TRANSMITTER_H
 
 #include "Message.h"
+#include "MessageView.h"
+#include "MediaBuffer.h"
+#include "Fec.h"
+#include "Latency.h"
+#include "ClockSync.h"
+#include "Telemetry.h"
 
 #include <QtNetwork>
 #include <QObject>
+#include <QElapsedTimer>
 
 // Status messages for API user convenience. Not used in Transmitter.
 // Bits of quint8
@@ -40,6 +47,71 @@
 #define CONNECTION_STATUS_RETRYING    0x2
 #define CONNECTION_STATUS_LOST        0x3
 
+// Default max size of a sent datagram (UDP payload). Media is fragmented to
+// fit in it. Must stay below the path MTU and the netrelay receive buffer.
+// PLECO_MTU overrides it, both ends must use the same value.
+#define TRANSMITTER_MTU_DEFAULT       1400
+#define TRANSMITTER_MTU_MAX           4096
+
+// Number of fragmented media frames that can be reassembled at the same time
+#define REASSEMBLY_SLOTS              8
+
+// High priority messages waiting for an ACK are kept in an open addressing
+// hash table indexed by the full type. Their resend timeouts are kept in a
+// hashed timing wheel driven by a single timer.
+#define RESEND_TABLE_BITS             7
+#define RESEND_TABLE_SIZE             (1 << RESEND_TABLE_BITS)
+#define RESEND_WHEEL_SLOTS            256
+#define RESEND_WHEEL_TICK_MS          10
+
+// A latest only message is dropped when its deadline has passed, but not
+// before this many resend timeouts from queueing it. With the back off this
+// allows three resends.
+#define RESEND_LATEST_MIN_RTOS        8
+
+// On Linux the socket is drained with recvmmsg() into a preallocated ring of
+// buffers and the datagrams sent in the same event loop iteration are
+// written with a single sendmmsg().
+#ifdef Q_OS_LINUX
+#define TRANSMITTER_BATCHED_IO
+#endif
+
+// Max number of datagrams read or written with a single system call
+#define TRANSMITTER_BATCH_SIZE        32
+
+// The receive buffers are MTU sized blocks from a pool. The media slices
+// held by the application return their blocks to it, at most this many are
+// kept for reuse.
+#define TRANSMITTER_RX_POOL_SIZE      256
+
+// ACKs of high priority messages (except pings) are held back at most this
+// long, so that several can be sent in one ACK map or appended to outgoing
+// messages. The state of this many full types is kept for the ACK maps.
+#define ACK_MAX_DELAY_MS              20
+#define ACK_STATE_SIZE                32
+
+// Max interval of the pings the clock sync is based on. Other high priority
+// messages delay the auto ping only up to this.
+#define CLOCK_SYNC_INTERVAL_MS        1000
+
+// Send scheduler. Datagrams of a higher class are always sent before the
+// queued ones of the lower classes. Media can be paced with a token bucket,
+// the paced media older than the deadline is dropped.
+enum {
+  TX_CLASS_CONTROL,                  // High priority messages and ACKs
+  TX_CLASS_NORMAL,                   // Other low priority messages
+  TX_CLASS_MEDIA,                    // Media and FEC
+  TX_CLASSES
+};
+
+#define TRANSMITTER_MEDIA_QUEUE_SIZE  512
+#define TRANSMITTER_MEDIA_DEADLINE_MS 300
+#define TRANSMITTER_PACING_BURST_MS   5
+
+// Limits of a single UDP GSO send, at most a batch can be coalesced
+#define TRANSMITTER_GSO_MAX_SEGMENTS  TRANSMITTER_BATCH_SIZE
+#define TRANSMITTER_GSO_MAX_BYTES     65000
+
 class Transmitter : public QObject
 {
   Q_OBJECT;
@@ -47,76 +119,270 @@ class Transmitter : public QObject
  public:
 
   // Message handler function prototype
-  typedef void (Transmitter::*messageHandler)(Message &msg);
+  typedef void (Transmitter::*messageHandler)(MessageView &msg);
 
   Transmitter(QString host, quint16 port);
   ~Transmitter();
   void initSocket();
   void enableAutoPing(bool enable);
+  void setMTU(int mtu);
+  static int configuredMTU(void);
+  void setGSO(bool enable);
+  void enableReceiverReports(bool enable);
+  void setReceiverBufferFill(int percent);
+  void setMediaPacing(int rateKbps, int deadlineMs);
+  void enableTelemetryBatching(int periodMs, int maxBytes);
 
  public slots:
   void sendPing();
-  void sendMedia(QByteArray *media);
+  void sendMedia(MediaBuffer *media);
   void sendDebug(QString *debug);
   void sendValue(quint8 type, quint16 value);
   void sendPeriodicValue(quint8 type, quint16 value);
+  void sendTypedValue(quint8 type, quint8 tag, qint64 value);
+  void setFec(int groupSize, int parityCount);
 
  private slots:
   void readPendingDatagrams();
   void printError(QAbstractSocket::SocketError error);
   void sendMessage(Message *msg);
-  void resendMessage(QObject *msg);
+  void processResendWheel(void);
   void updateRate(void);
   void connectionTimeout(void);
+  void readBatchedDatagrams(void);
+  void flushTxQueue(void);
+  void sendReceiverReport(void);
+  void flushAcks(void);
+  void paceMedia(void);
+  void flushTelemetry(void);
 
  signals:
   void rtt(int ms);
   void resendTimeout(int ms);
+  void rttEstimate(int srttMs, int rttVarMs, int rtoMs);
   void resentPackets(quint32 resendCounter);
-  void media(QByteArray *media);
+  void media(MediaBuffer *media);
   void debug(QString *debug);
   void value(quint8 type, quint16 value);
   void periodicValue(quint8 type, quint16 value);
+  void typedValue(quint8 type, quint8 tag, qint64 value);
   void status(quint8 status);
-  void networkRate(int payloadRx, int totalRx, int payloadTx, int totalTx);
+  void networkRate(int payloadRx, int totalRx, int payloadTx, int totalTx, double rxBatch, double txBatch);
   void connectionStatusChanged(int status);
+  void receiverReport(int highestSeq, int lost, int lossPercent, double jitterMs, int bufferFill);
+  void latency(LatencyStats *stats);
+  void clockSync(quint32 offsetUs, double driftPpm, int accuracyUs);
 
  private:
-  void printData(QByteArray *data);
-  void parseData(QByteArray *data);
-  void handleACK(Message &msg);
-  void handlePing(Message &msg);
-  void handleMedia(Message &msg);
-  void handleDebug(Message &msg);
-  void handleValue(Message &msg);
-  void handlePeriodicValue(Message &msg);
-  void sendACK(Message &incoming);
-  void startResendTimer(Message *msg);
-  void startRTTimer(Message *msg);
+  struct MediaFrame;
+
+  bool initBatchedSocket(void);
+  void scheduleDatagram(int txClass, qint64 queuedUs, const QByteArray &header, MediaBuffer *payload = NULL,
+						const char *payloadData = NULL, int payloadLength = 0);
+  void writeDatagram(int txClass, qint64 queuedUs, const QByteArray &header, MediaBuffer *payload = NULL,
+					 const char *payloadData = NULL, int payloadLength = 0);
+  void datagramSent(int txClass, qint64 queuedUs, qint64 nowUs);
+  void dropStaleMedia(qint64 nowUs);
+  void printData(const char *data, int length);
+  void parseData(const char *data, int length, MediaBuffer *buffer);
+  void handleACK(MessageView &msg);
+  void handleAckMap(MessageView &msg);
+  void processAckMap(MessageView &msg, int offset);
+  void acknowledge(int index, int ackDelayMs);
+  void handlePing(MessageView &msg);
+  void handleMedia(MessageView &msg);
+  void handleDebug(MessageView &msg);
+  void handleValue(MessageView &msg);
+  void handlePeriodicValue(MessageView &msg);
+  void handleMediaFec(MessageView &msg);
+  void handleReceiverReport(MessageView &msg);
+  void handleTelemetry(MessageView &msg);
+  void handleTypedValue(MessageView &msg);
+  void emitValue(quint8 type, quint8 tag, qint64 value);
+  void batchValue(quint8 type, quint8 tag, qint64 value);
+  void updateReceiverStats(MessageView &msg);
+  void updateLatency(MessageView &msg);
+  void updateClockSync(MessageView &msg);
+  void processMedia(MessageView &msg);
+  void reassembleMedia(MessageView &msg);
+  void clearMediaFrame(MediaFrame *frame);
+  void sendFec(qint64 queuedUs);
+  void sendACK(MessageView &incoming);
+  void queueAck(MessageView &incoming);
+  void appendAcks(Message *msg);
+  void resendMessage(int index);
+  void updateRTO(int rttMs);
+  void backoffRTO(void);
   void startConnectionTimeout(void);
 
+  // Resend table and timing wheel
+  int resendFind(quint16 fullType);
+  int resendInsert(quint16 fullType);
+  void resendRemove(int index);
+  void resendMove(int from, int to);
+  void wheelSchedule(int index, int timeoutMs);
+  void wheelUnlink(int index);
+
   QUdpSocket socket;
+
+  // Batched datagram I/O, used instead of the QUdpSocket when fd != -1
+  int fd;
+  QSocketNotifier *readNotifier;
+  MediaBufferPool *rxPool;
+  MediaBuffer *rxSlots[TRANSMITTER_BATCH_SIZE];
+
+  // Queued datagram. The payload (if any) is sent from its own buffer after
+  // the header, without copying.
+  struct TxDatagram {
+	QByteArray header;
+	MediaBuffer *payload;
+	const char *payloadData;
+	int payloadLength;
+	int txClass;
+	qint64 queuedUs;
+  };
+
+  TxDatagram txQueue[TRANSMITTER_BATCH_SIZE];
+  int txQueued;
+  QTimer txFlushTimer;
+  bool gso;
+
+  // Paced media, a ring buffer
+  TxDatagram mediaQueue[TRANSMITTER_MEDIA_QUEUE_SIZE];
+  int mediaQueueHead;
+  int mediaQueueCount;
+  QTimer pacingTimer;
+  int pacingRateKbps;
+  qint64 mediaDeadlineUs;
+  double pacingTokens;
+  qint64 pacingLastUs;
+  qint64 pacingFrameUs;  // Queuing time of the frame being sent
+
+  // Per class statistics, reported once per second
+  struct TxClassStats {
+	int queued;
+	int maxQueued;
+	int sent;
+	int dropped;
+	qint64 delaySumUs;
+	qint64 delayMaxUs;
+  };
+
+  TxClassStats txStats[TX_CLASSES];
+
   QHostAddress relayHost;
   quint16 relayPort;
   int resendTimeoutMs;
   quint32 resendCounter;
 
-  QSignalMapper *resendSignalMapper;
-  QTime *rtTimers[MSG_TYPE_SUBTYPE_MAX];
-  QTimer *resendTimers[MSG_TYPE_SUBTYPE_MAX];
-  Message *resendMessages[MSG_TYPE_SUBTYPE_MAX];
-  messageHandler messageHandlers[MSG_TYPE_SUBTYPE_MAX];
+  // Round trip time estimator
+  bool rttSampled;
+  double srttMs;
+  double rttVarMs;
+
+  messageHandler messageHandlers[MSG_TYPE_MAX];
+
+  // High priority message waiting for an ACK
+  struct ResendEntry {
+	bool used;
+	bool scheduled;
+	bool retransmitted;  // RTT is not sampled from resent messages
+	quint16 fullType;
+	int delivery;        // Delivery policy of the type
+	int deadlineMs;      // For the latest only delivery
+	Message *msg;
+	qint64 sentMs;       // For measuring the round trip time and the deadline
+	quint32 dueTick;     // Resend time in wheel ticks
+	int wheelPrev;
+	int wheelNext;
+  };
+
+  ResendEntry resendTable[RESEND_TABLE_SIZE];
+  int resendCount;
+  int wheel[RESEND_WHEEL_SLOTS];
+  quint32 wheelTick;
+  QTimer wheelTimer;
+  QElapsedTimer clock;
+
+  // Received high priority messages per full type, for the ACK maps
+  struct AckState {
+	bool used;
+	bool pending;        // Not yet acked
+	quint16 fullType;
+	quint16 seq;         // Latest received
+	quint16 bitmap;      // Bit n set if seq - 1 - n was received
+	qint64 receivedUs;   // Receive time of the latest
+  };
+
+  AckState ackStates[ACK_STATE_SIZE];
+  int pendingAcks;
+  QTimer ackTimer;
 
   QTimer *connectionTimeoutTimer;
   int connectionStatus;
 
   QTimer *autoPing;
+  qint64 lastPingMs;
+
+  // Media fragmentation and reassembly
+  struct MediaFrame {
+	bool used;
+	quint16 frameId;
+	int received;
+	quint32 present[(MSG_MEDIA_MAX_FRAGMENTS + 31) / 32];
+	QVector<MediaBuffer *> fragments;
+	QTime started;
+  };
+
+  int mtu;
+  quint16 mediaFrameId;
+  MediaFrame reassembly[REASSEMBLY_SLOTS];
+
+  // Forward error correction for media
+  FecEncoder fecEncoder;
+  FecDecoder fecDecoder;
+
+  // Statistics of the received media for the receiver reports (RFC 3550
+  // style). Sequence numbers are extended with the wrap around count.
+  QTimer *reportTimer;
+  bool mediaSeqInit;
+  quint16 mediaMaxSeq;
+  quint32 mediaCycles;
+  quint32 mediaBaseSeq;
+  quint32 mediaReceived;
+  quint32 mediaExpectedPrior;
+  quint32 mediaReceivedPrior;
+  qint64 mediaLastArrivalUs;
+  double mediaMeanIntervalUs;
+  double mediaJitterUs;
+  int bufferFill;
+
+  // The peer's clock, estimated from the timestamps in the ACKs of our
+  // pings. The receive time of the datagram being parsed is echoed in the
+  // ACK of a ping.
+  ClockSync peerClock;
+  qint64 rxTimeUs;
+
+  // Periodic values are batched into delta encoded telemetry messages,
+  // if the timer exists
+  QTimer *telemetryTimer;
+  int telemetryMaxBytes;
+  TelemetryEncoder telemetryEncoder;
+  TelemetryDecoder telemetryDecoder;
+
+  // Latency of the received media, reported once per second
+  LatencyStats latencyStats;
+  int latencyFrameId;    // Latest sampled frame, -1 if none
 
   // TX/RX rate
   int payloadSent;
   int payloadRecv;
   int totalSent;
   int totalRecv;
+  int rxCalls;
+  int rxDatagrams;
+  int txCalls;
+  int txDatagrams;
   QTimer rateTimer;
   QTime rateTime;
 };
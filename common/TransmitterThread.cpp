@@ -0,0 +1,783 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "TransmitterThread.h"
+#include "Log.h"
+
+#include <unistd.h>                          /* pipe, read, write */
+#include <fcntl.h>                           /* fcntl */
+#include <errno.h>
+#include <string.h>                          /* strerror */
+
+#ifdef Q_OS_LINUX
+#include <pthread.h>                         /* pthread_setaffinity_np */
+#include <sched.h>                           /* SCHED_FIFO */
+#endif
+
+// Commands to the network thread
+#define CMD_SEND_PING                 1
+#define CMD_SEND_MEDIA                2
+#define CMD_SEND_DEBUG                3
+#define CMD_SEND_VALUE                4
+#define CMD_SEND_PERIODIC_VALUE       5
+#define CMD_SET_FEC                   6
+#define CMD_ENABLE_AUTO_PING          7
+#define CMD_SET_MTU                   8
+#define CMD_SET_GSO                   9
+#define CMD_ENABLE_RECEIVER_REPORTS  10
+#define CMD_SET_RECEIVER_BUFFER_FILL 11
+#define CMD_SET_MEDIA_PACING         12
+#define CMD_ENABLE_TELEMETRY_BATCHING 13
+#define CMD_SEND_TYPED_VALUE         14
+
+// Events to the application thread
+#define EVENT_RTT                     1
+#define EVENT_RESEND_TIMEOUT          2
+#define EVENT_RTT_ESTIMATE            3
+#define EVENT_RESENT_PACKETS          4
+#define EVENT_MEDIA                   5
+#define EVENT_DEBUG                   6
+#define EVENT_VALUE                   7
+#define EVENT_PERIODIC_VALUE          8
+#define EVENT_STATUS                  9
+#define EVENT_NETWORK_RATE            10
+#define EVENT_CONNECTION_STATUS       11
+#define EVENT_RECEIVER_REPORT         12
+#define EVENT_LATENCY                 13
+#define EVENT_CLOCK_SYNC              14
+#define EVENT_TYPED_VALUE             15
+
+
+TransmitterThread::TransmitterThread(QString host, quint16 port):
+  host(host), port(port), cpu(-1), rtPriority(0), thread(), transmitter(NULL),
+  commands(), overflowMutex(), overflow(), overflowUsed(0), mediaCommands(), events(), commandsPending(0), eventsPending(0),
+  commandNotifier(NULL), eventNotifier(NULL)
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
+
+  commandPipe[0] = commandPipe[1] = -1;
+  eventPipe[0] = eventPipe[1] = -1;
+
+  if (pipe(commandPipe) == -1 || pipe(eventPipe) == -1) {
+	qCritical() << __FUNCTION__ << ": Failed to create pipes:" << strerror(errno);
+	return;
+  }
+
+  for (int i = 0; i < 2; i++) {
+	fcntl(commandPipe[i], F_SETFL, O_NONBLOCK);
+	fcntl(eventPipe[i], F_SETFL, O_NONBLOCK);
+  }
+
+  // Received events are emitted in the application thread
+  eventNotifier = new QSocketNotifier(eventPipe[0], QSocketNotifier::Read);
+  connect(eventNotifier, SIGNAL(activated(int)), this, SLOT(dispatchEvents()));
+
+  // Started and finished are emitted in the network thread
+  connect(&thread, SIGNAL(started()), this, SLOT(threadStarted()), Qt::DirectConnection);
+  connect(&thread, SIGNAL(finished()), this, SLOT(threadFinished()), Qt::DirectConnection);
+}
+
+
+
+TransmitterThread::~TransmitterThread()
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
+
+  // Transmitter is deleted in the network thread before it exits
+  thread.quit();
+  thread.wait();
+
+  delete eventNotifier;
+
+  // Free the data of the commands and events never handled
+  Command cmd;
+  while (commands.pop(cmd)) {
+	if (cmd.type == CMD_SEND_DEBUG) {
+	  delete (QString *)cmd.ptr;
+	}
+  }
+
+  while (mediaCommands.pop(cmd)) {
+	((MediaBuffer *)cmd.ptr)->unref();
+  }
+
+  Event event = Event();
+  while (events.pop(event)) {
+	if (event.type == EVENT_MEDIA) {
+	  ((MediaBuffer *)event.ptr)->unref();
+	} else if (event.type == EVENT_DEBUG) {
+	  delete (QString *)event.ptr;
+	} else if (event.type == EVENT_LATENCY) {
+	  delete (LatencyStats *)event.ptr;
+	}
+  }
+
+  for (int i = 0; i < 2; i++) {
+	if (commandPipe[i] != -1) {
+	  close(commandPipe[i]);
+	}
+	if (eventPipe[i] != -1) {
+	  close(eventPipe[i]);
+	}
+  }
+}
+
+
+
+/*
+ * Starts the network thread. The Transmitter is created and its socket
+ * initialised in the thread.
+ */
+void TransmitterThread::initSocket()
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
+
+  if (thread.isRunning()) {
+	return;
+  }
+
+  thread.start();
+}
+
+
+
+void TransmitterThread::enableAutoPing(bool enable)
+{
+  pushCommand(CMD_ENABLE_AUTO_PING, enable);
+}
+
+
+
+void TransmitterThread::setMTU(int mtu)
+{
+  pushCommand(CMD_SET_MTU, mtu);
+}
+
+
+
+void TransmitterThread::setGSO(bool enable)
+{
+  pushCommand(CMD_SET_GSO, enable);
+}
+
+
+
+void TransmitterThread::enableReceiverReports(bool enable)
+{
+  pushCommand(CMD_ENABLE_RECEIVER_REPORTS, enable);
+}
+
+
+
+void TransmitterThread::setReceiverBufferFill(int percent)
+{
+  pushCommand(CMD_SET_RECEIVER_BUFFER_FILL, percent);
+}
+
+
+
+void TransmitterThread::setMediaPacing(int rateKbps, int deadlineMs)
+{
+  pushCommand(CMD_SET_MEDIA_PACING, rateKbps, deadlineMs);
+}
+
+
+
+void TransmitterThread::enableTelemetryBatching(int periodMs, int maxBytes)
+{
+  pushCommand(CMD_ENABLE_TELEMETRY_BATCHING, periodMs, maxBytes);
+}
+
+
+
+/*
+ * Pins the network thread to the given CPU core. Must be called before
+ * initSocket(). -1 (default) lets the scheduler choose.
+ */
+void TransmitterThread::setCpuAffinity(int newCpu)
+{
+  cpu = newCpu;
+}
+
+
+
+/*
+ * Runs the network thread with the SCHED_FIFO policy and the given priority
+ * (1-99). Must be called before initSocket(). 0 (default) keeps the normal
+ * policy.
+ */
+void TransmitterThread::setRealtimePriority(int priority)
+{
+  rtPriority = priority;
+}
+
+
+
+void TransmitterThread::sendPing()
+{
+  pushCommand(CMD_SEND_PING);
+}
+
+
+
+void TransmitterThread::sendMedia(MediaBuffer *media)
+{
+  Command cmd;
+  cmd.type = CMD_SEND_MEDIA;
+  cmd.arg1 = 0;
+  cmd.arg2 = 0;
+  cmd.ptr = media;
+
+  if (!mediaCommands.push(cmd)) {
+	qWarning() << __FUNCTION__ << ": Media queue full, dropping";
+	media->unref();
+	return;
+  }
+
+  wake(commandsPending, commandPipe[1]);
+}
+
+
+
+void TransmitterThread::sendDebug(QString *debug)
+{
+  pushCommand(CMD_SEND_DEBUG, 0, 0, debug);
+}
+
+
+
+void TransmitterThread::sendValue(quint8 type, quint16 value)
+{
+  pushCommand(CMD_SEND_VALUE, type, value);
+}
+
+
+
+void TransmitterThread::sendPeriodicValue(quint8 type, quint16 value)
+{
+  pushCommand(CMD_SEND_PERIODIC_VALUE, type, value);
+}
+
+
+
+/*
+ * The type and the tag share the first argument, the 32 bit value is
+ * passed as is and decoded with the tag.
+ */
+void TransmitterThread::sendTypedValue(quint8 type, quint8 tag, qint64 value)
+{
+  pushCommand(CMD_SEND_TYPED_VALUE, (type << 8) | tag, (qint32)value);
+}
+
+
+
+void TransmitterThread::setFec(int groupSize, int parityCount)
+{
+  pushCommand(CMD_SET_FEC, groupSize, parityCount);
+}
+
+
+
+void TransmitterThread::pushCommand(int type, int arg1, int arg2, void *ptr)
+{
+  Command cmd;
+  cmd.type = type;
+  cmd.arg1 = arg1;
+  cmd.arg2 = arg2;
+  cmd.ptr = ptr;
+
+  // Once a command has overflowed, the following ones go after it to keep
+  // the order
+  if (overflowUsed.load() || !commands.push(cmd)) {
+	if (type == CMD_SEND_DEBUG) {
+	  qWarning() << __FUNCTION__ << ": Command queue full, dropping debug message";
+	  delete (QString *)ptr;
+	  return;
+	}
+
+	overflowMutex.lock();
+	if (overflow.isEmpty()) {
+	  qWarning() << __FUNCTION__ << ": Command queue full, queueing commands to the overflow list";
+	}
+	overflow.append(cmd);
+	overflowUsed.fetchAndStoreOrdered(1);
+	overflowMutex.unlock();
+  }
+
+  wake(commandsPending, commandPipe[1]);
+}
+
+
+
+void TransmitterThread::pushEvent(const Event &event)
+{
+  if (!events.push(event)) {
+	qWarning() << __FUNCTION__ << ": Event queue full, dropping event" << event.type;
+	if (event.type == EVENT_MEDIA) {
+	  ((MediaBuffer *)event.ptr)->unref();
+	} else if (event.type == EVENT_DEBUG) {
+	  delete (QString *)event.ptr;
+	} else if (event.type == EVENT_LATENCY) {
+	  delete (LatencyStats *)event.ptr;
+	}
+	return;
+  }
+
+  wake(eventsPending, eventPipe[1]);
+}
+
+
+
+/*
+ * Wakes up the consumer, unless already woken up and not yet draining.
+ */
+void TransmitterThread::wake(QAtomicInt &pending, int fd)
+{
+  if (!pending.testAndSetOrdered(0, 1)) {
+	return;
+  }
+
+  char c = 0;
+  if (write(fd, &c, 1) == -1 && errno != EAGAIN) {
+	qWarning() << __FUNCTION__ << ": Failed to write wake up pipe:" << strerror(errno);
+  }
+}
+
+
+
+void TransmitterThread::threadStarted(void)
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
+
+  setThreadPriority();
+
+  transmitter = new Transmitter(host, port);
+
+  // Called in this thread, so the signals are only copied to the ring
+  connect(transmitter, SIGNAL(rtt(int)), this, SLOT(queueRtt(int)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(resendTimeout(int)), this, SLOT(queueResendTimeout(int)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(rttEstimate(int, int, int)), this, SLOT(queueRttEstimate(int, int, int)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(resentPackets(quint32)), this, SLOT(queueResentPackets(quint32)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(media(MediaBuffer *)), this, SLOT(queueMedia(MediaBuffer *)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(debug(QString *)), this, SLOT(queueDebug(QString *)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(value(quint8, quint16)), this, SLOT(queueValue(quint8, quint16)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(periodicValue(quint8, quint16)), this, SLOT(queuePeriodicValue(quint8, quint16)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(typedValue(quint8, quint8, qint64)),
+		  this, SLOT(queueTypedValue(quint8, quint8, qint64)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(status(quint8)), this, SLOT(queueStatus(quint8)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(networkRate(int, int, int, int, double, double)),
+		  this, SLOT(queueNetworkRate(int, int, int, int, double, double)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(connectionStatusChanged(int)), this, SLOT(queueConnectionStatusChanged(int)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(receiverReport(int, int, int, double, int)),
+		  this, SLOT(queueReceiverReport(int, int, int, double, int)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(latency(LatencyStats *)), this, SLOT(queueLatency(LatencyStats *)), Qt::DirectConnection);
+  connect(transmitter, SIGNAL(clockSync(quint32, double, int)), this, SLOT(queueClockSync(quint32, double, int)), Qt::DirectConnection);
+
+  transmitter->initSocket();
+
+  // Created in this thread, so activated() is emitted in this thread
+  commandNotifier = new QSocketNotifier(commandPipe[0], QSocketNotifier::Read);
+  connect(commandNotifier, SIGNAL(activated(int)), this, SLOT(processCommands()), Qt::DirectConnection);
+
+  // Run the commands queued before the thread started
+  processCommands();
+}
+
+
+
+void TransmitterThread::threadFinished(void)
+{
+  logDebug(LOG_NET) << "in" << __FUNCTION__;
+
+  delete commandNotifier;
+  commandNotifier = NULL;
+
+  delete transmitter;
+  transmitter = NULL;
+}
+
+
+
+void TransmitterThread::setThreadPriority(void)
+{
+#ifdef Q_OS_LINUX
+  if (cpu >= 0) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err) {
+	  qWarning() << __FUNCTION__ << ": Failed to pin network thread to CPU" << cpu << ":" << strerror(err);
+	} else {
+	  logInfo(LOG_NET) << "Network thread pinned to CPU" << cpu;
+	}
+  }
+
+  if (rtPriority > 0) {
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = rtPriority;
+
+	// Requires CAP_SYS_NICE or a suitable RLIMIT_RTPRIO
+	int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err) {
+	  qWarning() << __FUNCTION__ << ": Failed to set SCHED_FIFO priority" << rtPriority << ":" << strerror(err);
+	} else {
+	  logInfo(LOG_NET) << "Network thread running with SCHED_FIFO priority" << rtPriority;
+	}
+  }
+#else
+  if (cpu >= 0 || rtPriority > 0) {
+	qWarning() << __FUNCTION__ << ": CPU affinity and real-time priority not supported";
+  }
+#endif
+}
+
+
+
+void TransmitterThread::processCommands(void)
+{
+  char buf[64];
+  while (read(commandPipe[0], buf, sizeof(buf)) > 0) {
+	; // Just empty the pipe
+  }
+
+  // Producers pushing from now on wake us up again
+  commandsPending.fetchAndStoreOrdered(0);
+
+  Command cmd;
+
+  // Control messages first, as they are more urgent than media
+  while (commands.pop(cmd)) {
+	runCommand(cmd);
+  }
+
+  // Then the ones pushed after the ring got full
+  if (overflowUsed.load()) {
+	overflowMutex.lock();
+	QVector<Command> pending = overflow;
+	overflow.clear();
+	overflowUsed.fetchAndStoreOrdered(0);
+	overflowMutex.unlock();
+
+	for (int i = 0; i < pending.size(); i++) {
+	  runCommand(pending[i]);
+	}
+  }
+
+  while (mediaCommands.pop(cmd)) {
+	runCommand(cmd);
+  }
+}
+
+
+
+void TransmitterThread::runCommand(const Command &cmd)
+{
+  switch (cmd.type) {
+  case CMD_SEND_PING:
+	transmitter->sendPing();
+	break;
+  case CMD_SEND_MEDIA:
+	transmitter->sendMedia((MediaBuffer *)cmd.ptr);
+	break;
+  case CMD_SEND_DEBUG:
+	transmitter->sendDebug((QString *)cmd.ptr);
+	break;
+  case CMD_SEND_VALUE:
+	transmitter->sendValue(cmd.arg1, cmd.arg2);
+	break;
+  case CMD_SEND_PERIODIC_VALUE:
+	transmitter->sendPeriodicValue(cmd.arg1, cmd.arg2);
+	break;
+  case CMD_SET_FEC:
+	transmitter->setFec(cmd.arg1, cmd.arg2);
+	break;
+  case CMD_ENABLE_AUTO_PING:
+	transmitter->enableAutoPing(cmd.arg1);
+	break;
+  case CMD_SET_MTU:
+	transmitter->setMTU(cmd.arg1);
+	break;
+  case CMD_SET_GSO:
+	transmitter->setGSO(cmd.arg1);
+	break;
+  case CMD_ENABLE_RECEIVER_REPORTS:
+	transmitter->enableReceiverReports(cmd.arg1);
+	break;
+  case CMD_SET_RECEIVER_BUFFER_FILL:
+	transmitter->setReceiverBufferFill(cmd.arg1);
+	break;
+  case CMD_SET_MEDIA_PACING:
+	transmitter->setMediaPacing(cmd.arg1, cmd.arg2);
+	break;
+  case CMD_ENABLE_TELEMETRY_BATCHING:
+	transmitter->enableTelemetryBatching(cmd.arg1, cmd.arg2);
+	break;
+  case CMD_SEND_TYPED_VALUE:
+	transmitter->sendTypedValue(cmd.arg1 >> 8, cmd.arg1 & 0xff, Message::typedValue(cmd.arg1 & 0xff, cmd.arg2));
+	break;
+  default:
+	qWarning("%s: Unhandled command: %d", __FUNCTION__, cmd.type);
+  }
+}
+
+
+
+void TransmitterThread::queueRtt(int ms)
+{
+  Event event = Event();
+  event.type = EVENT_RTT;
+  event.args[0] = ms;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueResendTimeout(int ms)
+{
+  Event event = Event();
+  event.type = EVENT_RESEND_TIMEOUT;
+  event.args[0] = ms;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueRttEstimate(int srttMs, int rttVarMs, int rtoMs)
+{
+  Event event = Event();
+  event.type = EVENT_RTT_ESTIMATE;
+  event.args[0] = srttMs;
+  event.args[1] = rttVarMs;
+  event.args[2] = rtoMs;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueResentPackets(quint32 resendCounter)
+{
+  Event event = Event();
+  event.type = EVENT_RESENT_PACKETS;
+  event.args[0] = resendCounter;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueMedia(MediaBuffer *media)
+{
+  Event event = Event();
+  event.type = EVENT_MEDIA;
+  event.ptr = media;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueDebug(QString *debug)
+{
+  Event event = Event();
+  event.type = EVENT_DEBUG;
+  event.ptr = debug;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueValue(quint8 type, quint16 value)
+{
+  Event event = Event();
+  event.type = EVENT_VALUE;
+  event.args[0] = type;
+  event.args[1] = value;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queuePeriodicValue(quint8 type, quint16 value)
+{
+  Event event = Event();
+  event.type = EVENT_PERIODIC_VALUE;
+  event.args[0] = type;
+  event.args[1] = value;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueTypedValue(quint8 type, quint8 tag, qint64 value)
+{
+  Event event = Event();
+  event.type = EVENT_TYPED_VALUE;
+  event.args[0] = type;
+  event.args[1] = tag;
+  event.dargs[0] = value;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueStatus(quint8 status)
+{
+  Event event = Event();
+  event.type = EVENT_STATUS;
+  event.args[0] = status;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueNetworkRate(int payloadRx, int totalRx, int payloadTx, int totalTx, double rxBatch, double txBatch)
+{
+  Event event = Event();
+  event.type = EVENT_NETWORK_RATE;
+  event.args[0] = payloadRx;
+  event.args[1] = totalRx;
+  event.args[2] = payloadTx;
+  event.args[3] = totalTx;
+  event.dargs[0] = rxBatch;
+  event.dargs[1] = txBatch;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueConnectionStatusChanged(int status)
+{
+  Event event = Event();
+  event.type = EVENT_CONNECTION_STATUS;
+  event.args[0] = status;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueReceiverReport(int highestSeq, int lost, int lossPercent, double jitterMs, int bufferFill)
+{
+  Event event = Event();
+  event.type = EVENT_RECEIVER_REPORT;
+  event.args[0] = highestSeq;
+  event.args[1] = lost;
+  event.args[2] = lossPercent;
+  event.args[3] = bufferFill;
+  event.dargs[0] = jitterMs;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueLatency(LatencyStats *stats)
+{
+  Event event = Event();
+  event.type = EVENT_LATENCY;
+  event.ptr = stats;
+  pushEvent(event);
+}
+
+
+
+void TransmitterThread::queueClockSync(quint32 offsetUs, double driftPpm, int accuracyUs)
+{
+  Event event = Event();
+  event.type = EVENT_CLOCK_SYNC;
+  event.args[0] = offsetUs;
+  event.args[1] = accuracyUs;
+  event.dargs[0] = driftPpm;
+  pushEvent(event);
+}
+
+
+
+/*
+ * Emits the events queued by the network thread.
+ */
+void TransmitterThread::dispatchEvents(void)
+{
+  char buf[64];
+  while (read(eventPipe[0], buf, sizeof(buf)) > 0) {
+	; // Just empty the pipe
+  }
+
+  eventsPending.fetchAndStoreOrdered(0);
+
+  Event event = Event();
+  while (events.pop(event)) {
+	switch (event.type) {
+	case EVENT_RTT:
+	  emit(rtt(event.args[0]));
+	  break;
+	case EVENT_RESEND_TIMEOUT:
+	  emit(resendTimeout(event.args[0]));
+	  break;
+	case EVENT_RTT_ESTIMATE:
+	  emit(rttEstimate(event.args[0], event.args[1], event.args[2]));
+	  break;
+	case EVENT_RESENT_PACKETS:
+	  emit(resentPackets(event.args[0]));
+	  break;
+	case EVENT_MEDIA:
+	  emit(media((MediaBuffer *)event.ptr));
+	  break;
+	case EVENT_DEBUG:
+	  emit(debug((QString *)event.ptr));
+	  break;
+	case EVENT_VALUE:
+	  emit(value(event.args[0], event.args[1]));
+	  break;
+	case EVENT_PERIODIC_VALUE:
+	  emit(periodicValue(event.args[0], event.args[1]));
+	  break;
+	case EVENT_TYPED_VALUE:
+	  emit(typedValue(event.args[0], event.args[1], (qint64)event.dargs[0]));
+	  break;
+	case EVENT_STATUS:
+	  emit(status(event.args[0]));
+	  break;
+	case EVENT_NETWORK_RATE:
+	  emit(networkRate(event.args[0], event.args[1], event.args[2], event.args[3],
+					   event.dargs[0], event.dargs[1]));
+	  break;
+	case EVENT_CONNECTION_STATUS:
+	  emit(connectionStatusChanged(event.args[0]));
+	  break;
+	case EVENT_RECEIVER_REPORT:
+	  emit(receiverReport(event.args[0], event.args[1], event.args[2], event.dargs[0], event.args[3]));
+	  break;
+	case EVENT_LATENCY:
+	  emit(latency((LatencyStats *)event.ptr));
+	  break;
+	case EVENT_CLOCK_SYNC:
+	  emit(clockSync(event.args[0], event.dargs[0], event.args[1]));
+	  break;
+	default:
+	  qWarning("%s: Unhandled event: %d", __FUNCTION__, event.type);
+	}
+  }
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _TRANSMITTERTHREAD_H
+#define _TRANSMITTERTHREAD_H
+
+#include "Transmitter.h"
+#include "SpscRing.h"
+
+#include <QObject>
+#include <QThread>
+#include <QSocketNotifier>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QVector>
+
+// Ring sizes, must be powers of two
+#define TRANSMITTER_COMMAND_RING_SIZE 256
+#define TRANSMITTER_MEDIA_RING_SIZE   256
+#define TRANSMITTER_EVENT_RING_SIZE   1024
+
+/*
+ * Runs a Transmitter in a dedicated network thread, so that slow slots in
+ * the application (GUI updates, serial writes) don't delay ACKs and resends.
+ *
+ * The API matches the Transmitter. Calls from the application thread and
+ * media from the video thread are passed to the network thread through
+ * lock-free single producer rings. Received data and statistics come back
+ * through a third ring and are emitted as signals in the application
+ * thread.
+ */
+class TransmitterThread : public QObject
+{
+  Q_OBJECT;
+
+ public:
+  TransmitterThread(QString host, quint16 port);
+  ~TransmitterThread();
+  void initSocket();
+  void enableAutoPing(bool enable);
+  void setMTU(int mtu);
+  void setGSO(bool enable);
+  void enableReceiverReports(bool enable);
+  void setReceiverBufferFill(int percent);
+  void setMediaPacing(int rateKbps, int deadlineMs);
+  void enableTelemetryBatching(int periodMs, int maxBytes);
+  void setCpuAffinity(int cpu);
+  void setRealtimePriority(int priority);
+
+ public slots:
+  void sendPing();
+  // Must always be called from the same thread, e.g. with a direct
+  // connection from the video thread.
+  void sendMedia(MediaBuffer *media);
+  void sendDebug(QString *debug);
+  void sendValue(quint8 type, quint16 value);
+  void sendPeriodicValue(quint8 type, quint16 value);
+  void sendTypedValue(quint8 type, quint8 tag, qint64 value);
+  void setFec(int groupSize, int parityCount);
+
+ private slots:
+  // Called in the network thread
+  void threadStarted(void);
+  void threadFinished(void);
+  void processCommands(void);
+  void queueRtt(int ms);
+  void queueResendTimeout(int ms);
+  void queueRttEstimate(int srttMs, int rttVarMs, int rtoMs);
+  void queueResentPackets(quint32 resendCounter);
+  void queueMedia(MediaBuffer *media);
+  void queueDebug(QString *debug);
+  void queueValue(quint8 type, quint16 value);
+  void queuePeriodicValue(quint8 type, quint16 value);
+  void queueTypedValue(quint8 type, quint8 tag, qint64 value);
+  void queueStatus(quint8 status);
+  void queueNetworkRate(int payloadRx, int totalRx, int payloadTx, int totalTx, double rxBatch, double txBatch);
+  void queueConnectionStatusChanged(int status);
+  void queueReceiverReport(int highestSeq, int lost, int lossPercent, double jitterMs, int bufferFill);
+  void queueLatency(LatencyStats *stats);
+  void queueClockSync(quint32 offsetUs, double driftPpm, int accuracyUs);
+
+  // Called in the application thread
+  void dispatchEvents(void);
+
+ signals:
+  void rtt(int ms);
+  void resendTimeout(int ms);
+  void rttEstimate(int srttMs, int rttVarMs, int rtoMs);
+  void resentPackets(quint32 resendCounter);
+  void media(MediaBuffer *media);
+  void debug(QString *debug);
+  void value(quint8 type, quint16 value);
+  void periodicValue(quint8 type, quint16 value);
+  void typedValue(quint8 type, quint8 tag, qint64 value);
+  void status(quint8 status);
+  void networkRate(int payloadRx, int totalRx, int payloadTx, int totalTx, double rxBatch, double txBatch);
+  void connectionStatusChanged(int status);
+  void receiverReport(int highestSeq, int lost, int lossPercent, double jitterMs, int bufferFill);
+  void latency(LatencyStats *stats);
+  void clockSync(quint32 offsetUs, double driftPpm, int accuracyUs);
+
+ private:
+
+  // Call from the application (or video) thread to the network thread
+  struct Command {
+	int type;
+	int arg1;
+	int arg2;
+	void *ptr;
+  };
+
+  // Signal from the network thread to the application thread
+  struct Event {
+	int type;
+	int args[4];
+	double dargs[2];
+	void *ptr;
+  };
+
+  void pushCommand(int type, int arg1 = 0, int arg2 = 0, void *ptr = NULL);
+  void pushEvent(const Event &event);
+  void runCommand(const Command &cmd);
+  void setThreadPriority(void);
+  void wake(QAtomicInt &pending, int fd);
+
+  QString host;
+  quint16 port;
+  int cpu;
+  int rtPriority;
+
+  QThread thread;
+
+  // Lives in the network thread
+  Transmitter *transmitter;
+
+  SpscRing<Command, TRANSMITTER_COMMAND_RING_SIZE> commands;
+
+  // Commands that didn't fit in the full ring, run after it in order. Only
+  // debug messages are dropped instead.
+  QMutex overflowMutex;
+  QVector<Command> overflow;
+  QAtomicInt overflowUsed;
+  SpscRing<Command, TRANSMITTER_MEDIA_RING_SIZE> mediaCommands;
+  SpscRing<Event, TRANSMITTER_EVENT_RING_SIZE> events;
+
+  // Wake up pipes. The pending flags make sure the pipe is written at most
+  // once per drain of the rings.
+  int commandPipe[2];
+  int eventPipe[2];
+  QAtomicInt commandsPending;
+  QAtomicInt eventsPending;
+  QSocketNotifier *commandNotifier;
+  QSocketNotifier *eventNotifier;
+};
+
+#endif
@@ -10,6 +10,26 @@ INCLUDEPATH += ../slave
 
 SOURCES += Transmitter.cpp
 SOURCES += Message.cpp
+SOURCES += Fec.cpp
+SOURCES += TransmitterThread.cpp
+SOURCES += Log.cpp
+SOURCES += MessageView.cpp
+SOURCES += MediaBuffer.cpp
+SOURCES += Crc16.cpp
+SOURCES += Latency.cpp
+SOURCES += ClockSync.cpp
+SOURCES += Telemetry.cpp
 
 HEADERS += Transmitter.h
 HEADERS += Message.h
+HEADERS += Fec.h
+HEADERS += TransmitterThread.h
+HEADERS += SpscRing.h
+HEADERS += Log.h
+HEADERS += MessageView.h
+HEADERS += MediaBuffer.h
+HEADERS += Crc16.h
+HEADERS += Latency.h
+HEADERS += ClockSync.h
+HEADERS += Telemetry.h
+HEADERS += Clock.h
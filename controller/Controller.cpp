@@ -29,10 +29,11 @@
 #include <QVBoxLayout>
 
 #include "Controller.h"
-#include "Transmitter.h"
+#include "TransmitterThread.h"
 #include "VideoReceiver.h"
 #include "Joystick.h"
 #include "Message.h"
+#include "Log.h"
 
 // Limit the frequency of sending commands affecting PWM signals
 #define THROTTLE_FREQ_CAMERA_XY  50
@@ -41,6 +42,22 @@
 // Limit the motor speed change
 #define MOTOR_SPEED_GRACE_LIMIT  10
 
+// Min interval between keyframe requests after video loss
+#define KEYFRAME_REQUEST_INTERVAL_MS 200
+
+// Selectable video FEC overheads (parity messages, media messages per group)
+static const struct {
+  const char *name;
+  int parities;
+  int group;
+} video_fec_modes[] = {
+  { "Off",          0, 0 },
+  { "1/16 (XOR)",   1, 16 },
+  { "1/8 (XOR)",    1, 8 },
+  { "2/16 (RS)",    2, 16 },
+  { "2/8 (RS)",     2, 8 }
+};
+
 #if 0
 #include <X11/Xlib.h>
 #endif
@@ -48,12 +65,14 @@ Controller::Controller(int &argc, char **argv):
   QApplication(argc, argv),
   joystick(NULL),
   transmitter(NULL), vr(NULL), window(NULL), textDebug(NULL),
-  labelConnectionStatus(NULL), labelRTT(NULL), labelResendTimeout(NULL),
-  labelUptime(NULL), labelVideoBufferPercent(NULL), labelLoadAvg(NULL), labelWlan(NULL),
+  labelConnectionStatus(NULL), labelRTT(NULL), labelSmoothedRTT(NULL), labelResendTimeout(NULL),
+  labelUptime(NULL), labelVideoBufferPercent(NULL), labelVideoFirstFrame(NULL), labelLatency(NULL), labelClockSync(NULL),
+  labelLoadAvg(NULL), labelWlan(NULL),
   labelDistance(NULL), labelTemperature(NULL),
   labelCurrent(NULL), labelVoltage(NULL),
   horizSlider(NULL), vertSlider(NULL), buttonEnableCalibrate(NULL),
   buttonEnableVideo(NULL), buttonHalfSpeed(NULL), sliderVideoQuality(NULL), comboboxVideoSource(NULL),
+  comboboxVideoFec(NULL),
   labelRx(NULL), labelTx(NULL), 
   labelCalibrateSpeed(NULL), labelCalibrateTurn(NULL),
   labelSpeed(NULL), labelTurn(NULL), sliderZoom(NULL), sliderFocus(NULL),
@@ -63,7 +82,8 @@ Controller::Controller(int &argc, char **argv):
   calibrateSpeed(0), calibrateTurn(0),
   throttleTimerCameraXY(NULL), throttleTimerSpeedTurn(NULL),
   cameraXYPending(false), speedTurnPending(false),
-  speedTurnPendingSpeed(0), speedTurnPendingTurn(0)
+  speedTurnPendingSpeed(0), speedTurnPendingTurn(0),
+  keyframeRequestTime(), keyframeRequests(0)
 {
 
 }
@@ -181,6 +201,13 @@ void Controller::createGUI(void)
   grid->addWidget(label, ++row, 0);
   grid->addWidget(labelRTT, row, 1);
 
+  // Smoothed round trip time and its variance
+  label = new QLabel("Smoothed RTT:");
+  labelSmoothedRTT = new QLabel("");
+
+  grid->addWidget(label, ++row, 0);
+  grid->addWidget(labelSmoothedRTT, row, 1);
+
   // Resent Packets
   label = new QLabel("Resends:");
   labelResentPackets = new QLabel("0");
@@ -334,6 +361,27 @@ void Controller::createGUI(void)
   grid->addWidget(label, ++row, 0);
   grid->addWidget(labelVideoBufferPercent, row, 1);
 
+  // Time from enabling the video to the first encoded frame on the slave
+  label = new QLabel("Video start (ms):");
+  labelVideoFirstFrame = new QLabel("");
+
+  grid->addWidget(label, ++row, 0);
+  grid->addWidget(labelVideoFirstFrame, row, 1);
+
+  // Video latency per stage, from the camera to the display
+  label = new QLabel("Video latency:");
+  labelLatency = new QLabel("");
+
+  grid->addWidget(label, ++row, 0);
+  grid->addWidget(labelLatency, row, 1);
+
+  // Offset of the slave's clock, the network latency depends on it
+  label = new QLabel("Clock sync:");
+  labelClockSync = new QLabel("");
+
+  grid->addWidget(label, ++row, 0);
+  grid->addWidget(labelClockSync, row, 1);
+
   // Enable calibrate
   label = new QLabel("Calibrate:");
   grid->addWidget(label, ++row, 0);
@@ -367,6 +415,16 @@ void Controller::createGUI(void)
   grid->addWidget(comboboxVideoSource, row, 1);
   QObject::connect(comboboxVideoSource, SIGNAL(currentIndexChanged(int)), this, SLOT(selectedVideoSource(int)));
 
+  // Video forward error correction
+  label = new QLabel("Video FEC:");
+  grid->addWidget(label, ++row, 0);
+  comboboxVideoFec = new QComboBox();
+  for (uint i = 0; i < sizeof(video_fec_modes) / sizeof(video_fec_modes[0]); i++) {
+	comboboxVideoFec->addItem(video_fec_modes[i].name);
+  }
+  grid->addWidget(comboboxVideoFec, row, 1);
+  QObject::connect(comboboxVideoFec, SIGNAL(currentIndexChanged(int)), this, SLOT(selectedVideoFec(int)));
+
   joystick = new Joystick();
   joystick->init();
   QObject::connect(joystick, SIGNAL(buttonChanged(int, quint16)), this, SLOT(buttonChanged(int, quint16)));
@@ -512,27 +570,38 @@ void Controller::connect(QString host, quint16 port)
   }
 
   // Create a new transmitter
-  transmitter = new Transmitter(host, port);
+  transmitter = new TransmitterThread(host, port);
+
+  // The receive buffers are sized for the max datagram of the slave
+  transmitter->setMTU(Transmitter::configuredMTU());
 
   transmitter->initSocket();
 
   QObject::connect(transmitter, SIGNAL(rtt(int)), this, SLOT(updateRtt(int)));
   QObject::connect(transmitter, SIGNAL(resendTimeout(int)), this, SLOT(updateResendTimeout(int)));
+  QObject::connect(transmitter, SIGNAL(rttEstimate(int, int, int)), this, SLOT(updateRttEstimate(int, int, int)));
   QObject::connect(transmitter, SIGNAL(resentPackets(quint32)), this, SLOT(updateResentPackets(quint32)));
-  QObject::connect(transmitter, SIGNAL(media(QByteArray *)), vr, SLOT(consumeVideo(QByteArray *)));
+  QObject::connect(transmitter, SIGNAL(media(MediaBuffer *)), vr, SLOT(consumeVideo(MediaBuffer *)));
   QObject::connect(transmitter, SIGNAL(status(quint8)), this, SLOT(updateStatus(quint8)));
-  QObject::connect(transmitter, SIGNAL(networkRate(int, int, int, int)), this, SLOT(updateNetworkRate(int, int, int, int)));
+  QObject::connect(transmitter, SIGNAL(networkRate(int, int, int, int, double, double)), this, SLOT(updateNetworkRate(int, int, int, int, double, double)));
   QObject::connect(transmitter, SIGNAL(value(quint8, quint16)), this, SLOT(updateValue(quint8, quint16)));
   QObject::connect(transmitter, SIGNAL(periodicValue(quint8, quint16)), this, SLOT(updatePeriodicValue(quint8, quint16)));
+  QObject::connect(transmitter, SIGNAL(typedValue(quint8, quint8, qint64)), this, SLOT(updateTypedValue(quint8, quint8, qint64)));
   QObject::connect(transmitter, SIGNAL(debug(QString *)), this, SLOT(showDebug(QString *)));
   QObject::connect(transmitter, SIGNAL(connectionStatusChanged(int)), this, SLOT(updateConnectionStatus(int)));
+  QObject::connect(transmitter, SIGNAL(latency(LatencyStats *)), this, SLOT(updateLatency(LatencyStats *)));
+  QObject::connect(transmitter, SIGNAL(clockSync(quint32, double, int)), this, SLOT(updateClockSync(quint32, double, int)));
 
   QObject::connect(vr, SIGNAL(pos(double, double)), this, SLOT(updateCamera(double, double)));
   QObject::connect(vr, SIGNAL(motorControlEvent(QKeyEvent *)), this, SLOT(updateMotor(QKeyEvent *)));
+  QObject::connect(vr, SIGNAL(videoLost()), this, SLOT(requestKeyframe()));
 
   // Send ping every second (unless other high priority packet are sent)
   transmitter->enableAutoPing(true);
 
+  // Report the received video quality to the slave once per second
+  transmitter->enableReceiverReports(true);
+
   // Get ready for receiving video
   vr->enableVideo(true);
 }
@@ -541,7 +610,7 @@ void Controller::connect(QString host, quint16 port)
 
 void Controller::updateRtt(int ms)
 {
-  qDebug() << "RTT:" << ms;
+  logTrace(LOG_NET) << "RTT:" << ms;
   if (labelRTT) {
 	labelRTT->setText(QString::number(ms));
   }
@@ -551,7 +620,7 @@ void Controller::updateRtt(int ms)
 
 void Controller::updateResendTimeout(int ms)
 {
-  qDebug() << "ResendTimeout:" << ms;
+  logTrace(LOG_NET) << "ResendTimeout:" << ms;
   if (labelResendTimeout) {
 	labelResendTimeout->setText(QString::number(ms));
   }
@@ -559,9 +628,19 @@ void Controller::updateResendTimeout(int ms)
 
 
 
+void Controller::updateRttEstimate(int srttMs, int rttVarMs, int rtoMs)
+{
+  logTrace(LOG_NET) << "SRTT:" << srttMs << ", RTTVAR:" << rttVarMs << ", RTO:" << rtoMs;
+  if (labelSmoothedRTT) {
+	labelSmoothedRTT->setText(QString::number(srttMs) + " +- " + QString::number(rttVarMs));
+  }
+}
+
+
+
 void Controller::updateResentPackets(quint32 resendCounter)
 {
-  qDebug() << "ResentPackets:" << resendCounter;
+  logTrace(LOG_NET) << "ResentPackets:" << resendCounter;
   if (labelResentPackets) {
 	labelResentPackets->setText(QString::number(resendCounter));
   }
@@ -691,14 +770,30 @@ void Controller::selectedVideoSource(int index)
 
 
 
-void Controller::updateNetworkRate(int payloadRx, int totalRx, int payloadTx, int totalTx)
+void Controller::selectedVideoFec(int index)
+{
+  qDebug() << "in" << __FUNCTION__ << ", index:" << index;
+
+  if (index < 0 || index >= (int)(sizeof(video_fec_modes) / sizeof(video_fec_modes[0]))) {
+	return;
+  }
+
+  transmitter->sendValue(MSG_SUBTYPE_VIDEO_FEC,
+						 MSG_VIDEO_FEC_VALUE(video_fec_modes[index].parities, video_fec_modes[index].group));
+}
+
+
+
+void Controller::updateNetworkRate(int payloadRx, int totalRx, int payloadTx, int totalTx, double rxBatch, double txBatch)
 {
   if (labelRx) {
-    labelRx->setText(QString::number(payloadRx) + " / " + QString::number(totalRx));
+	labelRx->setText(QString::number(payloadRx) + " / " + QString::number(totalRx) +
+					 " (" + QString::number(rxBatch, 'f', 1) + " per read)");
   }
 
   if (labelTx) {
-    labelTx->setText(QString::number(payloadTx) + " / " + QString::number(totalTx));
+	labelTx->setText(QString::number(payloadTx) + " / " + QString::number(totalTx) +
+					 " (" + QString::number(txBatch, 'f', 1) + " per write)");
   }
 }
 
@@ -709,6 +804,11 @@ void Controller::updateValue(quint8 type, quint16 value)
   qDebug() << "in" << __FUNCTION__ << ", type:" << type << ", value:" << value;
 
   switch (type) {
+  case MSG_SUBTYPE_VIDEO_FIRST_FRAME:
+	if (labelVideoFirstFrame) {
+	  labelVideoFirstFrame->setNum(value);
+	}
+	break;
   default:
 	qWarning("%s: Unhandled type: %d", __FUNCTION__, type);
   }
@@ -716,48 +816,65 @@ void Controller::updateValue(quint8 type, quint16 value)
 
 
 
+/*
+ * The 16 bit values are fixed point values with implicit decimals.
+ */
 void Controller::updatePeriodicValue(quint8 type, quint16 value)
 {
-  qDebug() << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(type) << ", value:" << value;
+  int decimals = 0;
 
   switch (type) {
   case MSG_SUBTYPE_DISTANCE:
-	if (labelDistance) {
-	  labelDistance->setNum(value/100.0);
-	}
-	break;
   case MSG_SUBTYPE_TEMPERATURE:
-	if (labelTemperature) {
-	  labelTemperature->setNum(value/100.0);
-	}
+  case MSG_SUBTYPE_CPU_USAGE:
+	decimals = 2;
 	break;
   case MSG_SUBTYPE_BATTERY_CURRENT:
-	if (labelCurrent) {
-	  labelCurrent->setNum(value/1000.0);
-	}
-	break;
   case MSG_SUBTYPE_BATTERY_VOLTAGE:
-	if (labelVoltage) {
-	  labelVoltage->setNum(value/1000.0);
-	}
+	decimals = 3;
 	break;
+  }
+
+  updateTypedValue(type, MSG_VALUE_TAG(MSG_VALUE_TYPE_FIXED, decimals), value);
+}
+
+
+
+void Controller::updateTypedValue(quint8 type, quint8 tag, qint64 value)
+{
+  logTrace(LOG_APP) << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(type) << ", tag:" << tag << ", value:" << value;
+
+  QLabel *label = periodicValueLabel(type);
+
+  if (!label) {
+	qWarning("%s: Unhandled type: %d", __FUNCTION__, type);
+	return;
+  }
+
+  label->setNum(Message::typedValueToDouble(tag, value));
+}
+
+
+
+QLabel *Controller::periodicValueLabel(quint8 type)
+{
+  switch (type) {
+  case MSG_SUBTYPE_DISTANCE:
+	return labelDistance;
+  case MSG_SUBTYPE_TEMPERATURE:
+	return labelTemperature;
+  case MSG_SUBTYPE_BATTERY_CURRENT:
+	return labelCurrent;
+  case MSG_SUBTYPE_BATTERY_VOLTAGE:
+	return labelVoltage;
   case MSG_SUBTYPE_CPU_USAGE:
-	if (labelLoadAvg) {
-	  labelLoadAvg->setNum(value/100.0);
-	}
-	break;
+	return labelLoadAvg;
   case MSG_SUBTYPE_SIGNAL_STRENGTH:
-	if (labelWlan) {
-	  labelWlan->setNum(value);
-	}
+	return labelWlan;
   case MSG_SUBTYPE_UPTIME:
-	if (labelUptime) {
-	  labelUptime->setNum(value);
-	}
-	break;
-	break;
+	return labelUptime;
   default:
-	qWarning("%s: Unhandled type: %d", __FUNCTION__, type);
+	return NULL;
   }
 }
 
@@ -1204,7 +1321,71 @@ void Controller::updateCameraPeridiocally(void)
  */
 void Controller::updateVideoBufferPercent(void)
 {
+  quint16 percent = vr->getBufferFilled();
+
   if (labelVideoBufferPercent) {
-	labelVideoBufferPercent->setNum(vr->getBufferFilled());
+	labelVideoBufferPercent->setNum(percent);
+  }
+
+  // Included in the next receiver report
+  if (transmitter) {
+	transmitter->setReceiverBufferFill(percent);
+  }
+}
+
+
+
+/*
+ * Asks the slave for a new keyframe after video loss. Lost packets usually
+ * come in bursts, so a single request is sent per burst.
+ */
+void Controller::requestKeyframe(void)
+{
+  if (!transmitter) {
+	return;
+  }
+
+  if (!keyframeRequestTime.isNull() && keyframeRequestTime.elapsed() < KEYFRAME_REQUEST_INTERVAL_MS) {
+	return;
+  }
+
+  keyframeRequestTime.start();
+
+  qDebug() << "in" << __FUNCTION__;
+
+  // The value only makes each request different from the previous one
+  transmitter->sendValue(MSG_SUBTYPE_REQUEST_KEYFRAME, ++keyframeRequests);
+}
+
+
+
+/*
+ * Combines the latencies of the slave and the network with those of the
+ * local video pipeline. Called once per second.
+ */
+void Controller::updateLatency(LatencyStats *stats)
+{
+  vr->takeLatencyStats(stats);
+
+  QString text = stats->toString();
+
+  if (labelLatency) {
+	labelLatency->setText(text);
+  }
+
+  logInfo(LOG_MEDIA) << "Video latency:" << text.replace("\n", ", ");
+
+  delete stats;
+}
+
+
+
+void Controller::updateClockSync(quint32 offsetUs, double driftPpm, int accuracyUs)
+{
+  if (labelClockSync) {
+	labelClockSync->setText(QString("%1 ms, %2 ppm, +-%3 ms")
+							.arg((qint32)offsetUs / 1000.0, 0, 'f', 1)
+							.arg(driftPpm, 0, 'f', 1)
+							.arg(accuracyUs / 1000.0, 0, 'f', 1));
   }
 }
@@ -27,7 +27,7 @@
 #ifndef _CONTROLLER_H
 #define _CONTROLLER_H
 
-#include "Transmitter.h"
+#include "TransmitterThread.h"
 #include "VideoReceiver.h"
 #include "Joystick.h"
 
@@ -55,6 +55,7 @@ class Controller : public QApplication
  private slots:
   void updateRtt(int ms);
   void updateResendTimeout(int ms);
+  void updateRttEstimate(int srttMs, int rttVarMs, int rtoMs);
   void updateResentPackets(quint32 resendCounter);
   void updateStatus(quint8 status);
   void updateCalibrateSpeed(int percent);
@@ -66,9 +67,11 @@ class Controller : public QApplication
   void clickedEnableVideo(bool enabled);
   void clickedHalfSpeed(bool enabled);
   void selectedVideoSource(int index);
-  void updateNetworkRate(int payloadRx, int totalRx, int payloadTx, int totalTx);
+  void selectedVideoFec(int index);
+  void updateNetworkRate(int payloadRx, int totalRx, int payloadTx, int totalTx, double rxBatch, double txBatch);
   void updateValue(quint8 type, quint16 value);
   void updatePeriodicValue(quint8 type, quint16 value);
+  void updateTypedValue(quint8 type, quint8 tag, qint64 value);
   void showDebug(QString *msg);
   void updateConnectionStatus(int status);
 
@@ -86,14 +89,18 @@ class Controller : public QApplication
   void sendCameraFocus(void);
   void sendVideoQuality(void);
   void updateVideoBufferPercent(void);
+  void requestKeyframe(void);
+  void updateLatency(LatencyStats *stats);
+  void updateClockSync(quint32 offsetUs, double driftPpm, int accuracyUs);
 
  private:
   void sendCameraXY(void);
   void sendSpeedTurn(int speed, int turn);
+  QLabel *periodicValueLabel(quint8 type);
 
   Joystick *joystick;
 
-  Transmitter *transmitter;
+  TransmitterThread *transmitter;
   VideoReceiver *vr;
 
   QWidget *window;
@@ -101,10 +108,14 @@ class Controller : public QApplication
 
   QLabel *labelConnectionStatus;;
   QLabel *labelRTT;
+  QLabel *labelSmoothedRTT;
   QLabel *labelResendTimeout;
   QLabel *labelResentPackets;
   QLabel *labelUptime;
   QLabel *labelVideoBufferPercent;
+  QLabel *labelVideoFirstFrame;
+  QLabel *labelLatency;
+  QLabel *labelClockSync;
   QLabel *labelLoadAvg;
   QLabel *labelWlan;
   QLabel *labelDistance;
@@ -122,6 +133,7 @@ class Controller : public QApplication
   QSlider *sliderVideoQuality;
 
   QComboBox *comboboxVideoSource;
+  QComboBox *comboboxVideoFec;
 
   QLabel *labelRx;
   QLabel *labelTx;
@@ -153,6 +165,9 @@ class Controller : public QApplication
   bool speedTurnPending;
   int speedTurnPendingSpeed;
   int speedTurnPendingTurn;
+
+  QTime keyframeRequestTime;
+  quint16 keyframeRequests;
 };
 
 #endif
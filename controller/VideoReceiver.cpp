@@ -1,4 +1,6 @@
 #include "VideoReceiver.h"
+#include "Clock.h"
+#include "Log.h"
 
 #include <QWidget>
 #include <QDebug>
@@ -12,7 +14,8 @@
 #include <string.h>                          /* memcpy */
 
 VideoReceiver::VideoReceiver(QWidget *parent):
-  QWidget(parent), xid(0), pipeline(NULL), source(NULL)
+  QWidget(parent), xid(0), pipeline(NULL), source(NULL),
+  latencyStats(), latencyMutex(), decodeStartUs(0), rtpTimestampValid(false), rtpTimestamp(0)
 {
 
 #ifndef GLIB_VERSION_2_32
@@ -165,6 +168,33 @@ bool VideoReceiver::enableVideo(bool enable)
 	return false;
   }
 
+  // The jitterbuffer tells about lost packets with a custom event
+  // (do-lost). Watch for them to request a new keyframe from the slave.
+  {
+	GstPad *pad = gst_element_get_static_pad(rtpdepay, "sink");
+	gst_pad_add_event_probe(pad, G_CALLBACK(depayEventCB), this);
+	gst_object_unref(pad);
+  }
+
+  // Measure the latency of the jitterbuffer, the decoder and the sink
+  {
+	GstPad *pad = gst_element_get_static_pad(jitterbuffer, "src");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(jitterbufferBufferCB), this);
+	gst_object_unref(pad);
+
+	pad = gst_element_get_static_pad(decoder, "sink");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(decoderInputCB), this);
+	gst_object_unref(pad);
+
+	pad = gst_element_get_static_pad(decoder, "src");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(decoderOutputCB), this);
+	gst_object_unref(pad);
+
+	pad = gst_element_get_static_pad(sink, "sink");
+	gst_pad_add_buffer_probe(pad, G_CALLBACK(sinkBufferCB), this);
+	gst_object_unref(pad);
+  }
+
   // Add a watch for new messages on our pipeline's message bus
   bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
   gst_bus_add_watch(bus, busCall, this);
@@ -179,15 +209,19 @@ bool VideoReceiver::enableVideo(bool enable)
 
 
 
-void VideoReceiver::consumeVideo(QByteArray *media)
+void VideoReceiver::consumeVideo(MediaBuffer *media)
 {
-  qDebug() << "In" << __FUNCTION__;
-
-  GstBuffer *buffer = gst_buffer_new_and_alloc(media->length());
+  logTrace(LOG_MEDIA) << "In" << __FUNCTION__;
 
-  // FIXME: zero copy?
-  memcpy(GST_BUFFER_DATA(buffer), media->data(), media->length());
+  // Wrap the received datagram memory without copying. The reference
+  // passed to us is released by GStreamer when the buffer is freed.
+  GstBuffer *buffer = gst_buffer_new();
+  GST_BUFFER_DATA(buffer) = (guint8 *)media->data();
+  GST_BUFFER_SIZE(buffer) = media->length();
+  GST_BUFFER_MALLOCDATA(buffer) = (guint8 *)media;
+  GST_BUFFER_FREE_FUNC(buffer) = &VideoReceiver::releaseMedia;
 
+  // appsrc takes the ownership of the buffer even on failure
   if (gst_app_src_push_buffer(GST_APP_SRC(source), buffer) != GST_FLOW_OK) {
 	qWarning("Error with gst_app_src_push_buffer");
   }
@@ -195,6 +229,165 @@ void VideoReceiver::consumeVideo(QByteArray *media)
 
 
 
+/*
+ * Called in the streaming thread for every event arriving to the
+ * depayloader. Lost packets mean the decoder can't continue until the next
+ * keyframe.
+ */
+gboolean VideoReceiver::depayEventCB(GstPad *, GstEvent *event, gpointer data)
+{
+  VideoReceiver *vr = static_cast<VideoReceiver *>(data);
+
+  if (GST_EVENT_TYPE(event) == GST_EVENT_CUSTOM_DOWNSTREAM &&
+	  gst_structure_has_name(gst_event_get_structure(event), "GstRTPPacketLost")) {
+	logTrace(LOG_MEDIA) << "In" << __FUNCTION__ << ", video packet lost";
+	emit(vr->videoLost());
+  }
+
+  // Keep the event
+  return true;
+}
+
+
+
+/*
+ * The buffers are timestamped by appsrc when pushed, so their age is the
+ * time since they were received. The jitterbuffer may adjust the
+ * timestamps for the clock skew, so this is an approximation. Returns -1 if
+ * not known.
+ */
+qint64 VideoReceiver::bufferAgeUs(GstPad *pad, GstBuffer *buffer)
+{
+  qint64 ageUs = -1;
+
+  if (!GST_BUFFER_TIMESTAMP_IS_VALID(buffer)) {
+	return ageUs;
+  }
+
+  GstElement *element = gst_pad_get_parent_element(pad);
+  GstClock *clock = element ? gst_element_get_clock(element) : NULL;
+
+  if (clock) {
+	GstClockTime now = gst_clock_get_time(clock) - gst_element_get_base_time(element);
+	if (now >= GST_BUFFER_TIMESTAMP(buffer)) {
+	  ageUs = (now - GST_BUFFER_TIMESTAMP(buffer)) / GST_USECOND;
+	}
+	gst_object_unref(clock);
+  }
+
+  if (element) {
+	gst_object_unref(element);
+  }
+
+  return ageUs;
+}
+
+
+
+/*
+ * The time spent in the jitterbuffer, sampled from the first RTP packet of
+ * each frame. The packets of a frame share the RTP timestamp.
+ */
+gboolean VideoReceiver::jitterbufferBufferCB(GstPad *pad, GstBuffer *buffer, gpointer data)
+{
+  VideoReceiver *vr = static_cast<VideoReceiver *>(data);
+
+  if (GST_BUFFER_SIZE(buffer) < 12) {
+	return true;
+  }
+
+  const guint8 *rtp = GST_BUFFER_DATA(buffer);
+  quint32 timestamp = ((quint32)rtp[4] << 24) | (rtp[5] << 16) | (rtp[6] << 8) | rtp[7];
+
+  if (vr->rtpTimestampValid && timestamp == vr->rtpTimestamp) {
+	return true;
+  }
+
+  vr->rtpTimestampValid = true;
+  vr->rtpTimestamp = timestamp;
+
+  qint64 ageUs = bufferAgeUs(pad, buffer);
+  if (ageUs >= 0) {
+	QMutexLocker locker(&vr->latencyMutex);
+	vr->latencyStats.stage[LATENCY_JITTERBUFFER].add(ageUs);
+  }
+
+  return true;
+}
+
+
+
+gboolean VideoReceiver::decoderInputCB(GstPad *, GstBuffer *, gpointer data)
+{
+  VideoReceiver *vr = static_cast<VideoReceiver *>(data);
+
+  vr->decodeStartUs = monotonicUs();
+
+  return true;
+}
+
+
+
+/*
+ * The decoder outputs the frame in the same streaming thread and call chain
+ * as its last input buffer, so the decoding time is the time since then.
+ */
+gboolean VideoReceiver::decoderOutputCB(GstPad *, GstBuffer *, gpointer data)
+{
+  VideoReceiver *vr = static_cast<VideoReceiver *>(data);
+
+  if (vr->decodeStartUs) {
+	QMutexLocker locker(&vr->latencyMutex);
+	vr->latencyStats.stage[LATENCY_DECODE].add(monotonicUs() - vr->decodeStartUs);
+  }
+
+  return true;
+}
+
+
+
+/*
+ * The sink gets one buffer per decoded frame, carrying the timestamp of
+ * the received data it was decoded from.
+ */
+gboolean VideoReceiver::sinkBufferCB(GstPad *pad, GstBuffer *buffer, gpointer data)
+{
+  VideoReceiver *vr = static_cast<VideoReceiver *>(data);
+
+  qint64 ageUs = bufferAgeUs(pad, buffer);
+  if (ageUs >= 0) {
+	QMutexLocker locker(&vr->latencyMutex);
+	vr->latencyStats.stage[LATENCY_DISPLAY].add(ageUs);
+  }
+
+  return true;
+}
+
+
+
+/*
+ * Adds the latencies collected since the previous call to the stats.
+ */
+void VideoReceiver::takeLatencyStats(LatencyStats *stats)
+{
+  QMutexLocker locker(&latencyMutex);
+
+  stats->add(latencyStats);
+  latencyStats.clear();
+}
+
+
+
+/*
+ * Called by GStreamer when the buffer wrapping the media is freed.
+ */
+void VideoReceiver::releaseMedia(gpointer media)
+{
+  ((MediaBuffer *)media)->unref();
+}
+
+
+
 void VideoReceiver::mouseMoveEvent(QMouseEvent *event)
 {
 
@@ -248,6 +441,6 @@ quint16 VideoReceiver::getBufferFilled(void)
   g_object_get(G_OBJECT(jitterbuffer),
 			   "percent", &percent,
 			   NULL);
-  qDebug() << "In" << __FUNCTION__ << "percent:" << percent;
+  logTrace(LOG_MEDIA) << "In" << __FUNCTION__ << "percent:" << percent;
   return percent;
 }
@@ -3,6 +3,11 @@
 
 #include <QWidget>
 
+#include "MediaBuffer.h"
+#include "Latency.h"
+
+#include <QMutex>
+
 #include <gst/gst.h>
 #include <glib.h>
 
@@ -15,13 +20,15 @@ class VideoReceiver : public QWidget
   ~VideoReceiver(void);
   bool enableVideo(bool enable);
   quint16 getBufferFilled(void);
+  void takeLatencyStats(LatencyStats *stats);
 
  public slots:
-  void consumeVideo(QByteArray *media);
+  void consumeVideo(MediaBuffer *media);
 
  signals:
   void pos(double x_percent, double y_percent);
   void motorControlEvent(QKeyEvent *event);
+  void videoLost(void);
 
  private:
   void mouseMoveEvent(QMouseEvent *event);
@@ -30,10 +37,24 @@ class VideoReceiver : public QWidget
   static gboolean busCall(GstBus     *bus,
 						  GstMessage *msg,
 						  gpointer    data);
+  static void releaseMedia(gpointer media);
+  static gboolean depayEventCB(GstPad *pad, GstEvent *event, gpointer data);
+  static gboolean jitterbufferBufferCB(GstPad *pad, GstBuffer *buffer, gpointer data);
+  static gboolean decoderInputCB(GstPad *pad, GstBuffer *buffer, gpointer data);
+  static gboolean decoderOutputCB(GstPad *pad, GstBuffer *buffer, gpointer data);
+  static gboolean sinkBufferCB(GstPad *pad, GstBuffer *buffer, gpointer data);
+  static qint64 bufferAgeUs(GstPad *pad, GstBuffer *buffer);
 
   WId xid;
   GstElement *pipeline;
   GstElement *source;
+
+  // Latency of the stages in the streaming thread
+  LatencyStats latencyStats;
+  QMutex latencyMutex;
+  qint64 decodeStartUs;
+  bool rtpTimestampValid;
+  quint32 rtpTimestamp;     // Of the latest frame out of the jitterbuffer
 };
 
 #endif
@@ -25,6 +25,7 @@
  */
 
 #include "ControlBoard.h"
+#include "Log.h"
 
 // For traditional serial port handling
 #include <termios.h>
@@ -223,7 +224,7 @@ void ControlBoard::parseSerialData(void)
 
     serialData.chop(chop);
 
-	qDebug() << __FUNCTION__ << "have msg:" << serialData.data();
+	logTrace(LOG_HW) << __FUNCTION__ << "have msg:" << serialData.data();
   } else {
 	// Wait for more data
 	return;
@@ -235,28 +236,28 @@ void ControlBoard::parseSerialData(void)
 
 	quint16 value = serialData.trimmed().toInt();
 
-	qDebug() << __FUNCTION__ << "Temperature:" << value;
+	logTrace(LOG_HW) << __FUNCTION__ << "Temperature:" << value;
 	emit(temperature(value));
   } else if (serialData.startsWith("dst: ")) {
 	serialData.remove(0,5);
 
 	quint16 value = serialData.trimmed().toInt();
 
-	qDebug() << __FUNCTION__ << "Distance:" << value;
+	logTrace(LOG_HW) << __FUNCTION__ << "Distance:" << value;
 	emit(distance(value));
   } else if (serialData.startsWith("amp: ")) {
 	serialData.remove(0,5);
 
 	quint16 value = serialData.trimmed().toInt();
 
-	qDebug() << __FUNCTION__ << "Current consumption:" << value;
+	logTrace(LOG_HW) << __FUNCTION__ << "Current consumption:" << value;
 	emit(current(value));
   } else if (serialData.startsWith("vlt: ")) {
 	serialData.remove(0,5);
 
 	quint16 value = serialData.trimmed().toInt();
 
-	qDebug() << __FUNCTION__ << "Battery voltage:" << value;
+	logTrace(LOG_HW) << __FUNCTION__ << "Battery voltage:" << value;
 	emit(voltage(value));
   } else if (serialData.startsWith("d: ")) {
 	serialData.remove(0,3);
@@ -32,27 +32,32 @@ struct hardwareInfo {
   QString name;
   QString videoEncoder;
   bool    bitrateInKilobits;
+  bool    encoderRenegotiates;
 };
 
 static const struct hardwareInfo hardwareList[] = {
   {
 	"gumstix_overo",
 	"ffmpegcolorspace ! dsph264enc name=encoder",
+	false,
 	false
   },
   {
 	"generic_x86",
 	"ffmpegcolorspace ! x264enc name=encoder",
+	true,
 	true
   },
   {
 	"tegra3",
 	"nvvidconv ! capsfilter caps=video/x-nvrm-yuv ! nv_omx_h264enc name=encoder",
+	false,
 	false
   },
   {
 	"tegrak1",
 	"nv_omx_h264enc name=encoder",
+	false,
 	false
   }
 };
@@ -93,3 +98,9 @@ bool Hardware::bitrateInKilobits(void) const
   return hardwareList[hw].bitrateInKilobits;
 }
 
+
+bool Hardware::encoderRenegotiates(void) const
+{
+  return hardwareList[hw].encoderRenegotiates;
+}
+
@@ -45,6 +45,9 @@ class Hardware
   // Does encoder take bitrate as kilobits instead of bits
   bool bitrateInKilobits(void) const;
 
+  // Does encoder accept new video caps while playing
+  bool encoderRenegotiates(void) const;
+
  private:
   uint hw;
 };
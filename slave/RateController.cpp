@@ -0,0 +1,173 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "RateController.h"
+#include "Log.h"
+
+#include <QtGlobal>
+
+RateController::RateController(void):
+  QObject(), timer(), maxBitrate(0), currentBitrate(0),
+  srttMs(0), rttVarMs(0), baseRttMs(-1), windowMinRttMs(-1), windowIntervals(0),
+  resendCounter(0), lastResendCounter(0), lossPercent(0)
+{
+  QObject::connect(&timer, SIGNAL(timeout()), this, SLOT(evaluate()));
+  timer.setSingleShot(false);
+}
+
+
+
+RateController::~RateController(void)
+{
+  timer.stop();
+}
+
+
+
+/*
+ * Starts adapting from the minimum bitrate, as nothing is known about the
+ * link yet.
+ */
+void RateController::start(int maxBitrate)
+{
+  logDebug(LOG_VIDEO) << "in" << __FUNCTION__ << ", max bitrate:" << maxBitrate;
+
+  this->maxBitrate = qMax(maxBitrate, RATE_CONTROL_MIN_BITRATE);
+  currentBitrate = qMin(this->maxBitrate, qMax(RATE_CONTROL_MIN_BITRATE, this->maxBitrate / 4));
+  baseRttMs = -1;
+  windowMinRttMs = -1;
+  windowIntervals = 0;
+  lastResendCounter = resendCounter;
+  lossPercent = 0;
+
+  emit(bitrate(currentBitrate));
+
+  timer.start(RATE_CONTROL_INTERVAL_MS);
+}
+
+
+
+void RateController::stop(void)
+{
+  logDebug(LOG_VIDEO) << "in" << __FUNCTION__;
+
+  timer.stop();
+}
+
+
+
+void RateController::setMaxBitrate(int maxBitrate)
+{
+  logDebug(LOG_VIDEO) << "in" << __FUNCTION__ << ", max bitrate:" << maxBitrate;
+
+  this->maxBitrate = qMax(maxBitrate, RATE_CONTROL_MIN_BITRATE);
+
+  currentBitrate = qMin(currentBitrate, this->maxBitrate);
+
+  // The new video quality has just set the encoder to the max bitrate
+  if (timer.isActive()) {
+	emit(bitrate(currentBitrate));
+  }
+}
+
+
+
+void RateController::updateRtt(int srttMs, int rttVarMs, int rtoMs)
+{
+  Q_UNUSED(rtoMs);
+
+  this->srttMs = srttMs;
+  this->rttVarMs = rttVarMs;
+
+  if (windowMinRttMs < 0 || srttMs < windowMinRttMs) {
+	windowMinRttMs = srttMs;
+  }
+
+  if (baseRttMs < 0 || srttMs < baseRttMs) {
+	baseRttMs = srttMs;
+  }
+}
+
+
+
+void RateController::updateResentPackets(quint32 resendCounter)
+{
+  this->resendCounter = resendCounter;
+}
+
+
+
+void RateController::updateReceiverReport(int highestSeq, int lost, int lossPercent, double jitterMs, int bufferFill)
+{
+  logTrace(LOG_VIDEO) << "in" << __FUNCTION__ << ", highest seq:" << highestSeq << ", lost:" << lost
+					  << ", loss:" << lossPercent << "%, jitter:" << jitterMs << "ms, buffer:" << bufferFill << "%";
+
+  this->lossPercent = lossPercent;
+}
+
+
+
+void RateController::evaluate(void)
+{
+  // Re-sample the base RTT periodically so that a route change to a longer
+  // path isn't treated as congestion forever
+  if (++windowIntervals >= RATE_CONTROL_BASE_RTT_WINDOW) {
+	baseRttMs = windowMinRttMs;
+	windowMinRttMs = -1;
+	windowIntervals = 0;
+  }
+
+  quint32 resends = resendCounter - lastResendCounter;
+  lastResendCounter = resendCounter;
+
+  int queuingDelay = 0;
+  if (baseRttMs >= 0) {
+	queuingDelay = srttMs - baseRttMs;
+  }
+
+  int newBitrate = currentBitrate;
+
+  if (lossPercent > RATE_CONTROL_LOSS_HIGH) {
+	// Heavy loss: decrease in proportion to the loss
+	newBitrate = (int)(currentBitrate * (1.0 - 0.5 * lossPercent / 100.0));
+  } else if (queuingDelay > qMax(RATE_CONTROL_MAX_QUEUING_DELAY, 2 * rttVarMs) || resends > 0) {
+	// Queues are building up or control messages are being lost
+	newBitrate = (int)(currentBitrate * 0.85);
+  } else if (lossPercent < RATE_CONTROL_LOSS_LOW) {
+	// Clean link: probe for more
+	newBitrate = (int)(currentBitrate * 1.08) + 1;
+  }
+
+  newBitrate = qBound(RATE_CONTROL_MIN_BITRATE, newBitrate, maxBitrate);
+
+  logTrace(LOG_VIDEO) << "in" << __FUNCTION__ << ", srtt:" << srttMs << ", base rtt:" << baseRttMs
+					  << ", resends:" << resends << ", loss:" << lossPercent << "%, bitrate:" << newBitrate;
+
+  if (newBitrate != currentBitrate) {
+	currentBitrate = newBitrate;
+	emit(bitrate(currentBitrate));
+  }
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _RATECONTROLLER_H
+#define _RATECONTROLLER_H
+
+#include <QObject>
+#include <QTimer>
+
+// How often the target bitrate is re-evaluated
+#define RATE_CONTROL_INTERVAL_MS        500
+
+// Bitrate limits in kbps. The upper limit is set by the video quality.
+#define RATE_CONTROL_MIN_BITRATE        128
+
+// Queuing delay on top of the base RTT that is treated as congestion
+#define RATE_CONTROL_MAX_QUEUING_DELAY   40
+
+// Receiver loss percentages below which the bitrate may increase and above
+// which it is decreased
+#define RATE_CONTROL_LOSS_LOW             2
+#define RATE_CONTROL_LOSS_HIGH           10
+
+// Number of intervals the base RTT is tracked before it is re-sampled
+#define RATE_CONTROL_BASE_RTT_WINDOW     20
+
+/*
+ * Loss and delay based congestion control for the video, loosely following
+ * the Google Congestion Control. The bitrate is increased slowly while the
+ * link is clean and decreased multiplicatively when the RTT grows above the
+ * base RTT, high priority messages need resending or the controller reports
+ * lost media. The goal is to back off the video before it starts delaying
+ * the control messages.
+ */
+class RateController : public QObject
+{
+  Q_OBJECT;
+
+ public:
+  RateController(void);
+  ~RateController(void);
+  void start(int maxBitrate);
+  void stop(void);
+  void setMaxBitrate(int maxBitrate);
+
+ public slots:
+  void updateRtt(int srttMs, int rttVarMs, int rtoMs);
+  void updateResentPackets(quint32 resendCounter);
+  void updateReceiverReport(int highestSeq, int lost, int lossPercent, double jitterMs, int bufferFill);
+
+ signals:
+  void bitrate(int bitrate);
+
+ private slots:
+  void evaluate(void);
+
+ private:
+  QTimer timer;
+  int maxBitrate;
+  int currentBitrate;
+
+  int srttMs;
+  int rttVarMs;
+  int baseRttMs;
+  int windowMinRttMs;
+  int windowIntervals;
+
+  quint32 resendCounter;
+  quint32 lastResendCounter;
+  int lossPercent;
+};
+
+#endif
@@ -25,8 +25,9 @@
  */
 
 #include "Slave.h"
-#include "Transmitter.h"
+#include "TransmitterThread.h"
 #include "VideoSender.h"
+#include "Log.h"
 
 #include <QCoreApplication>
 #include <QPluginLoader>
@@ -38,10 +39,22 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+// By default the video is paced to this many times the max bitrate of the
+// video quality, so that keyframes don't fill the WLAN driver queue
+#define MEDIA_PACING_FACTOR     3
+
+// Periodic values are batched and sent at this interval, or when this many
+// bytes are pending
+#define TELEMETRY_PERIOD_MS     250
+#define TELEMETRY_MAX_BYTES     256
+
+// System statistics are sampled at this interval
+#define SYSTEM_STATS_INTERVAL_MS 1000
+
 Slave::Slave(int &argc, char **argv):
   QCoreApplication(argc, argv), transmitter(NULL),
   vs(NULL), status(0), hardware(NULL), cb(NULL), camera(NULL),
-  oldSpeed(0), oldTurn(0)
+  rateController(NULL), sampler(), oldSpeed(0), oldTurn(0)
 {
 }
 
@@ -56,6 +69,12 @@ Slave::~Slave()
 	cb = NULL;
   }
 
+  // Delete the rate controller, if any
+  if (rateController) {
+	delete rateController;
+	rateController = NULL;
+  }
+
   // Delete the transmitter, if any
   if (transmitter) {
 	delete transmitter;
@@ -124,6 +143,8 @@ bool Slave::init(void)
 	camera->setBrightness(0);
   }
 
+  sampler.open();
+
   // Start a timer for sending ping to the control board
   QTimer *cbPingTimer = new QTimer();
   QObject::connect(cbPingTimer, SIGNAL(timeout()), this, SLOT(sendCBPing()));
@@ -143,8 +164,24 @@ void Slave::connect(QString host, quint16 port)
 	delete transmitter;
   }
 
-  // Create a new transmitter
-  transmitter = new Transmitter(host, port);
+  // Create a new transmitter, running in its own thread
+  transmitter = new TransmitterThread(host, port);
+
+  // Optionally pin the network thread to a CPU core and give it a real-time
+  // priority, so that video encoding doesn't delay ACKs and resends
+  char *netCpu = getenv("PLECO_NET_CPU");
+  if (netCpu) {
+	transmitter->setCpuAffinity(atoi(netCpu));
+  }
+
+  char *netPriority = getenv("PLECO_NET_RTPRIO");
+  if (netPriority) {
+	transmitter->setRealtimePriority(atoi(netPriority));
+  }
+
+  // The max datagram size, the video is packetized to fit in it
+  int mtu = Transmitter::configuredMTU();
+  transmitter->setMTU(mtu);
 
   // Connect the incoming data signals
   QObject::connect(transmitter, SIGNAL(value(quint8, quint16)), this, SLOT(updateValue(quint8, quint16)));
@@ -155,19 +192,65 @@ void Slave::connect(QString host, quint16 port)
   // Send ping every second (unless other high priority packet are sent)
   transmitter->enableAutoPing(true);
 
-  // Start timer for sending system statistics (wlan signal, cpu load) peridiocally
+  // Batch the telemetry. PLECO_TELEMETRY_PERIOD sets the period in ms, 0
+  // sends each value in its own message.
+  int telemetryPeriod = TELEMETRY_PERIOD_MS;
+  char *telemetry = getenv("PLECO_TELEMETRY_PERIOD");
+  if (telemetry) {
+	telemetryPeriod = atoi(telemetry);
+  }
+  transmitter->enableTelemetryBatching(telemetryPeriod, TELEMETRY_MAX_BYTES);
+
+  // Start timer for sending system statistics (wlan signal, cpu load)
+  // peridiocally. PLECO_STATS_INTERVAL sets the interval in ms.
+  int statsInterval = SYSTEM_STATS_INTERVAL_MS;
+  char *stats = getenv("PLECO_STATS_INTERVAL");
+  if (stats && atoi(stats) > 0) {
+	statsInterval = atoi(stats);
+  }
+
   QTimer *statsTimer = new QTimer();
   QObject::connect(statsTimer, SIGNAL(timeout()), this, SLOT(sendSystemStats()));
   statsTimer->setSingleShot(false);
-  statsTimer->start(1000);
+  statsTimer->start(statsInterval);
 
   // Create and enable sending video
   if (vs) {
 	delete vs;
   }
   vs = new VideoSender(hardware);
+  vs->setMTU(mtu);
+
+  // Keep the camera opened and the pipeline paused while the video is
+  // disabled, unless disabled with PLECO_VIDEO_STANDBY=0
+  char *videoStandby = getenv("PLECO_VIDEO_STANDBY");
+  if (!videoStandby || atoi(videoStandby) != 0) {
+	vs->setStandby(true);
+  }
 
-  QObject::connect(vs, SIGNAL(media(QByteArray*)), transmitter, SLOT(sendMedia(QByteArray*)));
+  QObject::connect(vs, SIGNAL(firstFrame(int)), this, SLOT(videoFirstFrame(int)));
+
+  // Media is queued directly from the GStreamer thread to the network thread
+  QObject::connect(vs, SIGNAL(media(MediaBuffer*)), transmitter, SLOT(sendMedia(MediaBuffer*)), Qt::DirectConnection);
+
+  // Adapt the video bitrate to the link, unless disabled with
+  // PLECO_RATE_CONTROL=0
+  if (rateController) {
+	delete rateController;
+	rateController = NULL;
+  }
+
+  char *rateControl = getenv("PLECO_RATE_CONTROL");
+  if (!rateControl || atoi(rateControl) != 0) {
+	rateController = new RateController();
+	QObject::connect(transmitter, SIGNAL(rttEstimate(int, int, int)), rateController, SLOT(updateRtt(int, int, int)));
+	QObject::connect(transmitter, SIGNAL(resentPackets(quint32)), rateController, SLOT(updateResentPackets(quint32)));
+	QObject::connect(transmitter, SIGNAL(receiverReport(int, int, int, double, int)),
+					 rateController, SLOT(updateReceiverReport(int, int, int, double, int)));
+	QObject::connect(rateController, SIGNAL(bitrate(int)), vs, SLOT(setBitrate(int)));
+  }
+
+  updateMediaPacing();
 
   QObject::connect(cb, SIGNAL(debug(QString*)), transmitter, SLOT(sendDebug(QString*)));
   QObject::connect(cb, SIGNAL(distance(quint16)), this, SLOT(cbDistance(quint16)));
@@ -180,76 +263,26 @@ void Slave::connect(QString host, quint16 port)
 
 void Slave::sendSystemStats(void)
 {
-  {
-	QFile file("/sys/class/net/wlan0/wireless/link");
-	if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-
-	  QByteArray line = file.readLine();
-	  uint link = line.trimmed().toUInt();
-	  // Link is 0-70, convert to 0-100%
-	  quint16 signal = (quint16)(link/70.0 * 100);
-
-	  transmitter->sendPeriodicValue(MSG_SUBTYPE_SIGNAL_STRENGTH, signal);
-	  file.close();
-	} else {
-	  QFile file("/proc/net/wireless");
-	  if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-
-		QString line = file.readLine();
-		line = file.readLine();
-		line = file.readLine();
-		quint16 signal = 0;
-		if (line.length() > 0) {
-		  QStringList list = line.split(" ", QString::SkipEmptyParts);
-		  list[3].chop(1);
-		  signal = (quint16)(list[3].toUInt());
-		}
-		transmitter->sendPeriodicValue(MSG_SUBTYPE_SIGNAL_STRENGTH, signal);
-		file.close();
-	  }
-	}
+  quint16 signal;
+  if (sampler.signalStrength(&signal)) {
+	transmitter->sendPeriodicValue(MSG_SUBTYPE_SIGNAL_STRENGTH, signal);
   }
 
-  {
-	QFile file("/proc/loadavg");
-	if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-
-	  QByteArray line = file.readLine();
-	  double loadavg = line.left(line.indexOf(" ")).toDouble();
-	  // Load avg is double, send as 100x integer
-	  quint16 signal = (quint16)(loadavg * 100);
-
-	  transmitter->sendPeriodicValue(MSG_SUBTYPE_CPU_USAGE, signal);
-	  file.close();
-	}
+  // Load avg is double, send as fixed point with two decimals
+  qint32 loadAvg;
+  if (sampler.loadAvg(&loadAvg)) {
+	transmitter->sendTypedValue(MSG_SUBTYPE_CPU_USAGE, MSG_VALUE_TAG(MSG_VALUE_TYPE_FIXED, 2), loadAvg);
   }
 
-  {
-	QFile file("/proc/uptime");
-	if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-
-	  QByteArray line = file.readLine();
-	  double uptime = line.left(line.indexOf(" ")).toDouble();
-	  // Uptime is seconds as double, send seconds as uint
-	  quint16 signal = (quint16)(uptime);
-
-	  transmitter->sendPeriodicValue(MSG_SUBTYPE_UPTIME, signal);
-	  file.close();
-	}
+  quint32 uptime;
+  if (sampler.uptime(&uptime)) {
+	transmitter->sendTypedValue(MSG_SUBTYPE_UPTIME, MSG_VALUE_TAG(MSG_VALUE_TYPE_U32, 0), uptime);
   }
 
-  {
-	QFile file("/sys/devices/virtual/hwmon/hwmon0/temp1_input");
-	if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-
-	  QByteArray line = file.readLine();
-	  uint mtemp = line.trimmed().toUInt();
-	  // Temperature is in millicelsius, convert to hundreds of celsius
-	  quint16 temp = (quint16)(mtemp / 10.0);
-
-	  transmitter->sendPeriodicValue(MSG_SUBTYPE_TEMPERATURE, temp);
-	  file.close();
-	}
+  // Temperature is in millicelsius, send as fixed point with three decimals
+  qint32 temp;
+  if (sampler.temperature(&temp)) {
+	transmitter->sendTypedValue(MSG_SUBTYPE_TEMPERATURE, MSG_VALUE_TAG(MSG_VALUE_TYPE_FIXED, 3), temp);
   }
 }
 
@@ -257,7 +290,7 @@ void Slave::sendSystemStats(void)
 
 void Slave::updateValue(quint8 type, quint16 value)
 {
-  qDebug() << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(type) << ", value:" << value;
+  logTrace(LOG_APP) << "in" << __FUNCTION__ << ", type:" << Message::getSubTypeStr(type) << ", value:" << value;
 
   switch (type) {
   case MSG_SUBTYPE_ENABLE_LED:
@@ -285,6 +318,13 @@ void Slave::updateValue(quint8 type, quint16 value)
   case MSG_SUBTYPE_VIDEO_QUALITY:
 	parseVideoQuality(value);
 	break;
+  case MSG_SUBTYPE_VIDEO_FEC:
+	// Parity count in the high byte, group size in the low byte
+	transmitter->setFec(value & 0x00ff, value >> 8);
+	break;
+  case MSG_SUBTYPE_REQUEST_KEYFRAME:
+	vs->forceKeyframe();
+	break;
   default:
     qWarning() << __FUNCTION__ << "Unknown type: " << Message::getSubTypeStr(type);
   }
@@ -301,14 +341,14 @@ void Slave::updateConnectionStatus(int status)
 	if (oldSpeed != 0) {
 	  cb->setPWMDuty(CB_PWM_SPEED, 750);
 	  cb->stopPWM(CB_PWM_SPEED);
-	  qDebug() << "in" << __FUNCTION__ << ", Speed PWM:" << 750;
+	  logTrace(LOG_APP) << "in" << __FUNCTION__ << ", Speed PWM:" << 750;
 	  oldSpeed = 0;
 	}
 
 	if (oldTurn != 0) {
 	  cb->setPWMDuty(CB_PWM_TURN, 750);
 	  cb->stopPWM(CB_PWM_TURN);
-	  qDebug() << "in" << __FUNCTION__ << ", Turn PWM:" << 750;
+	  logTrace(LOG_APP) << "in" << __FUNCTION__ << ", Turn PWM:" << 750;
 	  oldTurn = 0;
 	}
 
@@ -348,9 +388,28 @@ void Slave::cbVoltage(quint16 value)
 
 
 
+/*
+ * Reports the video start latency to the controller.
+ */
+void Slave::videoFirstFrame(int ms)
+{
+  transmitter->sendValue(MSG_SUBTYPE_VIDEO_FIRST_FRAME, (quint16)qMin(ms, 0xffff));
+}
+
+
+
 void Slave::parseSendVideo(quint16 value)
 {
   vs->enableSending(value ? true : false);
+
+  if (rateController) {
+	if (value) {
+	  rateController->start(vs->getBitrate());
+	} else {
+	  rateController->stop();
+	}
+  }
+
   // FIXME: what's the point of maintaining "status"? Better to ask from vs?
   if (value) {
 	status ^= STATUS_VIDEO_ENABLED;
@@ -364,6 +423,30 @@ void Slave::parseSendVideo(quint16 value)
 void Slave::parseVideoQuality(quint16 value)
 {
   vs->setVideoQuality(value);
+
+  if (rateController) {
+	rateController->setMaxBitrate(vs->getBitrate());
+  }
+
+  updateMediaPacing();
+}
+
+
+
+/*
+ * Sets the pacing rate of the video. PLECO_MEDIA_PACING overrides it in
+ * kbit/s, 0 disables the pacing.
+ */
+void Slave::updateMediaPacing(void)
+{
+  int rate = vs->getBitrate() * MEDIA_PACING_FACTOR;
+
+  char *pacing = getenv("PLECO_MEDIA_PACING");
+  if (pacing) {
+	rate = atoi(pacing);
+  }
+
+  transmitter->setMediaPacing(rate, TRANSMITTER_MEDIA_DEADLINE_MS);
 }
 
 
@@ -385,13 +468,13 @@ void Slave::parseCameraXY(quint16 value)
   // Update servo positions only if value has changed
   if (x != oldx) {
 	cb->setPWMDuty(CB_PWM_CAMERA_X, x);
-	qDebug() << "in" << __FUNCTION__ << ", Camera X PWM:" << x;
+	logTrace(LOG_APP) << "in" << __FUNCTION__ << ", Camera X PWM:" << x;
 	oldx = x;
   }
 
   if (y != oldy) {
 	cb->setPWMDuty(CB_PWM_CAMERA_Y, y);
-	qDebug() << "in" << __FUNCTION__ << ", Camera Y PWM:" << y;
+	logTrace(LOG_APP) << "in" << __FUNCTION__ << ", Camera Y PWM:" << y;
 	oldy = y;
   }
 }
@@ -427,7 +510,7 @@ void Slave::parseSpeedTurn(quint16 value)
 
 	  cb->setGPIO(CB_GPIO_REAR_LIGHTS, 1);
 	}
-	qDebug() << "in" << __FUNCTION__ << ", Speed PWM:" << speed;
+	logTrace(LOG_APP) << "in" << __FUNCTION__ << ", Speed PWM:" << speed;
 	oldSpeed = speed;
   }
 
@@ -438,11 +521,11 @@ void Slave::parseSpeedTurn(quint16 value)
 
 	// Reversing front and rear based on experiments
 	cb->setPWMDuty(CB_PWM_TURN, turn);
-	qDebug() << "in" << __FUNCTION__ << ", Turn PWM1:" << turn;
+	logTrace(LOG_APP) << "in" << __FUNCTION__ << ", Turn PWM1:" << turn;
 	oldTurn = turn;
 
 	cb->setPWMDuty(CB_PWM_TURN2, turn2);
-	qDebug() << "in" << __FUNCTION__ << ", Turn PWM2:" << turn2;
+	logTrace(LOG_APP) << "in" << __FUNCTION__ << ", Turn PWM2:" << turn2;
   }
 
 }
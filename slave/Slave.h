@@ -27,11 +27,13 @@
 #ifndef _SLAVE_H
 #define _SLAVE_H
 
-#include "Transmitter.h"
+#include "TransmitterThread.h"
 #include "Hardware.h"
 #include "VideoSender.h"
 #include "ControlBoard.h"
 #include "Camera.h"
+#include "RateController.h"
+#include "SystemSampler.h"
 
 #include <QCoreApplication>
 #include <QTimer>
@@ -56,19 +58,23 @@ class Slave : public QCoreApplication
   void cbVoltage(quint16 value);
   void sendCBPing(void);
   void turnOffRearLight(void);
+  void videoFirstFrame(int ms);
 
  private:
   void parseSendVideo(quint16 value);
   void parseCameraXY(quint16 value);
   void parseSpeedTurn(quint16 value);
   void parseVideoQuality(quint16 value);
+  void updateMediaPacing(void);
 
-  Transmitter *transmitter;
+  TransmitterThread *transmitter;
   VideoSender *vs;
   quint8 status;
   Hardware *hardware;
   ControlBoard *cb;
   Camera *camera;
+  RateController *rateController;
+  SystemSampler sampler;
   quint16 oldSpeed;
   quint16 oldTurn;
 };
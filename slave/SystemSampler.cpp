@@ -0,0 +1,334 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "SystemSampler.h"
+#include "Clock.h"
+#include "Log.h"
+
+#include <QDebug>
+
+#include <unistd.h>                          /* pread, close */
+#include <fcntl.h>                           /* open */
+#include <errno.h>
+#include <string.h>                          /* strerror */
+
+// Max value of the wireless link quality in sysfs
+#define SYSTEM_SAMPLER_MAX_LINK     70
+
+
+
+static const char *skipSpaces(const char *p)
+{
+  while (*p == ' ' || *p == '\t' || *p == '\n') {
+	p++;
+  }
+
+  return p;
+}
+
+
+
+static const char *skipToken(const char *p)
+{
+  p = skipSpaces(p);
+  while (*p && *p != ' ' && *p != '\t' && *p != '\n') {
+	p++;
+  }
+
+  return p;
+}
+
+
+
+/*
+ * Parses a signed decimal integer. Returns the position after it or NULL
+ * if there are no digits.
+ */
+static const char *parseInt(const char *p, qint64 *value)
+{
+  p = skipSpaces(p);
+
+  bool negative = (*p == '-');
+  if (negative) {
+	p++;
+  }
+
+  if (*p < '0' || *p > '9') {
+	return NULL;
+  }
+
+  qint64 v = 0;
+  while (*p >= '0' && *p <= '9') {
+	v = v * 10 + (*p++ - '0');
+  }
+
+  *value = negative ? -v : v;
+  return p;
+}
+
+
+
+/*
+ * Parses a decimal number, e.g. "0.52", to an integer with the given
+ * number of decimals. Extra decimals are truncated.
+ */
+static const char *parseFixed(const char *p, int decimals, qint64 *value)
+{
+  p = parseInt(p, value);
+  if (!p) {
+	return NULL;
+  }
+
+  bool negative = (*value < 0);
+  qint64 v = negative ? -*value : *value;
+
+  if (*p == '.') {
+	p++;
+  }
+
+  for (int i = 0; i < decimals; i++) {
+	v *= 10;
+	if (*p >= '0' && *p <= '9') {
+	  v += *p++ - '0';
+	}
+  }
+
+  while (*p >= '0' && *p <= '9') {
+	p++;
+  }
+
+  *value = negative ? -v : v;
+  return p;
+}
+
+
+
+SystemSampler::SystemSampler()
+{
+  static const char *paths[SOURCES] = {
+	"/sys/class/net/wlan0/wireless/link",
+	"/proc/net/wireless",
+	"/proc/loadavg",
+	"/proc/uptime",
+	"/sys/devices/virtual/hwmon/hwmon0/temp1_input",
+  };
+
+  for (int i = 0; i < SOURCES; i++) {
+	sources[i].path = paths[i];
+	sources[i].fd = -1;
+	sources[i].retryUs = 0;
+	sources[i].failing = false;
+	sources[i].reported = false;
+  }
+}
+
+
+
+SystemSampler::~SystemSampler()
+{
+  close();
+}
+
+
+
+/*
+ * Opens the files that exist on this system. The rest are retried when
+ * sampled.
+ */
+void SystemSampler::open(void)
+{
+  close();
+
+  for (int i = 0; i < SOURCES; i++) {
+	openSource(&sources[i]);
+  }
+}
+
+
+
+void SystemSampler::close(void)
+{
+  for (int i = 0; i < SOURCES; i++) {
+	closeSource(&sources[i]);
+	sources[i].retryUs = 0;
+	sources[i].failing = false;
+	sources[i].reported = false;
+  }
+}
+
+
+
+bool SystemSampler::openSource(Source *source)
+{
+  source->fd = ::open(source->path, O_RDONLY | O_CLOEXEC);
+  if (source->fd == -1) {
+	if (!source->reported) {
+	  logDebug(LOG_APP) << __FUNCTION__ << ": Not sampling" << source->path << ":" << strerror(errno);
+	  source->reported = true;
+	}
+	source->failing = true;
+	source->retryUs = monotonicUs() + SYSTEM_SAMPLER_RETRY_MS * 1000;
+	return false;
+  }
+
+  return true;
+}
+
+
+
+void SystemSampler::closeSource(Source *source)
+{
+  if (source->fd >= 0) {
+	::close(source->fd);
+	source->fd = -1;
+  }
+}
+
+
+
+/*
+ * Re-reads the file from the start into the buffer and terminates it. A
+ * failed file is closed and reopened once the retry time has passed. The
+ * first failure of each file is logged. Returns the length or -1 on failure.
+ */
+int SystemSampler::readSource(int index)
+{
+  Source *source = &sources[index];
+
+  if (source->fd == -1) {
+	if (monotonicUs() < source->retryUs || !openSource(source)) {
+	  return -1;
+	}
+  }
+
+  ssize_t len = pread(source->fd, buffer, sizeof(buffer) - 1, 0);
+  if (len == -1) {
+	if (!source->reported) {
+	  logDebug(LOG_APP) << __FUNCTION__ << ": Failed to read" << source->path << ":" << strerror(errno);
+	  source->reported = true;
+	}
+	source->failing = true;
+	closeSource(source);
+	source->retryUs = monotonicUs() + SYSTEM_SAMPLER_RETRY_MS * 1000;
+	return -1;
+  }
+
+  if (source->failing) {
+	logTrace(LOG_APP) << __FUNCTION__ << ": Sampling" << source->path << "again";
+	source->failing = false;
+  }
+
+  buffer[len] = '\0';
+  return len;
+}
+
+
+
+/*
+ * Returns the WLAN signal strength. From sysfs the link quality in
+ * percents, from /proc/net/wireless the signal level of the first
+ * interface (0 if there is none), if sysfs can't be read.
+ */
+bool SystemSampler::signalStrength(quint16 *percent)
+{
+  qint64 value = 0;
+
+  if (readSource(SOURCE_LINK) != -1 && parseInt(buffer, &value)) {
+	*percent = (quint16)(value * 100 / SYSTEM_SAMPLER_MAX_LINK);
+	return true;
+  }
+
+  if (readSource(SOURCE_WIRELESS) == -1) {
+	return false;
+  }
+
+  // Skip the two header lines
+  const char *p = buffer;
+  for (int i = 0; i < 2 && p; i++) {
+	p = strchr(p, '\n');
+	if (p) {
+	  p++;
+	}
+  }
+
+  *percent = 0;
+  if (p && *p) {
+	// Interface, status and link quality precede the level
+	for (int i = 0; i < 3; i++) {
+	  p = skipToken(p);
+	}
+	if (parseInt(p, &value) && value > 0) {
+	  *percent = (quint16)value;
+	}
+  }
+
+  return true;
+}
+
+
+
+/*
+ * Returns the 1 minute load average times 100.
+ */
+bool SystemSampler::loadAvg(qint32 *centiLoad)
+{
+  qint64 value;
+
+  if (readSource(SOURCE_LOADAVG) == -1 || !parseFixed(buffer, 2, &value)) {
+	return false;
+  }
+
+  *centiLoad = (qint32)value;
+  return true;
+}
+
+
+
+bool SystemSampler::uptime(quint32 *seconds)
+{
+  qint64 value;
+
+  if (readSource(SOURCE_UPTIME) == -1 || !parseInt(buffer, &value)) {
+	return false;
+  }
+
+  *seconds = (quint32)value;
+  return true;
+}
+
+
+
+bool SystemSampler::temperature(qint32 *milliCelsius)
+{
+  qint64 value;
+
+  if (readSource(SOURCE_TEMPERATURE) == -1 || !parseInt(buffer, &value)) {
+	return false;
+  }
+
+  *milliCelsius = (qint32)value;
+  return true;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2015 Tuomas Kulve, <tuomas.kulve@snowcap.fi>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _SYSTEMSAMPLER_H
+#define _SYSTEMSAMPLER_H
+
+#include <QtGlobal>
+
+// Size of the read buffer, enough for the first lines of /proc/net/wireless
+#define SYSTEM_SAMPLER_BUFFER_SIZE  512
+
+// A file that fails to read is reopened at most this often, e.g. when the
+// WLAN interface comes back
+#define SYSTEM_SAMPLER_RETRY_MS     1000
+
+/*
+ * Samples the system statistics from /proc and /sys. The files are kept
+ * open and re-read from the start with pread() into a fixed buffer and
+ * parsed in place, so sampling doesn't allocate and is cheap enough to be
+ * done tens of times per second. A file that fails is closed and reopened
+ * later.
+ */
+class SystemSampler
+{
+ public:
+  SystemSampler();
+  ~SystemSampler();
+  void open(void);
+  void close(void);
+
+  bool signalStrength(quint16 *percent);
+  bool loadAvg(qint32 *centiLoad);
+  bool uptime(quint32 *seconds);
+  bool temperature(qint32 *milliCelsius);
+
+ private:
+  enum {
+	SOURCE_LINK,
+	SOURCE_WIRELESS,
+	SOURCE_LOADAVG,
+	SOURCE_UPTIME,
+	SOURCE_TEMPERATURE,
+	SOURCES
+  };
+
+  struct Source {
+	const char *path;
+	int fd;
+	qint64 retryUs;      // Earliest time to reopen a failed file
+	bool failing;        // The last open or read failed
+	bool reported;       // A failure has been logged
+  };
+
+  bool openSource(Source *source);
+  void closeSource(Source *source);
+  int readSource(int index);
+
+  Source sources[SOURCES];
+  char buffer[SYSTEM_SAMPLER_BUFFER_SIZE];
+};
+
+#endif
@@ -1,4 +1,7 @@
 #include "VideoSender.h"
+#include "Transmitter.h"
+#include "Log.h"
+#include "Clock.h"
 
 #include <QObject>
 #include <QDebug>
@@ -10,9 +13,15 @@
 // High quality: 1024kbps, low quality: 256kbps
 static const int video_quality_bitrate[] = {256, 1024, 2048};
 
+// Keyframes are forced at most this often, so that a loss storm doesn't
+// turn every frame into a keyframe
+#define KEYFRAME_MIN_INTERVAL_MS 500
+
 VideoSender::VideoSender(Hardware *hardware):
   QObject(), pipeline(NULL), videoSource("v4l2src"), hardware(hardware),
-  encoder(NULL), bitrate(video_quality_bitrate[0]), quality(0)
+  encoder(NULL), capsfilter(NULL), valve(NULL), mtu(TRANSMITTER_MTU_DEFAULT), bitrate(video_quality_bitrate[0]), quality(0), sourceQuality(0), keyframeTime(),
+  keyframeOnPlaying(false), busWatch(0),
+  sending(false), standby(false), firstFrameTimer(), firstFramePending(0)
 {
 
 #ifndef GLIB_VERSION_2_32
@@ -31,16 +40,7 @@ VideoSender::~VideoSender()
 { 
 
   // Clean up
-  qDebug() << "Stopping video encoding";
-  if (pipeline) {
-	gst_element_set_state(pipeline, GST_STATE_NULL);
-  }
-
-  qDebug() << "Deleting pipeline";
-  if (pipeline) {
-	gst_object_unref(GST_OBJECT(pipeline));
-	pipeline = NULL;
-  }
+  destroyPipeline();
 
 }
 
@@ -48,34 +48,88 @@ VideoSender::~VideoSender()
 
 bool VideoSender::enableSending(bool enable)
 {
-  GstElement *sink;
-  GError *error = NULL;
-
   qDebug() << "In" << __FUNCTION__ << ", Enable:" << enable;
 
   // Disable video sending
   if (enable == false) {
-	qDebug() << "Stopping video encoding";
-	if (pipeline) {
-	  gst_element_set_state(pipeline, GST_STATE_NULL);
+	sending = false;
+
+	// Keep the pipeline with the camera opened, if in standby mode
+	if (standby && pipeline) {
+	  qDebug() << "Pausing video encoding";
+	  g_object_set(G_OBJECT(valve), "drop", true, NULL);
+	  gst_element_set_state(pipeline, GST_STATE_PAUSED);
+	  return true;
 	}
 
-	qDebug() << "Deleting pipeline";
-	if (pipeline) {
-	  gst_object_unref(GST_OBJECT(pipeline));
-	  pipeline = NULL;
-	}
-	encoder = NULL;
+	destroyPipeline();
 	return true;
   }
 
-  if (pipeline) {
-	// Do nothing as the pipeline has already been created and is
-	// probably running
+  if (sending) {
+	// Do nothing as the pipeline is already running
 	qCritical("Pipeline exists already, doing nothing");
 	return true;
   }
 
+  firstFrameTimer.start();
+  firstFramePending.fetchAndStoreOrdered(1);
+
+  if (!pipeline && !createPipeline()) {
+	firstFramePending.fetchAndStoreOrdered(0);
+	destroyPipeline();
+	return false;
+  }
+
+  sending = true;
+
+  // The decoder needs a keyframe to start with, also when resuming a paused
+  // encoder. It's requested once the pipeline is playing (see busCall()).
+  g_object_set(G_OBJECT(valve), "drop", false, NULL);
+  keyframeOnPlaying = true;
+
+  // Start running
+  gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_PLAYING);
+
+  return true;
+}
+
+
+
+/*
+ * Keeps the video pipeline created and paused, with the camera opened, while
+ * the video is disabled. Enabling the video then only starts the pipeline.
+ */
+void VideoSender::setStandby(bool enable)
+{
+  qDebug() << "In" << __FUNCTION__ << ", Enable:" << enable;
+
+  standby = enable;
+
+  if (sending) {
+	return;
+  }
+
+  if (standby && !pipeline) {
+	if (!createPipeline()) {
+	  destroyPipeline();
+	}
+  } else if (!standby && pipeline) {
+	destroyPipeline();
+  }
+}
+
+
+
+/*
+ * Creates the video pipeline and leaves it in PAUSED state with the valve
+ * closed.
+ */
+bool VideoSender::createPipeline(void)
+{
+  GstElement *sink;
+  GError *error = NULL;
+
   // Initialisation. We don't pass command line arguments here
   if (!gst_init_check(NULL, NULL, NULL)) {
 	qCritical("Failed to init GST");
@@ -90,27 +144,29 @@ bool VideoSender::enableSending(bool enable)
   QString pipelineString = "";
   pipelineString.append(videoSource + " name=source");
   pipelineString.append(" ! ");
-  switch(quality) {
-  default:
-  case 0:
-	pipelineString.append("capsfilter caps=\"video/x-raw-yuv,width=(int)320,height=(int)240,framerate=(fraction)30/1\"");
-	break;
-  case 1:
-	pipelineString.append("capsfilter caps=\"video/x-raw-yuv,width=(int)640,height=(int)480,framerate=(fraction)30/1\"");
-	break;
-  case 2:
-	pipelineString.append("capsfilter caps=\"video/x-raw-yuv,width=(int)800,height=(int)600,framerate=(fraction)30/1\"");
-	break;
-  }
+  // The source negotiates the mode of the current quality through the (then
+  // passthrough) videoscale and videorate. They scale the video down if a
+  // lower quality is selected later, as the source can't change its mode
+  // while streaming.
+  pipelineString.append("videoscale ! videorate");
+  pipelineString.append(" ! ");
+  pipelineString.append("capsfilter name=capsfilter caps=\"" + getVideoCaps() + "\"");
+  pipelineString.append(" ! ");
+  // Closed while paused, so that no stale frames are encoded on resume
+  pipelineString.append("valve name=valve drop=true");
   pipelineString.append(" ! ");
   pipelineString.append(hardware->getEncodingPipeline());
   pipelineString.append(" ! ");
-  pipelineString.append("rtph264pay name=rtppay config-interval=1");
+  // Make RTP packets fit in a single media datagram to avoid fragmentation
+  pipelineString.append("rtph264pay name=rtppay config-interval=1 mtu=" +
+						QString::number(mtu - TYPE_OFFSET_MEDIA_PAYLOAD));
   pipelineString.append(" ! ");
   pipelineString.append("appsink name=sink sync=false max-buffers=1 drop=true");
 
   qDebug() << "Using pipeline:" << pipelineString;
 
+  sourceQuality = quality;
+
   // Create encoding video pipeline
   pipeline = gst_parse_launch(pipelineString.toUtf8(), &error);
   if (!pipeline) {
@@ -119,6 +175,18 @@ bool VideoSender::enableSending(bool enable)
     return false;
   }
 
+  valve = gst_bin_get_by_name(GST_BIN(pipeline), "valve");
+  if (!valve) {
+	qCritical("Failed to get valve");
+	return false;
+  }
+
+  capsfilter = gst_bin_get_by_name(GST_BIN(pipeline), "capsfilter");
+  if (!capsfilter) {
+	qCritical("Failed to get capsfilter");
+	return false;
+  }
+
   encoder = gst_bin_get_by_name(GST_BIN(pipeline), "encoder");
   if (!encoder) {
 	qCritical("Failed to get encoder");
@@ -156,6 +224,8 @@ bool VideoSender::enableSending(bool enable)
 	} else if (videoSource == "v4l2src") {
 	  //g_object_set(G_OBJECT(source), "always-copy", false, NULL);
 	}
+
+	gst_object_unref(source);
   }
 
 
@@ -178,18 +248,60 @@ bool VideoSender::enableSending(bool enable)
   appSinkCallbacks.new_buffer_list = NULL;
 
   gst_app_sink_set_callbacks(GST_APP_SINK(sink), &appSinkCallbacks, this, NULL);
+  gst_object_unref(sink);
 
-  // Start running 
-  gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_PLAYING);
+  // Watch for the state changes
+  GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+  busWatch = gst_bus_add_watch(bus, busCall, this);
+  gst_object_unref(bus);
+
+  // Open the camera and allocate the buffers, but don't start capturing yet
+  gst_element_set_state(GST_ELEMENT(pipeline), GST_STATE_PAUSED);
 
   return true;
 }
 
 
 
-void VideoSender::emitMedia(QByteArray *data)
+void VideoSender::destroyPipeline(void)
 {
-  qDebug() << "In" << __FUNCTION__;
+  qDebug() << "Stopping video encoding";
+  if (pipeline) {
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+  }
+
+  if (busWatch) {
+	g_source_remove(busWatch);
+	busWatch = 0;
+  }
+  keyframeOnPlaying = false;
+
+  // Release the references from gst_bin_get_by_name()
+  if (encoder) {
+	gst_object_unref(encoder);
+	encoder = NULL;
+  }
+  if (capsfilter) {
+	gst_object_unref(capsfilter);
+	capsfilter = NULL;
+  }
+  if (valve) {
+	gst_object_unref(valve);
+	valve = NULL;
+  }
+
+  qDebug() << "Deleting pipeline";
+  if (pipeline) {
+	gst_object_unref(GST_OBJECT(pipeline));
+	pipeline = NULL;
+  }
+}
+
+
+
+void VideoSender::emitMedia(MediaBuffer *data)
+{
+  logTrace(LOG_VIDEO) << "In" << __FUNCTION__;
 
   emit(media(data));
 
@@ -199,7 +311,7 @@ void VideoSender::emitMedia(QByteArray *data)
 
 GstFlowReturn VideoSender::newBufferCB(GstAppSink *sink, gpointer user_data)
 {
-  qDebug() << "In" << __FUNCTION__;
+  logTrace(LOG_VIDEO) << "In" << __FUNCTION__;
 
   VideoSender *vs = static_cast<VideoSender *>(user_data);
 
@@ -210,11 +322,35 @@ GstFlowReturn VideoSender::newBufferCB(GstAppSink *sink, gpointer user_data)
 	qWarning("%s: Failed to get new buffer", __FUNCTION__);
 	return GST_FLOW_OK;
   }
+
+  // Time from enabling the video to the first encoded frame
+  if (vs->firstFramePending.testAndSetOrdered(1, 0)) {
+	int ms = (int)vs->firstFrameTimer.elapsed();
+	logInfo(LOG_VIDEO) << "Time to first frame:" << ms << "ms";
+	emit(vs->firstFrame(ms));
+  }
   
-  // Copy the data to QBytArray
-  // FIXME: zero copy?
-  QByteArray *data = new QByteArray((char *)(buffer->data), (int)(buffer->size));
-  gst_buffer_unref(buffer);
+  // Hand the buffer over without copying. It is unreffed once the
+  // Transmitter has written the data.
+  MediaBuffer *data = new MediaBuffer((char *)GST_BUFFER_DATA(buffer), (int)GST_BUFFER_SIZE(buffer),
+									  &VideoSender::releaseBuffer, buffer);
+
+  // The buffer carries the capture time (do-timestamp) as running time of
+  // the pipeline clock. Convert it to our clock through its age.
+  qint64 encodeUs = monotonicUs();
+  qint64 captureUs = 0;
+  GstClock *clock = gst_element_get_clock(GST_ELEMENT(sink));
+  if (clock) {
+	if (GST_BUFFER_TIMESTAMP_IS_VALID(buffer)) {
+	  GstClockTime capture = GST_BUFFER_TIMESTAMP(buffer) + gst_element_get_base_time(GST_ELEMENT(sink));
+	  GstClockTime now = gst_clock_get_time(clock);
+	  if (now >= capture) {
+		captureUs = encodeUs - (qint64)((now - capture) / GST_USECOND);
+	  }
+	}
+	gst_object_unref(clock);
+  }
+  data->setTimestamps(captureUs, encodeUs);
 
   vs->emitMedia(data);
 
@@ -223,6 +359,17 @@ GstFlowReturn VideoSender::newBufferCB(GstAppSink *sink, gpointer user_data)
 
 
 
+/*
+ * Called by the MediaBuffer (in the network thread) when it is no longer
+ * used.
+ */
+void VideoSender::releaseBuffer(void *buffer)
+{
+  gst_buffer_unref(GST_BUFFER(buffer));
+}
+
+
+
 void VideoSender::setVideoSource(int index)
 {
   switch (index) {
@@ -234,8 +381,17 @@ void VideoSender::setVideoSource(int index)
 	break;
   default:
 	qWarning("%s: Unknown video source index: %d", __FUNCTION__, index);
+	return;
   }
 
+  // Recreate the standby pipeline with the new source. A running pipeline
+  // uses it after the video has been disabled.
+  if (standby && pipeline && !sending) {
+	destroyPipeline();
+	if (!createPipeline()) {
+	  destroyPipeline();
+	}
+  }
 }
 
 
@@ -265,9 +421,10 @@ void VideoSender::setBitrate(int bitrate)
 
 void VideoSender::setVideoQuality(quint16 q)
 {
+  bool changed = (q != quality);
   quality = q;
 
-  if (quality < sizeof(video_quality_bitrate)) {
+  if (quality < sizeof(video_quality_bitrate) / sizeof(video_quality_bitrate[0])) {
 	bitrate = video_quality_bitrate[quality];
   } else {
 	qWarning("%s: Unknown quality: %d", __FUNCTION__, quality);
@@ -275,4 +432,139 @@ void VideoSender::setVideoQuality(quint16 q)
   }
 
   setBitrate(bitrate);
+
+  if (!pipeline || !changed) {
+	return;
+  }
+
+  // Scaling up would only add bitrate, not detail. The source mode can't be
+  // changed while streaming, so the pipeline is recreated for a higher
+  // quality, or if the encoder can't take new caps while playing.
+  if (quality > sourceQuality || !hardware->encoderRenegotiates()) {
+	qDebug() << "In" << __FUNCTION__ << ", recreating pipeline for quality" << quality;
+
+	bool wasSending = sending;
+	sending = false;
+	destroyPipeline();
+
+	if (wasSending) {
+	  enableSending(true);
+	} else if (standby && !createPipeline()) {
+	  destroyPipeline();
+	}
+	return;
+  }
+
+  // Scale down the video of a running pipeline in place
+  QString capsString = getVideoCaps();
+  qDebug() << "In" << __FUNCTION__ << ", changing caps to" << capsString;
+
+  GstCaps *caps = gst_caps_from_string(capsString.toUtf8());
+  g_object_set(G_OBJECT(capsfilter), "caps", caps, NULL);
+  gst_caps_unref(caps);
+}
+
+
+
+/*
+ * Sets the max datagram size of the transmitter. The RTP packets are sized
+ * to fit in a single media datagram. Takes effect when the pipeline is
+ * created.
+ */
+void VideoSender::setMTU(int newMtu)
+{
+  mtu = newMtu;
+}
+
+
+
+QString VideoSender::getVideoCaps(void)
+{
+  switch(quality) {
+  default:
+  case 0:
+	return "video/x-raw-yuv,width=(int)320,height=(int)240,framerate=(fraction)30/1";
+  case 1:
+	return "video/x-raw-yuv,width=(int)640,height=(int)480,framerate=(fraction)30/1";
+  case 2:
+	return "video/x-raw-yuv,width=(int)800,height=(int)600,framerate=(fraction)30/1";
+  }
+}
+
+
+
+/*
+ * Returns the bitrate of the current video quality, i.e. the upper limit
+ * for the rate control.
+ */
+int VideoSender::getBitrate(void)
+{
+  return bitrate;
+}
+
+
+
+/*
+ * Called in the main thread for the messages of the pipeline. The keyframe
+ * for enabling the video is requested once the pipeline is playing.
+ */
+gboolean VideoSender::busCall(GstBus *, GstMessage *message, gpointer data)
+{
+  VideoSender *vs = static_cast<VideoSender *>(data);
+
+  if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_STATE_CHANGED &&
+	  GST_MESSAGE_SRC(message) == GST_OBJECT(vs->pipeline)) {
+	GstState state;
+	gst_message_parse_state_changed(message, NULL, &state, NULL);
+
+	if (state == GST_STATE_PLAYING && vs->keyframeOnPlaying) {
+	  vs->keyframeOnPlaying = false;
+	  vs->forceKeyframe(true);
+	}
+  }
+
+  return true;
+}
+
+
+
+/*
+ * Asks the encoder to produce a keyframe (IDR) with the SPS/PPS headers as
+ * soon as possible, e.g. after the receiver has lost video. Requests are
+ * rate limited, unless forced.
+ */
+void VideoSender::forceKeyframe(bool force)
+{
+  if (!encoder) {
+	return;
+  }
+
+  if (!force && !keyframeTime.isNull() && keyframeTime.elapsed() < KEYFRAME_MIN_INTERVAL_MS) {
+	logDebug(LOG_VIDEO) << "In" << __FUNCTION__ << ", keyframe forced recently, ignoring";
+	return;
+  }
+
+  keyframeTime.start();
+
+  qDebug() << "In" << __FUNCTION__;
+
+  // Same as gst_video_event_new_downstream_force_key_unit(), without
+  // depending on gstreamer-video
+  GstStructure *s = gst_structure_new("GstForceKeyUnit",
+									  "all-headers", G_TYPE_BOOLEAN, TRUE,
+									  "count", G_TYPE_UINT, 0,
+									  NULL);
+  GstEvent *event = gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM, s);
+
+  GstPad *pad = gst_element_get_static_pad(encoder, "sink");
+  if (!pad) {
+	qWarning("%s: Failed to get encoder sink pad", __FUNCTION__);
+	gst_event_unref(event);
+	return;
+  }
+
+  if (!gst_pad_send_event(pad, event)) {
+	qWarning("%s: Encoder didn't handle the keyframe request", __FUNCTION__);
+  }
+  gst_object_unref(pad);
 }
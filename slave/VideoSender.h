@@ -2,8 +2,12 @@
 #define _VIDEOSENDER_H
 
 #include "Hardware.h"
+#include "MediaBuffer.h"
 
 #include <QObject>
+#include <QTime>
+#include <QElapsedTimer>
+#include <QAtomicInt>
 
 #include <gst/gst.h>
 #include <gst/app/gstappsink.h>
@@ -17,16 +21,28 @@ class VideoSender : public QObject
   VideoSender(Hardware *hardware);
   ~VideoSender();
   bool enableSending(bool enable);
+  void setStandby(bool enable);
   void setVideoSource(int index);
   void setVideoQuality(quint16 quality);
+  void setMTU(int mtu);
+  int getBitrate(void);
+  void forceKeyframe(bool force = false);
+
+ public slots:
+  void setBitrate(int bitrate);
 
  signals:
-  void media(QByteArray *media);
+  void media(MediaBuffer *media);
+  void firstFrame(int ms);
 
  private:
-  void setBitrate(int bitrate);
-  void emitMedia(QByteArray *data);
+  bool createPipeline(void);
+  void destroyPipeline(void);
+  QString getVideoCaps(void);
+  void emitMedia(MediaBuffer *data);
   static GstFlowReturn newBufferCB(GstAppSink *sink, gpointer user_data);
+  static void releaseBuffer(void *buffer);
+  static gboolean busCall(GstBus *bus, GstMessage *message, gpointer data);
 
   GstElement *pipeline;
   QString videoSource;
@@ -34,9 +50,25 @@ class VideoSender : public QObject
   Hardware *hardware;
 
   GstElement *encoder;
+  GstElement *capsfilter;
+  GstElement *valve;
 
+  int mtu;
   int bitrate;
   quint16 quality;
+  quint16 sourceQuality;
+
+  QTime keyframeTime;
+  bool keyframeOnPlaying;
+  guint busWatch;
+
+  bool sending;
+  bool standby;
+
+  // Time to first frame is measured from enabling the video to the first
+  // encoded buffer in the appsink
+  QElapsedTimer firstFrameTimer;
+  QAtomicInt firstFramePending;
 };
 
 #endif
@@ -17,12 +17,16 @@ SOURCES += ControlBoard.cpp
 SOURCES += main.cpp
 SOURCES += Hardware.cpp
 SOURCES += Camera.cpp
+SOURCES += RateController.cpp
+SOURCES += SystemSampler.cpp
 
 HEADERS += Slave.h
 HEADERS += VideoSender.h
 HEADERS += ControlBoard.h
 HEADERS += Hardware.h
 HEADERS += Camera.h
+HEADERS += RateController.h
+HEADERS += SystemSampler.h
 
 TARGET = slave
 INSTALLS += target